@@ -0,0 +1,394 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "cache.h"
+#include "rpmcache.h"
+
+// rpmcache-bench: put and then get a synthetic corpus of rpm header-like
+// values through cache_put/get, bsm_put/get, or rpmcache_put/get (which
+// covers memcached and redis via RPMCACHE_CONFIG).  Each phase runs in
+// fresh processes and prints a JSON line with the throughput and the
+// latency percentiles.  The throughput is computed over the time spent
+// in the calls by the slowest process, so that the corpus generation
+// does not count.
+
+// The backend under test.
+enum { B_CACHE, B_BSM, B_RPMCACHE } backend;
+static const char *backend_name;
+static const char *target;	// directory or cache name
+
+static int nent = 10000;
+static double median = 24 << 10, sigma = 1.0;
+static int maxsize = 4 << 20;
+static int nproc = 1;
+static int rounds = 1;
+static bool cold;
+static unsigned seed = 1;
+static FILE *out;
+
+// Shared among the processes: per-op latency in nanoseconds,
+// per-process busy time, and hit counters.
+struct shared {
+    unsigned long hits;
+    uint64_t busy[];
+};
+static struct shared *shared;
+static uint64_t *lat;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// The synthetic corpus is a function of the entry number, so that each
+// process can generate its share on the fly.
+
+static const char *words[] = {
+    "lib", "perl", "python3", "module", "x11", "font", "gtk", "qt5", "devel",
+    "utils", "common", "data", "doc", "tools", "core", "plugin", "xml", "ssl",
+    "kernel", "firmware", "image", "sound", "net", "gnome", "kde", "rust",
+};
+#define NWORDS (sizeof words / sizeof *words)
+
+static const char *dirs[] = {
+    "/usr/bin/", "/usr/lib64/", "/usr/share/doc/", "/usr/share/man/man1/",
+    "/usr/include/", "/usr/share/locale/ru/LC_MESSAGES/", "/etc/",
+    "/usr/lib/python3/site-packages/", "/usr/share/perl5/",
+};
+#define NDIRS (sizeof dirs / sizeof *dirs)
+
+static int entsize(unsigned i)
+{
+    // lognormal, via Box-Muller
+    unsigned r = seed * 2654435761U + i;
+    double u1 = (rand_r(&r) + 1.0) / (RAND_MAX + 2.0);
+    double u2 = (rand_r(&r) + 1.0) / (RAND_MAX + 2.0);
+    double z = sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+    double size = median * exp(sigma * z);
+    if (size < 64)
+	size = 64;
+    if (size > maxsize)
+	size = maxsize;
+    return size;
+}
+
+static void entname(unsigned i, struct rpmkey *key, char *fname, unsigned *fsize, unsigned *mtime)
+{
+    unsigned r = seed * 40503U + i;
+    const char *w1 = words[rand_r(&r) % NWORDS];
+    const char *w2 = words[rand_r(&r) % NWORDS];
+    sprintf(fname, "%s-%s%u-%u.%u.%u-alt%u.x86_64.rpm", w1, w2, i,
+	    rand_r(&r) % 10, rand_r(&r) % 30, rand_r(&r) % 100, rand_r(&r) % 5 + 1);
+    *fsize = entsize(i) * 3 + rand_r(&r) % 4096;
+    *mtime = 1500000000 + i;
+    if (!rpmcache_key(fname, *fsize, *mtime, key)) {
+	fprintf(stderr, "%s: %s: bad name\n", program_invocation_short_name, fname);
+	exit(1);
+    }
+}
+
+// Like an unloaded rpm header: the index of 16-byte big-endian entries,
+// followed by the store of file names, hex digests, and integer arrays.
+static void entdata(unsigned i, char *buf, int size)
+{
+    unsigned r = seed * 69069U + i;
+    int il = size / 256 + 1;
+    uint32_t *p = (uint32_t *) buf;
+    int n = size / 4;
+    int k = 0;
+    if (n > 2) {
+	p[k++] = htobe32(il);
+	p[k++] = htobe32(size - 8 - 16 * il);
+    }
+    for (int j = 0; j < il && k + 4 <= n; j++) {
+	p[k++] = htobe32(1000 + j);
+	p[k++] = htobe32(j % 3 ? 8 : 4);
+	p[k++] = htobe32(j * 64);
+	p[k++] = htobe32(rand_r(&r) % 50 + 1);
+    }
+    char *s = (char *) (p + k);
+    char *end = buf + size;
+    while (s < end) {
+	char tmp[256];
+	int len;
+	switch (rand_r(&r) % 8) {
+	case 0: case 1:
+	    // hex digest
+	    len = 0;
+	    for (int j = 0; j < 32; j++)
+		tmp[len++] = "0123456789abcdef"[rand_r(&r) % 16];
+	    tmp[len++] = '\0';
+	    break;
+	case 2:
+	    // integers: sizes, modes, mtimes
+	    for (len = 0; len < 32; len += 4) {
+		uint32_t v = htobe32(rand_r(&r) % 3 ? 0100644 : 1500000000 + rand_r(&r) % 100000);
+		memcpy(tmp + len, &v, 4);
+	    }
+	    break;
+	default:
+	    len = snprintf(tmp, sizeof tmp, "%s%s-%s/%s%u.%s",
+		    dirs[rand_r(&r) % NDIRS], words[i % NWORDS], words[(i / NWORDS) % NWORDS],
+		    words[rand_r(&r) % NWORDS], rand_r(&r) % 100,
+		    rand_r(&r) % 2 ? "so" : "html") + 1;
+	}
+	if (len > end - s)
+	    len = end - s;
+	memcpy(s, tmp, len);
+	s += len;
+    }
+}
+
+// Open the backend in a worker process.
+static void *bopen(void)
+{
+    void *db = backend == B_RPMCACHE ? (void *) rpmcache_open(target) : (void *) cache_open(target);
+    if (db == NULL)
+	exit(1);	// warning issued by the library
+    return db;
+}
+
+static void bclose(void *db)
+{
+    if (backend == B_RPMCACHE)
+	rpmcache_close(db);
+    else
+	cache_close(db);
+}
+
+// Run one phase in a worker process: entries k, k + nproc, ...
+static void work(int k, bool put, int startfd)
+{
+    void *db = bopen();
+    char *buf = malloc(maxsize);
+    if (buf == NULL)
+	exit(1);
+    // wait until all the workers are ready
+    char c;
+    while (read(startfd, &c, 1) < 0 && errno == EINTR)
+	;
+    uint64_t busy = 0;
+    unsigned long hits = 0;
+    for (int i = k; i < nent; i += nproc) {
+	struct rpmkey key;
+	char fname[NAME_MAX + 1];
+	unsigned fsize, mtime;
+	entname(i, &key, fname, &fsize, &mtime);
+	int size = entsize(i);
+	if (put)
+	    entdata(i, buf, size);
+	void *val = NULL;
+	int valsize;
+	bool hit = false;
+	uint64_t t0 = now_ns();
+	switch (backend) {
+	case B_CACHE:
+	    if (put)
+		cache_put(db, key.str, key.len, buf, size);
+	    else
+		hit = cache_get(db, key.str, key.len, &val, &valsize);
+	    break;
+	case B_BSM:
+	    if (put)
+		bsm_put(db, fname, ".rpm", fsize, mtime, buf, size);
+	    else
+		hit = bsm_get(db, fname, ".rpm", fsize, mtime, &val, &valsize);
+	    break;
+	case B_RPMCACHE:
+	    if (put)
+		rpmcache_put(db, &key, buf, size);
+	    else
+		hit = rpmcache_get(db, &key, &val, &valsize);
+	    break;
+	}
+	uint64_t t = now_ns() - t0;
+	free(val);
+	lat[i] = t;
+	busy += t;
+	hits += hit;
+    }
+    // the close flushes deferred writes, so it counts
+    uint64_t t0 = now_ns();
+    bclose(db);
+    busy += now_ns() - t0;
+    shared->busy[k] = busy;
+    __atomic_add_fetch(&shared->hits, hits, __ATOMIC_RELAXED);
+    free(buf);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static void drop_caches(void)
+{
+    sync();
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    if (fd < 0 || write(fd, "1", 1) != 1) {
+	fprintf(stderr, "%s: cannot drop the page cache: %m (needs root)\n",
+		program_invocation_short_name);
+	exit(1);
+    }
+    close(fd);
+}
+
+// Run a phase in nproc processes, then print a JSON line.
+static void phase(const char *name, bool put)
+{
+    memset(shared, 0, sizeof(*shared) + nproc * sizeof(uint64_t));
+    memset(lat, 0, nent * sizeof(*lat));
+    int pfd[2];
+    if (pipe(pfd) < 0) {
+	fprintf(stderr, "%s: pipe: %m\n", program_invocation_short_name);
+	exit(1);
+    }
+    fflush(NULL);
+    for (int k = 0; k < nproc; k++) {
+	pid_t pid = fork();
+	if (pid < 0) {
+	    fprintf(stderr, "%s: fork: %m\n", program_invocation_short_name);
+	    exit(1);
+	}
+	if (pid == 0) {
+	    close(pfd[1]);
+	    work(k, put, pfd[0]);
+	    _exit(0);
+	}
+    }
+    close(pfd[0]);
+    // closing the pipe starts the workers
+    uint64_t t0 = now_ns();
+    close(pfd[1]);
+    int failed = 0;
+    int status;
+    while (wait(&status) > 0)
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+	    failed++;
+    double wall = (now_ns() - t0) / 1e9;
+    if (failed) {
+	fprintf(stderr, "%s: %s: %d workers failed\n", program_invocation_short_name, name, failed);
+	exit(1);
+    }
+
+    uint64_t busy = 0;
+    for (int k = 0; k < nproc; k++)
+	if (shared->busy[k] > busy)
+	    busy = shared->busy[k];
+    double secs = busy / 1e9;
+    double bytes = 0;
+    for (int i = 0; i < nent; i++)
+	bytes += entsize(i);
+    qsort(lat, nent, sizeof(*lat), cmp_u64);
+#define PCT(p) (lat[(size_t) ((nent - 1) * (p))] / 1e3)
+    fprintf(out, "{\"backend\":\"%s\",\"target\":\"%s\",\"phase\":\"%s\","
+	    "\"procs\":%d,\"n\":%d,\"bytes\":%.0f,\"median\":%.0f,\"sigma\":%.2f,"
+	    "\"secs\":%.6f,\"wall\":%.6f,\"ops_per_sec\":%.1f,\"mb_per_sec\":%.2f,"
+	    "\"hits\":%lu,\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f}\n",
+	    backend_name, target, name, nproc, nent, bytes, median, sigma,
+	    secs, wall, secs > 0 ? nent / secs : 0, secs > 0 ? bytes / secs / (1 << 20) : 0,
+	    put ? 0 : shared->hits, PCT(0.5), PCT(0.99), PCT(0.999), PCT(1.0));
+    fflush(out);
+}
+
+int main(int argc, char *argv[])
+{
+    out = stdout;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:p:r:S:co:")) != -1) {
+	switch (opt) {
+	case 'n':
+	    nent = atoi(optarg);
+	    if (nent < 1)
+		goto usage;
+	    break;
+	case 's':
+	    // MEDIAN[,SIGMA[,MAX]]
+	    if (sscanf(optarg, "%lf,%lf,%d", &median, &sigma, &maxsize) < 1 ||
+		    median < 1 || sigma < 0 || maxsize < 64)
+		goto usage;
+	    break;
+	case 'p':
+	    nproc = atoi(optarg);
+	    if (nproc < 1)
+		goto usage;
+	    break;
+	case 'r':
+	    rounds = atoi(optarg);
+	    if (rounds < 0)
+		goto usage;
+	    break;
+	case 'S':
+	    seed = atoi(optarg);
+	    break;
+	case 'c':
+	    cold = true;
+	    break;
+	case 'o':
+	    out = fopen(optarg, "a");
+	    if (out == NULL) {
+		fprintf(stderr, "%s: %s: %m\n", program_invocation_short_name, optarg);
+		return 1;
+	    }
+	    break;
+	default:
+	    goto usage;
+	}
+    }
+    if (argc - optind != 2) {
+    usage:
+	fprintf(stderr, "Usage: %s [-n COUNT] [-s MEDIAN[,SIGMA[,MAX]]] [-p PROCS] [-r ROUNDS]\n"
+		"\t[-S SEED] [-c] [-o FILE] {cache DIR | bsm DIR | rpmcache NAME}\n",
+		program_invocation_short_name);
+	return 2;
+    }
+    backend_name = argv[optind];
+    target = argv[optind+1];
+    if (strcmp(backend_name, "cache") == 0)
+	backend = B_CACHE;
+    else if (strcmp(backend_name, "bsm") == 0)
+	backend = B_BSM;
+    else if (strcmp(backend_name, "rpmcache") == 0)
+	backend = B_RPMCACHE;
+    else
+	goto usage;
+    if (nproc > nent)
+	nproc = nent;
+
+    size_t size = sizeof(*shared) + nproc * sizeof(uint64_t) + nent * sizeof(*lat);
+    shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+	fprintf(stderr, "%s: mmap: %m\n", program_invocation_short_name);
+	return 1;
+    }
+    lat = shared->busy + nproc;
+
+    // each phase runs in fresh processes, with no in-process caches
+    phase("put", true);
+    if (cold) {
+	drop_caches();
+	phase("get-cold", false);
+    }
+    for (int r = 0; r < rounds; r++)
+	phase("get-warm", false);
+    return 0;
+}
+
+// ex: set ts=8 sts=4 sw=4 noet:
@@ -10,7 +10,11 @@
 #include <fcntl.h>
 #include <stdbool.h>
 #include <db.h>
+#include <zstd.h>
 #include "error.h"
+#include "cache.h"
+#include "codec.h"
+#include "stats.h"
 
 #define SET_UMASK(cache) \
     cache->omask = umask(cache->umask)
@@ -21,6 +25,13 @@
 struct cache_ent {
 #define V_SNAPPY (1 << 0)
 #define V_ZSTD   (1 << 1)
+// Compressed with a zstd dictionary of the cache, the one whose id is
+// in the frame.  V_ZSTD is also set, so that older versions treat such
+// entries as bad zstd data.
+#define V_ZDICT  (1 << 2)
+// LZ4 or LZ4HC, with the uncompressed size in front.  V_SNAPPY is
+// also set, so that older versions treat such entries as misses.
+#define V_LZ4    (1 << 3)
     unsigned short flags;
     unsigned short mtime;
     unsigned short atime;
@@ -30,39 +41,176 @@ struct cache_ent {
 // Values with compressed size larger than this will be backed by fs.
 #define MAX_DB_VAL_SIZE (32 << 10)
 
+// The fs-backed entries of this size or larger are decompressed in
+// a streaming fashion, releasing the compressed pages as they are consumed.
+#define QAFS_STREAM_SIZE (1 << 20)
+
+// Durability policy for fs-backed entries, see QACACHE_SYNC in cache.h.
+enum {
+    QAFS_SYNC_NONE,
+    QAFS_SYNC_FDATASYNC,
+    QAFS_SYNC_SYNCFS,
+};
+
+// Cache hits are served under a shared lock; atime updates are deferred
+// and then flushed in batches under a single exclusive lock.
+#define QADB_ATIME_BATCH 64
+
+// Small entries can be spread over a number of db files, selected by
+// key hash, each file guarded by its own lock.  A single "cache.db" is
+// guarded by the directory lock, as in previous versions.
+#define QADB_MAX_SHARDS 64
+
+struct qadb_shard {
+    DB *db;
+    int lockfd;
+    // pending atime updates
+    int natime;
+    struct qadb_key *atime[QADB_ATIME_BATCH];
+};
+
+// Operation counters and latency histograms, see cache_stats in cache.h.
+enum {
+    QST_GET,
+    QST_HIT,
+    QST_DB_HIT,
+    QST_FS_HIT,
+    QST_GET_BYTES,
+    QST_PUT,
+    QST_DB_PUT,
+    QST_FS_PUT,
+    QST_PUT_BYTES,
+    QST_STORED_BYTES,	// after compression
+    QST_NCNT
+};
+enum {
+    QSH_GET,
+    QSH_MGET,
+    QSH_PUT,
+    QSH_LOCK,		// waiting for flock
+    QSH_COMPRESS,
+    QSH_DECOMPRESS,
+    QSH_NHIST
+};
+
 struct cache {
     // common
     int dirfd;
     unsigned umask, omask;
     unsigned short now;
-    // db
+    // read-only mode: no atime updates, no writes
+    bool rdonly;
+    // zstd contexts and the trained dictionary, if any
+    ZSTD_CCtx *cctx;
+    ZSTD_DCtx *dctx;
+    ZSTD_CDict *cdict;
+    ZSTD_DDict *ddict;
+    unsigned dictid;
+    // previous dictionaries, to decode older entries, loaded on demand
+    struct qaddict *ddicts;
+    int nddict;
+    // chooses the codec for each entry
+    struct codec_policy codec;
+    // fs
+    unsigned char subdirs[256 / 8];	// hex subdirs known to exist
+    bool no_tmpfile;			// O_TMPFILE is not supported
+    bool fsdirty;			// fs entries written, for syncfs
+    int sync;				// durability policy
+    struct qafs_uring *uring;		// qafs_mget's ring, set up on demand
+    bool no_uring;			// io_uring is not available
+    // db: the native engine, if selected; otherwise BDB
+    struct qahx *hx;
     DB_ENV *env;
-    DB *db;
+    int nshard;
+    struct qadb_shard *shard;
     sigset_t bset, oset;
     int pid;
+    // stats
+    unsigned long cnt[QST_NCNT];
+    struct stats_hist hist[QSH_NHIST];
 };
 
 #pragma GCC visibility push(hidden)
 
+bool cache_decode(struct cache *cache,
+	const struct cache_ent *vent, int ventsize, bool mapped,
+	void **valp, int *valsizep);
+
+void qadict_load(struct cache *cache);
+void qadict_free(struct cache *cache);
+const ZSTD_DDict *qadict_ddict(struct cache *cache, unsigned dictid);
+
+void qafs_open(struct cache *cache);
+void qafs_close(struct cache *cache);
 bool qafs_get(struct cache *cache,
 	const unsigned char *sha1,
 	void **valp, int *valsizep);
 void qafs_unget(void *val, int valsize);
+
+// Batched fetch: on return, vent is a malloc'd entry, or NULL with
+// ventsize = -1 if not found, or NULL with ventsize = 0 if the entry
+// should be fetched with qafs_get (e.g. large entries).
+struct qafs_mreq {
+    unsigned char sha1[20] __attribute__((aligned(4)));
+    int i;
+    void *vent;
+    int ventsize;
+};
+void qafs_mget(struct cache *cache, int n, struct qafs_mreq *req);
 void qafs_put(struct cache *cache,
 	const unsigned char *sha1,
 	const void *val, int valsize);
-void qafs_clean(struct cache *cache, int days);
+void qafs_clean(struct cache *cache, int days, int jobs,
+	cache_clean_cb progress, void *arg);
+void qafs_scan(struct cache *cache, struct cache_scan *scan);
 
 bool qadb_open(struct cache *cache, const char *dir);
 bool qadb_get(struct cache *cache,
 	const void *key, int keysize,
 	struct cache_ent *vent, int *ventsize);
+void qadb_mget(struct cache *cache, int n,
+	const void *keys[], const int keysizes[],
+	void *vents[], int ventsizes[]);
 void qadb_put(struct cache *cache,
 	const void *key, int keysize,
 	struct cache_ent *vent, int ventsize);
 void qadb_del(struct cache *cache,
 	const void *key, int keysize);
+void qadb_walk(struct cache *cache,
+	bool (*cb)(void *arg, const void *key, int keysize,
+		const struct cache_ent *vent, int ventsize),
+	void *arg);
 void qadb_close(struct cache *cache);
-void qadb_clean(struct cache *cache, int days);
+void qadb_clean(struct cache *cache, int days, int budget);
+void qadb_stat(struct cache *cache, struct cache_scan *scan);
+
+// The native engine behind qadb_*: returns 1 if opened, 0 if the cache
+// uses BDB, and -1 on error.
+int qahx_open(struct cache *cache);
+void qahx_close(struct cache *cache);
+bool qahx_get(struct cache *cache,
+	const void *key, int keysize,
+	struct cache_ent *vent, int *ventsize);
+void qahx_mget(struct cache *cache, int n,
+	const void *keys[], const int keysizes[],
+	void *vents[], int ventsizes[]);
+void qahx_put(struct cache *cache,
+	const void *key, int keysize,
+	struct cache_ent *vent, int ventsize);
+void qahx_del(struct cache *cache,
+	const void *key, int keysize);
+void qahx_walk(struct cache *cache,
+	bool (*cb)(void *arg, const void *key, int keysize,
+		const struct cache_ent *vent, int ventsize),
+	void *arg);
+void qahx_clean(struct cache *cache, int days);
+void qahx_stat(struct cache *cache, struct cache_scan *scan);
+
+// Account for an entry in the scan; only the first avail bytes
+// of the entry may be at hand, which are enough to tell the codec
+// and the uncompressed size.
+void qascan_ent(struct cache *cache, struct cache_scan *scan, bool fs,
+	const struct cache_ent *vent, int avail, int ventsize,
+	unsigned short mtime, unsigned short atime);
 
 #pragma GCC visibility pop
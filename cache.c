@@ -9,6 +9,8 @@ struct cache *cache_open(const char *dir)
 	ERROR("malloc: %m");
 	return NULL;
     }
+    memset(cache->cnt, 0, sizeof cache->cnt);
+    memset(cache->hist, 0, sizeof cache->hist);
 
     // open dir
     cache->dirfd = open(dir, O_RDONLY | O_DIRECTORY);
@@ -31,8 +33,32 @@ struct cache *cache_open(const char *dir)
     // initialize timestamp
     cache->now = time(NULL) / 3600 / 24;
 
+    // read-only mode, e.g. for CI runners
+    const char *rdonly = getenv("QACACHE_RDONLY");
+    cache->rdonly = rdonly && *rdonly && *rdonly != '0';
+
+    // compression policy
+    codec_parse(NULL, &cache->codec);
+    codec_parse(getenv("QACACHE_CODEC"), &cache->codec);
+
+    // initialize zstd contexts
+    cache->cctx = ZSTD_createCCtx();
+    cache->dctx = ZSTD_createDCtx();
+    if (cache->cctx == NULL || cache->dctx == NULL) {
+	ERROR("cannot create zstd context");
+	goto undo;
+    }
+    qadict_load(cache);
+
+    // initialize fs backend
+    qafs_open(cache);
+
     // initialize db backend
     if (!qadb_open(cache, dir)) {
+	qadict_free(cache);
+    undo:
+	ZSTD_freeCCtx(cache->cctx);
+	ZSTD_freeDCtx(cache->dctx);
 	close(cache->dirfd);
 	free(cache);
 	return NULL;
@@ -41,83 +67,200 @@ struct cache *cache_open(const char *dir)
     return cache;
 }
 
+static const char *const cntname[QST_NCNT] = {
+    [QST_GET] = "get",
+    [QST_HIT] = "hit",
+    [QST_DB_HIT] = "db_hit",
+    [QST_FS_HIT] = "fs_hit",
+    [QST_GET_BYTES] = "get_bytes",
+    [QST_PUT] = "put",
+    [QST_DB_PUT] = "db_put",
+    [QST_FS_PUT] = "fs_put",
+    [QST_PUT_BYTES] = "put_bytes",
+    [QST_STORED_BYTES] = "stored_bytes",
+};
+
+static const char *const histname[QSH_NHIST] = {
+    [QSH_GET] = "get",
+    [QSH_MGET] = "mget",
+    [QSH_PUT] = "put",
+    [QSH_LOCK] = "lock_wait",
+    [QSH_COMPRESS] = "compress",
+    [QSH_DECOMPRESS] = "decompress",
+};
+
+// The stats are labelled with the cache directory.
+static
+void stats_desc(struct cache *cache, struct stats_desc *d, char *dir, size_t dirsize)
+{
+    char proc[64];
+    sprintf(proc, "/proc/self/fd/%d", cache->dirfd);
+    ssize_t n = readlink(proc, dir, dirsize - 1);
+    if (n < 0)
+	n = 0;
+    dir[n] = '\0';
+    *d = (struct stats_desc) {
+	.prefix = "qacache",
+	.label = "dir",
+	.value = dir,
+	.ncnt = QST_NCNT,
+	.cntname = cntname,
+	.cnt = cache->cnt,
+	.nhist = QSH_NHIST,
+	.histname = histname,
+	.hist = cache->hist,
+    };
+}
+
+bool cache_stats(struct cache *cache, FILE *fp, const char *fmt)
+{
+    char dir[PATH_MAX];
+    struct stats_desc d;
+    stats_desc(cache, &d, dir, sizeof dir);
+    return stats_write(fp, fmt, &d);
+}
+
 void cache_close(struct cache *cache)
 {
     if (cache == NULL)
 	return;
+    char dir[PATH_MAX];
+    struct stats_desc d;
+    stats_desc(cache, &d, dir, sizeof dir);
+    stats_dump(&d);
     qadb_close(cache);
+    qafs_close(cache);
+    qadict_free(cache);
+    ZSTD_freeCCtx(cache->cctx);
+    ZSTD_freeDCtx(cache->dctx);
     close(cache->dirfd);
     free(cache);
 }
 
 #include <openssl/sha.h>
 
-// Fast compression and decompression from Facebook.
-#include <zstd.h>
-
 // When compressing a sequence of 17 repeated characters,
 // zstd's output size is 17.  So it is pointless to even
 // try to compress anything below this size:
 #define MIN_COMPRESS_SIZE 18
 
-bool cache_get(struct cache *cache,
-	const void *key, int keysize,
-	void **valp, int *valsizep)
-{
-    if (valp)
-	*valp = NULL;
-    if (valsizep)
-	*valsizep = 0;
-
-    char vbuf[sizeof(struct cache_ent) + MAX_DB_VAL_SIZE] __attribute__((aligned(4)));
-    struct cache_ent *vent = (void *) vbuf;
-    int ventsize = sizeof(vbuf);
+#include <stdint.h>
+#include <sys/mman.h>
 
-    if (!qadb_get(cache, key, keysize, vent, &ventsize)) {
-	unsigned char sha1[20] __attribute__((aligned(4)));
-	SHA1(key, keysize, sha1);
-	if (!qafs_get(cache, sha1, (void **) &vent, &ventsize))
-	    return false;
-    }
+// Decompress a large fs-backed entry chunk by chunk, releasing the pages
+// of the mapping which have already been consumed.  This way, the peak
+// memory use is not the compressed plus the decompressed size.
+static
+size_t zstd_stream(struct cache *cache,
+	void *dst, size_t usize,
+	const void *src, size_t csize,
+	const ZSTD_DDict *ddict)
+{
+    ZSTD_DStream *ds = cache->dctx;
+    size_t rc = ddict ? ZSTD_initDStream_usingDDict(ds, ddict) : ZSTD_initDStream(ds);
+    if (ZSTD_isError(rc))
+	return rc;
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    size_t chunk = ZSTD_DStreamInSize();
+    // the mapping starts at the page boundary, before the cache_ent
+    const char *released = (const char *) ((uintptr_t) src & ~(pagesize - 1));
+    ZSTD_outBuffer out = { dst, usize, 0 };
+    ZSTD_inBuffer in = { src, 0, 0 };
+    do {
+	in.size = csize - in.pos > chunk ? in.pos + chunk : csize;
+	rc = ZSTD_decompressStream(ds, &out, &in);
+	if (ZSTD_isError(rc))
+	    return rc;
+	const char *consumed = (const char *) ((uintptr_t) ((const char *) src + in.pos) & ~(pagesize - 1));
+	if (consumed > released) {
+	    if (madvise((void *) released, consumed - released, MADV_DONTNEED) < 0)
+		ERROR("madvise: %m");
+	    released = consumed;
+	}
+    } while (rc && in.pos < csize);
+    // the frame must be complete
+    if (rc)
+	return (size_t) -1;
+    return out.pos;
+}
 
+// Decode a cache entry, either from the db or from the fs, into
+// a malloc'd value; the entry itself is not released.  Mapped
+// entries can be released partially while being decoded.
+bool cache_decode(struct cache *cache,
+	const struct cache_ent *vent, int ventsize, bool mapped,
+	void **valp, int *valsizep)
+{
     // validate
-    if (ventsize < sizeof(*vent)) {
+    if (ventsize < (int) sizeof(*vent)) {
 	ERROR("vent too small");
-    unget:
-	if (vent != (void *) vbuf)
-	    qafs_unget(vent, ventsize);
 	return false;
     }
 
     // prepare for return
-    if (vent->flags & V_SNAPPY) {
+    uint64_t t0 = stats_now();
+    if (vent->flags & V_LZ4) {
+	int csize = ventsize - sizeof(*vent);
+	int usize = codec_usize(CODEC_LZ4, vent + 1, csize);
+	if (usize < MIN_COMPRESS_SIZE) {
+	    ERROR("LZ4: invalid data");
+	    return false;
+	}
+	if (valp) {
+	    if ((*valp = malloc(usize + 1)) == NULL) {
+		ERROR("malloc: %m");
+		return false;
+	    }
+	    if (!codec_decode(CODEC_LZ4, vent + 1, csize, *valp, usize, NULL, NULL)) {
+		ERROR("LZ4_decompress_safe: invalid data");
+		free(*valp);
+		*valp = NULL;
+		return false;
+	    }
+	    ((char *) *valp)[usize] = '\0';
+	}
+	if (valsizep)
+	    *valsizep = usize;
+    }
+    else if (vent->flags & V_SNAPPY) {
 	// We used to have snappy, but zstd provides a much better compromise
 	// for big data sets which we have; so, force a miss.
-	goto unget;
+	return false;
     }
     else if (vent->flags & V_ZSTD) {
 	// uncompress
 	int csize = ventsize - sizeof(*vent);
 	if (csize < 1) {
 	    ERROR("compressed vent too small");
-	    goto unget;
+	    return false;
+	}
+	// entries compressed with a previous dictionary need that one
+	const ZSTD_DDict *ddict = NULL;
+	if (vent->flags & V_ZDICT) {
+	    ddict = qadict_ddict(cache, ZSTD_getDictID_fromFrame(vent + 1, csize));
+	    if (ddict == NULL)
+		return false;
 	}
 	size_t usize = ZSTD_getDecompressedSize(vent + 1, csize);
 	if (usize < MIN_COMPRESS_SIZE || usize > INT_MAX) {
 	    ERROR("ZSTD_getDecompressedSize: invalid data");
-	    goto unget;
+	    return false;
 	}
 	if (valp) {
 	    if ((*valp = malloc(usize + 1)) == NULL) {
 		ERROR("malloc: %m");
-		goto unget;
+		return false;
 	    }
-	    usize = ZSTD_decompress(*valp, usize, vent + 1, csize);
+	    if (mapped && ventsize >= QAFS_STREAM_SIZE)
+		usize = zstd_stream(cache, *valp, usize, vent + 1, csize, ddict);
+	    else if (!codec_decode(CODEC_ZSTD, vent + 1, csize, *valp, usize,
+			cache->dctx, ddict))
+		usize = (size_t) -1;
 	    if (usize < MIN_COMPRESS_SIZE || usize > INT_MAX) {
 		ERROR("ZSTD_decompress: invalid data");
 		free(*valp);
 		*valp = NULL;
-		goto unget;
+		return false;
 	    }
 	    ((char *) *valp)[usize] = '\0';
 	}
@@ -129,7 +272,7 @@ bool cache_get(struct cache *cache,
 	if (size && valp) {
 	    if ((*valp = malloc(size + 1)) == NULL) {
 		ERROR("malloc: %m");
-		goto unget;
+		return false;
 	    }
 	    memcpy(*valp, vent + 1, size);
 	    ((char *) *valp)[size] = '\0';
@@ -138,25 +281,232 @@ bool cache_get(struct cache *cache,
 	    *valsizep = size;
     }
 
+    if (valp && (vent->flags & (V_LZ4 | V_ZSTD)))
+	stats_time(&cache->hist[QSH_DECOMPRESS], t0);
+    return true;
+}
+
+bool cache_get(struct cache *cache,
+	const void *key, int keysize,
+	void **valp, int *valsizep)
+{
+    if (valp)
+	*valp = NULL;
+    if (valsizep)
+	*valsizep = 0;
+
+    uint64_t t0 = stats_now();
+    stats_add(&cache->cnt[QST_GET], 1);
+
+    char vbuf[sizeof(struct cache_ent) + MAX_DB_VAL_SIZE] __attribute__((aligned(4)));
+    struct cache_ent *vent = (void *) vbuf;
+    int ventsize = sizeof(vbuf);
+
+    if (!qadb_get(cache, key, keysize, vent, &ventsize)) {
+	unsigned char sha1[20] __attribute__((aligned(4)));
+	SHA1(key, keysize, sha1);
+	if (!qafs_get(cache, sha1, (void **) &vent, &ventsize)) {
+	    stats_time(&cache->hist[QSH_GET], t0);
+	    return false;
+	}
+    }
+
+    int valsize = 0;
+    bool ok = cache_decode(cache, vent, ventsize, vent != (void *) vbuf,
+	    valp, &valsize);
+    if (valsizep)
+	*valsizep = valsize;
+
+    if (ok) {
+	stats_add(&cache->cnt[QST_HIT], 1);
+	stats_add(&cache->cnt[vent == (void *) vbuf ? QST_DB_HIT : QST_FS_HIT], 1);
+	stats_add(&cache->cnt[QST_GET_BYTES], valsize);
+    }
+
     if (vent != (void *) vbuf)
 	qafs_unget(vent, ventsize);
 
-    return true;
+    stats_time(&cache->hist[QSH_GET], t0);
+    return ok;
+}
+
+bool cache_borrow(struct cache *cache,
+	const void *key, int keysize,
+	struct cache_val *v)
+{
+    v->val = NULL;
+    v->valsize = 0;
+    v->priv = NULL;
+    v->privsize = 0;
+
+    uint64_t t0 = stats_now();
+    stats_add(&cache->cnt[QST_GET], 1);
+
+    char vbuf[sizeof(struct cache_ent) + MAX_DB_VAL_SIZE] __attribute__((aligned(4)));
+    struct cache_ent *vent = (void *) vbuf;
+    int ventsize = sizeof(vbuf);
+
+    if (!qadb_get(cache, key, keysize, vent, &ventsize)) {
+	unsigned char sha1[20] __attribute__((aligned(4)));
+	SHA1(key, keysize, sha1);
+	if (!qafs_get(cache, sha1, (void **) &vent, &ventsize)) {
+	    stats_time(&cache->hist[QSH_GET], t0);
+	    return false;
+	}
+	// uncompressed fs-backed entries are handed out as they are mapped
+	if (ventsize > (int) sizeof(*vent) && (vent->flags & (V_SNAPPY | V_ZSTD)) == 0) {
+	    v->val = vent + 1;
+	    v->valsize = ventsize - sizeof(*vent);
+	    v->priv = vent;
+	    v->privsize = ventsize;
+	    stats_add(&cache->cnt[QST_HIT], 1);
+	    stats_add(&cache->cnt[QST_FS_HIT], 1);
+	    stats_add(&cache->cnt[QST_GET_BYTES], v->valsize);
+	    stats_time(&cache->hist[QSH_GET], t0);
+	    return true;
+	}
+    }
+
+    void *val = NULL;
+    bool ok = cache_decode(cache, vent, ventsize, vent != (void *) vbuf,
+	    &val, &v->valsize);
+    if (ok) {
+	v->val = val;
+	v->priv = val;
+	stats_add(&cache->cnt[QST_HIT], 1);
+	stats_add(&cache->cnt[vent == (void *) vbuf ? QST_DB_HIT : QST_FS_HIT], 1);
+	stats_add(&cache->cnt[QST_GET_BYTES], v->valsize);
+    }
+
+    if (vent != (void *) vbuf)
+	qafs_unget(vent, ventsize);
+
+    stats_time(&cache->hist[QSH_GET], t0);
+    return ok;
+}
+
+void cache_release(struct cache_val *v)
+{
+    if (v->privsize)
+	qafs_unget(v->priv, v->privsize);
+    else
+	free(v->priv);
+    v->val = NULL;
+    v->valsize = 0;
+    v->priv = NULL;
+    v->privsize = 0;
+}
+
+int cache_mget(struct cache *cache, int n,
+	const void *keys[], const int keysizes[],
+	void *vals[], int valsizes[])
+{
+    uint64_t t0 = stats_now();
+    stats_add(&cache->cnt[QST_GET], n);
+
+    // db entries are first placed into vals[], to be decoded in place
+    qadb_mget(cache, n, keys, keysizes, vals, valsizes);
+
+    // the rest is then fetched from the fs in a batch
+    int nfs = 0;
+    for (int i = 0; i < n; i++)
+	if (vals[i] == NULL)
+	    nfs++;
+    struct qafs_mreq *req = NULL;
+    if (nfs) {
+	req = malloc(nfs * sizeof(*req));
+	if (req == NULL) {
+	    ERROR("malloc: %m");
+	    nfs = 0;
+	}
+    }
+    for (int i = 0, k = 0; k < nfs; i++) {
+	if (vals[i])
+	    continue;
+	SHA1(keys[i], keysizes[i], req[k].sha1);
+	req[k++].i = i;
+    }
+    qafs_mget(cache, nfs, req);
+
+    int nhit = 0;
+    for (int i = 0; i < n; i++) {
+	struct cache_ent *vent = vals[i];
+	int ventsize = valsizes[i];
+	vals[i] = NULL;
+	valsizes[i] = -1;
+	if (vent == NULL)
+	    continue;
+	if (cache_decode(cache, vent, ventsize, false, &vals[i], &valsizes[i])) {
+	    stats_add(&cache->cnt[QST_DB_HIT], 1);
+	    stats_add(&cache->cnt[QST_GET_BYTES], valsizes[i]);
+	    nhit++;
+	}
+	else
+	    valsizes[i] = -1;
+	free(vent);
+    }
+
+    for (int k = 0; k < nfs; k++) {
+	int i = req[k].i;
+	struct cache_ent *vent = req[k].vent;
+	int ventsize = req[k].ventsize;
+	// entries which were not read in the batch are mapped one by one
+	bool mapped = false;
+	if (vent == NULL) {
+	    if (ventsize < 0)
+		continue;
+	    if (!qafs_get(cache, req[k].sha1, (void **) &vent, &ventsize))
+		continue;
+	    mapped = true;
+	}
+	if (cache_decode(cache, vent, ventsize, mapped, &vals[i], &valsizes[i])) {
+	    stats_add(&cache->cnt[QST_FS_HIT], 1);
+	    stats_add(&cache->cnt[QST_GET_BYTES], valsizes[i]);
+	    nhit++;
+	}
+	else
+	    valsizes[i] = -1;
+	if (mapped)
+	    qafs_unget(vent, ventsize);
+	else
+	    free(vent);
+    }
+
+    free(req);
+    stats_add(&cache->cnt[QST_HIT], nhit);
+    stats_time(&cache->hist[QSH_MGET], t0);
+    return nhit;
 }
 
 void cache_put(struct cache *cache,
 	const void *key, int keysize,
 	const void *val, int valsize)
 {
-    int max_valsize;
-    if (valsize < MIN_COMPRESS_SIZE)
+    if (cache->rdonly)
+	return;
+
+    uint64_t t0 = stats_now();
+    int level;
+    enum codec codec = codec_choose(&cache->codec,
+	    CODEC_BIT(CODEC_LZ4) | CODEC_BIT(CODEC_LZ4HC) | CODEC_BIT(CODEC_ZSTD),
+	    val, valsize, MIN_COMPRESS_SIZE, &level);
+
+    size_t max_valsize;
+    switch (codec) {
+    case CODEC_NONE:
 	max_valsize = valsize;
-    else {
+	break;
+    case CODEC_LZ4:
+    case CODEC_LZ4HC:
+	max_valsize = codec_lz4_bound(valsize);
+	break;
+    case CODEC_ZSTD:
 	max_valsize = ZSTD_compressBound(valsize);
-	if (max_valsize < valsize) {
-	    ERROR("ZSTD_compressBound: error");
-	    return;
-	}
+	break;
+    }
+    if (max_valsize < (size_t) valsize || max_valsize > INT_MAX) {
+	ERROR("compress bound: error");
+	return;
     }
 
     struct cache_ent *vent = malloc(sizeof(*vent) + max_valsize);
@@ -170,44 +520,91 @@ void cache_put(struct cache *cache,
     vent->pad = 0;
 
     int ventsize;
-    if (valsize < MIN_COMPRESS_SIZE) {
+    uint64_t tc = stats_now();
+    if (codec == CODEC_NONE) {
     uncompressed:
 	memcpy(vent + 1, val, valsize);
 	ventsize = sizeof(*vent) + valsize;
     }
-    else {
-	size_t csize = ZSTD_compress(vent + 1, max_valsize, val, valsize, 3);
-	if (csize < 1 || csize > INT_MAX) {
+    else if (codec == CODEC_ZSTD) {
+	// the dictionary has its own level
+	size_t csize;
+	if (cache->cdict)
+	    csize = ZSTD_compress_usingCDict(cache->cctx, vent + 1, max_valsize,
+		    val, valsize, cache->cdict);
+	else
+	    csize = ZSTD_compressCCtx(cache->cctx, vent + 1, max_valsize,
+		    val, valsize, level ? level : 3);
+	if (ZSTD_isError(csize) || csize < 1 || csize > INT_MAX) {
 	    ERROR("ZSTD_compress: error");
 	    free(vent);
 	    return;
 	}
-	if (csize >= valsize)
+	if (csize >= (size_t) valsize)
 	    goto uncompressed;
 	vent->flags |= V_ZSTD;
+	if (cache->cdict)
+	    vent->flags |= V_ZDICT;
 	ventsize = sizeof(*vent) + csize;
     }
+    else {
+	size_t csize = codec_lz4_compress(codec, level, val, valsize,
+		vent + 1, max_valsize);
+	if (csize < 1) {
+	    ERROR("LZ4_compress: error");
+	    free(vent);
+	    return;
+	}
+	if (csize >= (size_t) valsize)
+	    goto uncompressed;
+	vent->flags |= V_LZ4 | V_SNAPPY;
+	ventsize = sizeof(*vent) + csize;
+    }
+    if (codec != CODEC_NONE)
+	stats_time(&cache->hist[QSH_COMPRESS], tc);
 
-    if (ventsize - sizeof(*vent) <= MAX_DB_VAL_SIZE)
+    if (ventsize - sizeof(*vent) <= MAX_DB_VAL_SIZE) {
 	qadb_put(cache, key, keysize, vent, ventsize);
+	stats_add(&cache->cnt[QST_DB_PUT], 1);
+    }
     else {
 	qadb_del(cache, key, keysize);
 	unsigned char sha1[20] __attribute__((aligned(4)));
 	SHA1(key, keysize, sha1);
 	qafs_put(cache, sha1, vent, ventsize);
+	stats_add(&cache->cnt[QST_FS_PUT], 1);
     }
 
     free(vent);
+    stats_add(&cache->cnt[QST_PUT], 1);
+    stats_add(&cache->cnt[QST_PUT_BYTES], valsize);
+    stats_add(&cache->cnt[QST_STORED_BYTES], ventsize - sizeof(*vent));
+    stats_time(&cache->hist[QSH_PUT], t0);
 }
 
-void cache_clean(struct cache *cache, int days)
+bool cache_codec(struct cache *cache, const char *policy)
+{
+    return codec_parse(policy, &cache->codec);
+}
+
+void cache_clean_mt(struct cache *cache, int days, int jobs, int budget,
+	cache_clean_cb progress, void *arg)
 {
     if (days < 1) {
 	ERROR("days must be greater than 0, got %d", days);
 	return;
     }
-    qadb_clean(cache, days);
-    qafs_clean(cache, days);
+    if (cache->rdonly) {
+	ERROR("cache opened in read-only mode");
+	return;
+    }
+    qadb_clean(cache, days, budget);
+    qafs_clean(cache, days, jobs, progress, arg);
+}
+
+void cache_clean(struct cache *cache, int days)
+{
+    cache_clean_mt(cache, days, 0, 0, NULL, NULL);
 }
 
 // ex:ts=8 sts=4 sw=4 noet
@@ -5,13 +5,142 @@
 extern "C" {
 #endif
 
-struct cache *cache_open(const char *dir);
-void cache_clean(struct cache *cache, int days);
-void cache_close(struct cache *cache);
-
 #ifndef __cplusplus
 #include <stdbool.h>
 #endif
+#include <stdio.h>
+
+/*
+ * If QACACHE_RDONLY environment variable is set (and is not "0"), the cache
+ * is opened in read-only mode: hits do not update atime, cache_put does
+ * nothing, and cache_clean refuses to run.  The files are opened read-only,
+ * nothing is created in the directory, and cache_open fails if there is no
+ * cache yet.  This is useful for CI runners which share a pre-populated
+ * cache.
+ *
+ * When a new cache is created, QACACHE_SHARDS environment variable specifies
+ * the number of db files (up to 64) among which small entries are spread,
+ * each file having its own lock.  Existing caches keep their layout.
+ *
+ * QACACHE_ENGINE=hx environment variable creates a new cache with the native
+ * engine instead of BDB: a memory-mapped hash index over an append-only heap,
+ * with lock-free reads.  Again, existing caches keep their engine.
+ *
+ * QACACHE_CODEC environment variable sets the compression policy, see
+ * cache_codec below.
+ *
+ * QACACHE_SYNC environment variable sets the durability policy for large
+ * entries backed by the filesystem: "none" (the default), "fdatasync" (each
+ * file is synced before it is linked in place), or "syncfs" (the filesystem
+ * is synced once by cache_close).
+ */
+struct cache *cache_open(const char *dir);
+void cache_clean(struct cache *cache, int days);
+
+/*
+ * Same as cache_clean, but with more control.  The db is cleaned in chunks,
+ * and the lock is released between the chunks.  With a time budget (in
+ * seconds, 0 means no limit), the db cleaning stops when the budget is
+ * exhausted, and the next call with a budget resumes from that position;
+ * this way, cleanup can be spread over the day.  The scan of fs-backed
+ * entries is not limited by the budget, and is performed by a pool
+ * of threads (jobs = 0 selects the number of CPUs, up to 16).
+ * The progress callback, if any, is invoked after each of the 256
+ * subdirectories is done, and is serialized among the threads.
+ */
+struct cache_clean_stats {
+    int ndirs;			// subdirectories done, out of 256
+    unsigned long nscan;	// fs-backed entries scanned
+    unsigned long nfree;	// fs-backed entries removed
+};
+typedef void (*cache_clean_cb)(void *arg, const struct cache_clean_stats *st);
+void cache_clean_mt(struct cache *cache, int days, int jobs, int budget,
+	cache_clean_cb progress, void *arg);
+
+/*
+ * Train a zstd dictionary on the small entries found in the cache, and
+ * store it in the cache directory (dictsize = 0 selects the default size).
+ * The dictionary is loaded by subsequent cache_open calls and is then used
+ * to compress new entries.  The previous dictionaries are kept by their
+ * ids, as zstd.dict.ID, to decode the entries compressed with them.
+ */
+bool cache_train(struct cache *cache, int dictsize);
+
+/*
+ * Set the compression policy for new entries: "auto" (the default) picks
+ * zstd unless the value looks incompressible, and "none", "lz4",
+ * "lz4hc[:LEVEL]", or "zstd[:LEVEL]" force the codec.  Entries record
+ * their codec, so that the policy can be changed at any time.
+ */
+bool cache_codec(struct cache *cache, const char *policy);
+
+/*
+ * Gather statistics for capacity planning, without changing the cache (as
+ * far as O_NOATIME permits, fs-backed entries are read without updating
+ * their atime).  Sizes and ages are put into buckets by the power of 2:
+ * bucket i counts sizes in [2^i, 2^(i+1)) bytes, and ages in [2^i - 1,
+ * 2^(i+1) - 1) days.  The compression ratio buckets are by the half power
+ * of 2: bucket i counts ratios in [2^(i/2), 2^((i+1)/2)).
+ */
+#define CACHE_SCAN_NSIZE 32
+#define CACHE_SCAN_NAGE 16
+#define CACHE_SCAN_NRATIO 16
+
+// Entries by the way they are stored.
+enum {
+    CACHE_SCAN_RAW,
+    CACHE_SCAN_LZ4,
+    CACHE_SCAN_ZSTD,
+    CACHE_SCAN_ZDICT,		// zstd with the trained dictionary
+    CACHE_SCAN_LEGACY,		// snappy, read as misses
+    CACHE_SCAN_NCODEC
+};
+
+struct cache_scan_part {
+    unsigned long nent;
+    unsigned long long usize;	// values, uncompressed
+    unsigned long long csize;	// values, as stored
+    unsigned long size[CACHE_SCAN_NSIZE];	// by the stored size
+    unsigned long mtime[CACHE_SCAN_NAGE];	// by age
+    unsigned long atime[CACHE_SCAN_NAGE];	// by the time since last use
+};
+
+struct cache_scan {
+    struct cache_scan_part db, fs;
+    struct {
+	unsigned long nent;
+	unsigned long long usize, csize;
+	unsigned long ratio[CACHE_SCAN_NRATIO];
+    } codec[CACHE_SCAN_NCODEC];
+    // values stored in the db are at most cutoff bytes, larger ones go
+    // to the fs; near_cutoff counts those within 1/8 of it on either side
+    int cutoff;
+    unsigned long near_cutoff;
+    // fs-backed entries whose header could not be read
+    unsigned long unread;
+    // db files: BDB btree pages, or the native engine's hash index
+    bool hx;
+    unsigned long long dbfile_bytes;
+    unsigned pagesize;
+    unsigned long pages, free_pages, leaf_pages, overflow_pages;
+    unsigned long long leaf_free_bytes;	// fill factor = 1 - free / leaf size
+    unsigned long hx_slots, hx_used, hx_live;
+    unsigned long long hx_garbage_bytes;
+};
+void cache_scan(struct cache *cache, struct cache_scan *scan);
+
+/*
+ * Write the operation counters (gets, hits in the db and in the fs, puts,
+ * bytes before and after compression) and the latency histograms (get, put,
+ * lock wait, compression, decompression) accumulated since cache_open.
+ * The format is "json", a single line, or "prometheus" text.  The stats
+ * are also appended by cache_close to the file named by RPMCACHE_STATS
+ * environment variable, if set.  If the name ends with ".prom", they are
+ * rather added up into the file, in Prometheus format, with the stats of
+ * the other processes which have used the same cache.
+ */
+bool cache_stats(struct cache *cache, FILE *fp, const char *fmt);
+void cache_close(struct cache *cache);
 
 /*
  * Note that it is possible to store empty values by specifying valsize = 0
@@ -32,6 +161,36 @@ void cache_put(struct cache *cache,
 	const void *key, int keysize,
 	const void *val, int valsize);
 
+/*
+ * Borrowed values.  cache_borrow works like cache_get, except that the value
+ * need not be copied: compressed entries are decompressed right into the
+ * value's buffer, and large uncompressed entries backed by the filesystem
+ * are handed out as they are mapped into memory.  The value is read-only,
+ * it is not necessarily null-terminated, and it stays valid until the
+ * cache_release call.
+ */
+struct cache_val {
+    const void *val;
+    int valsize;
+    // private
+    void *priv;
+    int privsize;
+};
+
+bool cache_borrow(struct cache *cache,
+	const void *key, int keysize,
+	struct cache_val *v);
+void cache_release(struct cache_val *v);
+
+/*
+ * Fetch n entries at once.  For each key found, vals[i] and valsizes[i]
+ * are set as with cache_get; otherwise, vals[i] is set to NULL and
+ * valsizes[i] is set to -1.  Returns the number of entries found.
+ */
+int cache_mget(struct cache *cache, int n,
+	const void *keys[], const int keysizes[],
+	void *vals[] /* malloc'd */, int valsizes[]);
+
 /*
  * These wrappers simplify file processing when files are identified by their
  * (basename,size,mtime) triple.  This is useful when filenames convey some
@@ -3,32 +3,152 @@
 #endif
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include "cache.h"
 
-int main(int argc, const char *argv[])
+static int days;
+static int dirjobs = 1, subjobs = 1;
+static int budget;
+static bool verbose;
+static int ndirs;
+static const char **dirs;
+static int *next;
+static int rc;
+
+struct job {
+    const char *dir;
+    struct timespec start;
+};
+
+static double elapsed(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void report(struct job *job, const struct cache_clean_stats *st)
+{
+    double t = elapsed(&job->start);
+    fprintf(stderr, "%s: %s: %d/256 dirs, %lu scanned, %lu removed, %.1fs, %.0f files/s\n",
+	    program_invocation_short_name, job->dir,
+	    st->ndirs, st->nscan, st->nfree, t, t > 0 ? st->nscan / t : 0);
+}
+
+static void progress(void *arg, const struct cache_clean_stats *st)
+{
+    // every 1/16th of the way
+    if (st->ndirs % 16 == 0)
+	report(arg, st);
+}
+
+static void clean(const char *dir)
+{
+    struct job job = { .dir = dir };
+    clock_gettime(CLOCK_MONOTONIC, &job.start);
+    struct cache *cache = cache_open(dir);
+    if (!cache) {
+	// warning issued by the library
+	rc = 1;
+	return;
+    }
+    cache_clean_mt(cache, days, subjobs, budget, verbose ? progress : NULL, &job);
+    cache_close(cache);
+}
+
+static void worker(void)
 {
-    if (argc < 3) {
+    while (1) {
+	int i = __atomic_fetch_add(next, 1, __ATOMIC_RELAXED);
+	if (i >= ndirs)
+	    break;
+	clean(dirs[i]);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int jobs = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:t:v")) != -1) {
+	switch (opt) {
+	case 'j':
+	    jobs = atoi(optarg);
+	    if (jobs < 1)
+		goto usage;
+	    break;
+	case 't':
+	    budget = atoi(optarg);
+	    if (budget < 1)
+		goto usage;
+	    break;
+	case 'v':
+	    verbose = true;
+	    break;
+	default:
+	    goto usage;
+	}
+    }
+    if (argc - optind < 2) {
   usage:
-      fprintf(stderr, "Usage: %s DAYS DIR...\n",
+      fprintf(stderr, "Usage: %s [-j JOBS] [-t SECONDS] [-v] DAYS DIR...\n",
 	      program_invocation_short_name);
       return 2;
     }
-    int days = atoi(argv[1]);
+    days = atoi(argv[optind]);
     if (days < 1)
 	goto usage;
-    int rc = 0;
-    int i;
-    for (i = 2; i < argc; i++) {
-	const char *dir = argv[i];
-	struct cache *cache = cache_open(dir);
-	if (!cache) {
-	    // warning issued by the library
-	    rc = 1;
-	    continue;
+    dirs = (const char **) argv + optind + 1;
+    ndirs = argc - optind - 1;
+
+    // the jobs are split among the directories and their subdirectories
+    if (jobs < 1)
+	jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (jobs < 1)
+	jobs = 1;
+    dirjobs = jobs < ndirs ? jobs : ndirs;
+    subjobs = jobs / dirjobs;
+
+    // the directories are cleaned by processes rather than threads,
+    // since the library sets the umask while creating files; the main
+    // process is one of the workers
+    next = mmap(NULL, sizeof(*next), PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (next == MAP_FAILED) {
+	perror("mmap");
+	return 1;
+    }
+    fflush(NULL);
+    int nproc = 0;
+    while (nproc < dirjobs - 1) {
+	pid_t pid = fork();
+	if (pid < 0) {
+	    perror("fork");
+	    break;
+	}
+	if (pid == 0) {
+	    worker();
+	    _exit(rc);
 	}
-	cache_clean(cache, days);
-	cache_close(cache);
+	nproc++;
+    }
+    worker();
+    int status;
+    while (nproc > 0) {
+	if (wait(&status) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    perror("wait");
+	    return 1;
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+	    rc = 1;
+	nproc--;
     }
     return rc;
 }
@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdint.h>
+#include <lz4.h>
+#include <lz4hc.h>
+#include "error.h"
+#include "codec.h"
+
+bool codec_parse(const char *spec, struct codec_policy *policy)
+{
+    static const struct {
+	const char *name;
+	enum codec codec;
+    } names[] = {
+	{ "none", CODEC_NONE },
+	{ "lz4hc", CODEC_LZ4HC },
+	{ "lz4", CODEC_LZ4 },
+	{ "zstd", CODEC_ZSTD },
+    };
+    // the policy is not changed on error
+    if (spec == NULL || *spec == '\0' || strcmp(spec, "auto") == 0) {
+	policy->adaptive = true;
+	policy->codec = CODEC_NONE;
+	policy->level = 0;
+	return true;
+    }
+    for (size_t i = 0; i < sizeof names / sizeof *names; i++) {
+	size_t len = strlen(names[i].name);
+	if (strncmp(spec, names[i].name, len))
+	    continue;
+	const char *s = spec + len;
+	int level = 0;
+	if (*s == ':' && (names[i].codec == CODEC_LZ4HC || names[i].codec == CODEC_ZSTD)) {
+	    char *end;
+	    level = strtol(s + 1, &end, 10);
+	    if (end == s + 1 || level < 1 || level > 22)
+		break;
+	    s = end;
+	}
+	if (*s)
+	    break;
+	policy->adaptive = false;
+	policy->codec = names[i].codec;
+	policy->level = level;
+	return true;
+    }
+    ERROR("invalid codec: %s", spec);
+    return false;
+}
+
+// Compressibility is measured by running fast LZ4 over the beginning
+// of the value; if it cannot save 1/16th, the value is stored as is.
+#define PROBE_SIZE (16 << 10)
+
+// Smaller values get a higher zstd level: the decoding speed does not
+// depend on the level much.
+#define ZSTD_HI_SIZE (1 << 20)
+#define ZSTD_HI_LEVEL 9
+#define ZSTD_LO_LEVEL 3
+
+enum codec codec_choose(const struct codec_policy *policy, unsigned avail,
+	const void *val, int valsize, int minsize, int *level)
+{
+    *level = 0;
+    if (valsize < minsize)
+	return CODEC_NONE;
+
+    // a fixed codec, if the backend supports it
+    if (!policy->adaptive && (avail & CODEC_BIT(policy->codec))) {
+	*level = policy->level;
+	return policy->codec;
+    }
+    if (!policy->adaptive && policy->codec == CODEC_NONE)
+	return CODEC_NONE;
+
+    char probe[PROBE_SIZE];
+    int n = valsize < PROBE_SIZE ? valsize : PROBE_SIZE;
+    if (LZ4_compress_default(val, probe, n, n - n / 16) <= 0)
+	return CODEC_NONE;
+
+    if (avail & CODEC_BIT(CODEC_ZSTD)) {
+	*level = valsize < ZSTD_HI_SIZE ? ZSTD_HI_LEVEL : ZSTD_LO_LEVEL;
+	return CODEC_ZSTD;
+    }
+    if (avail & CODEC_BIT(CODEC_LZ4HC)) {
+	*level = LZ4HC_CLEVEL_DEFAULT;
+	return CODEC_LZ4HC;
+    }
+    if (avail & CODEC_BIT(CODEC_LZ4))
+	return CODEC_LZ4;
+    return CODEC_NONE;
+}
+
+size_t codec_lz4_bound(int valsize)
+{
+    return LZ4_compressBound(valsize) + 4;
+}
+
+size_t codec_lz4_compress(enum codec codec, int level,
+	const void *val, int valsize, void *dst, size_t dstsize)
+{
+    if (dstsize <= 4)
+	return 0;
+    int cap = dstsize - 4 > INT_MAX ? INT_MAX : dstsize - 4;
+    int csize;
+    if (codec == CODEC_LZ4HC)
+	csize = LZ4_compress_HC(val, (char *) dst + 4, valsize, cap,
+		level ? level : LZ4HC_CLEVEL_DEFAULT);
+    else
+	csize = LZ4_compress_default(val, (char *) dst + 4, valsize, cap);
+    if (csize <= 0)
+	return 0;
+    uint32_t usize = valsize;
+    memcpy(dst, &usize, 4);
+    return csize + 4;
+}
+
+size_t codec_zstd_compress(ZSTD_CCtx *cctx, int level,
+	const void *val, int valsize, void *dst, size_t dstsize)
+{
+    size_t csize;
+    if (level == 0)
+	level = ZSTD_LO_LEVEL;
+    if (cctx)
+	csize = ZSTD_compressCCtx(cctx, dst, dstsize, val, valsize, level);
+    else
+	csize = ZSTD_compress(dst, dstsize, val, valsize, level);
+    return ZSTD_isError(csize) ? 0 : csize;
+}
+
+int codec_usize(enum codec codec, const void *src, size_t csize)
+{
+    switch (codec) {
+    case CODEC_NONE:
+	return csize > INT_MAX ? -1 : (int) csize;
+    case CODEC_LZ4:
+    case CODEC_LZ4HC: {
+	uint32_t usize;
+	if (csize <= 4)
+	    return -1;
+	memcpy(&usize, src, 4);
+	return usize > INT_MAX ? -1 : (int) usize;
+    }
+    case CODEC_ZSTD: {
+	unsigned long long usize = ZSTD_getDecompressedSize(src, csize);
+	return usize == 0 || usize > INT_MAX ? -1 : (int) usize;
+    }
+    }
+    return -1;
+}
+
+bool codec_decode(enum codec codec, const void *src, size_t csize,
+	void *dst, int usize, ZSTD_DCtx *dctx, const ZSTD_DDict *ddict)
+{
+    size_t n;
+    switch (codec) {
+    case CODEC_NONE:
+	if (csize != (size_t) usize)
+	    return false;
+	memcpy(dst, src, usize);
+	return true;
+    case CODEC_LZ4:
+    case CODEC_LZ4HC:
+	if (csize <= 4 || csize - 4 > INT_MAX)
+	    return false;
+	return LZ4_decompress_safe((const char *) src + 4, dst, csize - 4, usize) == usize;
+    case CODEC_ZSTD:
+	if (dctx && ddict)
+	    n = ZSTD_decompress_usingDDict(dctx, dst, usize, src, csize, ddict);
+	else if (dctx)
+	    n = ZSTD_decompressDCtx(dctx, dst, usize, src, csize);
+	else
+	    n = ZSTD_decompress(dst, usize, src, csize);
+	return n == (size_t) usize;
+    }
+    return false;
+}
+
+// ex:ts=8 sts=4 sw=4 noet
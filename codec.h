@@ -0,0 +1,52 @@
+// Compression codecs shared by qacache and the memcached/redis backends,
+// and the policy which chooses a codec for each entry.  Entries are
+// written once and read many times, so the policy favours the ratio
+// and the decoding speed over the encoding speed.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <zstd.h>
+
+enum codec {
+    CODEC_NONE,
+    CODEC_LZ4,
+    CODEC_LZ4HC,	// decoded as LZ4
+    CODEC_ZSTD,
+};
+
+#define CODEC_BIT(codec) (1U << (codec))
+
+struct codec_policy {
+    bool adaptive;	// choose by size and compressibility
+    enum codec codec;	// otherwise, always use this codec
+    int level;		// 0 selects the codec's default
+};
+
+// The policy is "auto" (the default), "none", "lz4", "lz4hc[:LEVEL]",
+// or "zstd[:LEVEL]".
+bool codec_parse(const char *spec, struct codec_policy *policy);
+
+// Choose the codec and the level for the value; avail is the set of
+// the codecs which the backend supports.  Values smaller than minsize
+// are not compressed.
+enum codec codec_choose(const struct codec_policy *policy, unsigned avail,
+	const void *val, int valsize, int minsize, int *level);
+
+// LZ4 data is a 4-byte uncompressed size followed by an LZ4 block.
+// Returns the size of the data, or 0 if it does not fit into dst.
+size_t codec_lz4_bound(int valsize);
+size_t codec_lz4_compress(enum codec codec, int level,
+	const void *val, int valsize, void *dst, size_t dstsize);
+
+// A zstd frame; without the cctx, a temporary context is used.
+size_t codec_zstd_compress(ZSTD_CCtx *cctx, int level,
+	const void *val, int valsize, void *dst, size_t dstsize);
+
+// The uncompressed size of the data, or -1 if it is invalid.
+int codec_usize(enum codec codec, const void *src, size_t csize);
+
+// Decode into dst, which must hold usize bytes; returns false on
+// error.  Zstd data is decoded with the dctx (and the ddict, if any),
+// or else with a temporary context.
+bool codec_decode(enum codec codec, const void *src, size_t csize,
+	void *dst, int usize, ZSTD_DCtx *dctx, const ZSTD_DDict *ddict);
@@ -2,11 +2,13 @@
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <stdbool.h>
 #include "conf.h"
 
 struct conf *findconf(FILE *fp, const char *name)
 {
-    char line[128], *s;
+    // tag lists can be long
+    char line[1024], *s;
     enum conftype t;
     size_t namelen = strlen(name);
     while ((s = fgets(line, sizeof line, fp))) {
@@ -21,28 +23,30 @@ struct conf *findconf(FILE *fp, const char *name)
 	    if (strncmp(s, "qacache", sizeof("qacache") - 1))
 		continue;
 	    s += sizeof("qacache") - 1;
-	    if (!isspace(*s))
-		continue;
 	    t = CONFTYPE_QACACHE;
 	    break;
 	case 'm':
 	    if (strncmp(s, "memcached", sizeof("memcached") - 1))
 		continue;
 	    s += sizeof("memcached") - 1;
-	    if (!isspace(*s))
-		continue;
 	    t = CONFTYPE_MEMCACHED;
 	    break;
 	case 'r':
 	    if (strncmp(s, "redis", sizeof("redis") - 1))
 		continue;
 	    s += sizeof("redis") - 1;
-	    if (!isspace(*s))
-		continue;
 	    t = CONFTYPE_REDIS;
 	    break;
 	default: continue;
 	}
+	// "memcached,async" means write-back
+	bool async = false;
+	if (strncmp(s, ",async", sizeof(",async") - 1) == 0) {
+	    async = true;
+	    s += sizeof(",async") - 1;
+	}
+	if (!isspace(*s))
+	    continue;
 	do s++; while (isspace(*s));
 	char *q = s;
 	while (*s && *s != '\n')
@@ -51,9 +55,40 @@ struct conf *findconf(FILE *fp, const char *name)
 	    continue;
 	struct conf *c = malloc(sizeof(*c) + s - q + 1);
 	c->t = t;
+	c->async = async;
 	memcpy(c->str, q, s - q);
 	c->str[s - q] = '\0';
 	return c;
     }
     return NULL;
 }
+
+char *findopt(FILE *fp, const char *name, const char *key)
+{
+    char line[1024], *s, *val = NULL;
+    size_t namelen = strlen(name);
+    size_t keylen = strlen(key);
+    rewind(fp);
+    while ((s = fgets(line, sizeof line, fp))) {
+	if (strncmp(s, name, namelen))
+	    continue;
+	s += namelen;
+	if (!isspace(*s))
+	    continue;
+	do s++; while (isspace(*s));
+	if (strncmp(s, key, keylen))
+	    continue;
+	s += keylen;
+	if (!isspace(*s))
+	    continue;
+	do s++; while (isspace(*s));
+	char *q = s;
+	while (*s && *s != '\n')
+	    s++;
+	if (s == q)
+	    continue;
+	free(val);
+	val = strndup(q, s - q);
+    }
+    return val;
+}
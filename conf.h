@@ -6,7 +6,16 @@ enum conftype {
 
 struct conf {
     enum conftype t;
+    bool async;
     char str[];
 };
 
+// Returns the next line for the name, so that a cache can be declared
+// with a few lines, one per tier.
 struct conf *findconf(FILE *fp, const char *name);
+
+// Returns the value of the "NAME key VALUE" line which is not a tier,
+// e.g. "NAME codec POLICY", see cache_codec in cache.h, or "NAME tags
+// TAG,...", see rpmcache_tags in rpmcache.h.  The whole file is searched,
+// and the last line wins.  The value is malloc'd.
+char *findopt(FILE *fp, const char *name, const char *key);
@@ -17,18 +17,35 @@ void msgcall(const DB_ENV *env, const char *msg)
 
 #include <sys/file.h>
 
+// The time spent waiting for the locks goes into the stats.
 #define LOCK_DIR(cache, op) \
     {	int rc_; \
+	uint64_t t0_ = stats_now(); \
 	do \
 	    rc_ = flock(cache->dirfd, op); \
 	while (rc_ < 0 && errno == EINTR); \
 	if (rc_) \
 	    ERROR("%s: %m", #op); \
+	stats_time(&cache->hist[QSH_LOCK], t0_); \
     }
 #define UNLOCK_DIR(cache) \
     if (flock(cache->dirfd, LOCK_UN)) \
 	ERROR("LOCK_UN: %m")
 
+#define LOCK_SHARD(cache, sh, op) \
+    {	int rc_; \
+	uint64_t t0_ = stats_now(); \
+	do \
+	    rc_ = flock(sh->lockfd, op); \
+	while (rc_ < 0 && errno == EINTR); \
+	if (rc_) \
+	    ERROR("%s: %m", #op); \
+	stats_time(&cache->hist[QSH_LOCK], t0_); \
+    }
+#define UNLOCK_SHARD(sh) \
+    if (flock(sh->lockfd, LOCK_UN)) \
+	ERROR("LOCK_UN: %m")
+
 #define BLOCK_SIGNALS(cache) \
     if (sigprocmask(SIG_BLOCK, &cache->bset, &cache->oset)) \
 	ERROR("SIG_BLOCK: %m")
@@ -36,6 +53,131 @@ void msgcall(const DB_ENV *env, const char *msg)
     if (sigprocmask(SIG_SETMASK, &cache->oset, NULL)) \
 	ERROR("SIG_SETMASK: %m")
 
+// The directory lock must be taken before a shard lock, never after.
+// With a single shard, the directory lock is the shard lock.
+#define SEPARATE_LOCK(cache, sh) (sh->lockfd != cache->dirfd)
+
+// Select the shard by FNV-1a hash of the key.
+static inline
+struct qadb_shard *qadb_shard(struct cache *cache,
+	const void *key, int keysize)
+{
+    if (cache->nshard == 1)
+	return cache->shard;
+    const unsigned char *p = key;
+    unsigned h = 2166136261U;
+    for (int i = 0; i < keysize; i++)
+	h = (h ^ p[i]) * 16777619U;
+    return &cache->shard[h % cache->nshard];
+}
+
+// Find out the number of shards: existing "cache.db" means the
+// unsharded layout; otherwise, count "cache-XX.db" files.  A new
+// cache gets QACACHE_SHARDS shards.  Called under the directory lock.
+static
+int qadb_nshard(struct cache *cache)
+{
+    if (faccessat(cache->dirfd, "cache.db", F_OK, 0) == 0)
+	return 1;
+    int n = 0;
+    char fname[sizeof("cache-00.db")];
+    while (n < QADB_MAX_SHARDS) {
+	snprintf(fname, sizeof fname, "cache-%02x.db", n);
+	if (faccessat(cache->dirfd, fname, F_OK, 0))
+	    break;
+	n++;
+    }
+    if (n)
+	return n;
+    // nothing is created in read-only mode
+    if (cache->rdonly)
+	return 0;
+    const char *env = getenv("QACACHE_SHARDS");
+    if (env && *env) {
+	n = atoi(env);
+	if (n >= 1 && n <= QADB_MAX_SHARDS)
+	    return n;
+	ERROR("QACACHE_SHARDS: invalid value: %s", env);
+    }
+    return 1;
+}
+
+static
+bool qadb_open_shard(struct cache *cache, struct qadb_shard *sh, int i)
+{
+    char fname[sizeof("cache-00.lock")];
+    if (cache->nshard == 1) {
+	strcpy(fname, "cache.db");
+	sh->lockfd = cache->dirfd;
+    }
+    else {
+	snprintf(fname, sizeof fname, "cache-%02x.lock", i);
+	int flags = O_RDONLY | O_CLOEXEC;
+	if (!cache->rdonly)
+	    flags |= O_CREAT;
+	sh->lockfd = openat(cache->dirfd, fname, flags, 0666);
+	if (sh->lockfd < 0) {
+	    ERROR("openat %s: %m", fname);
+	    return false;
+	}
+	snprintf(fname, sizeof fname, "cache-%02x.db", i);
+    }
+    sh->natime = 0;
+
+    // allocate db
+    int rc = db_create(&sh->db, cache->env, 0);
+    if (rc) {
+	ERROR("db_create: %s", db_strerror(rc));
+	goto undo;
+    }
+
+    // open db
+    if (SEPARATE_LOCK(cache, sh))
+	LOCK_SHARD(cache, sh, LOCK_EX);
+    rc = sh->db->open(sh->db, NULL, fname, NULL,
+	    DB_BTREE, cache->rdonly ? DB_RDONLY : DB_CREATE, 0666);
+    if (SEPARATE_LOCK(cache, sh))
+	UNLOCK_SHARD(sh);
+    if (rc) {
+	ERROR("db_open %s: %s", fname, db_strerror(rc));
+	sh->db->close(sh->db, 0);
+    undo:
+	if (SEPARATE_LOCK(cache, sh))
+	    close(sh->lockfd);
+	return false;
+    }
+
+    return true;
+}
+
+static
+void qadb_close_shard(struct cache *cache, struct qadb_shard *sh)
+{
+    if (SEPARATE_LOCK(cache, sh))
+	LOCK_SHARD(cache, sh, LOCK_EX);
+    int rc = sh->db->close(sh->db, 0);
+    if (rc)
+	ERROR("db_close: %s", db_strerror(rc));
+    if (SEPARATE_LOCK(cache, sh)) {
+	UNLOCK_SHARD(sh);
+	close(sh->lockfd);
+    }
+}
+
+static
+bool qadb_env_create(struct cache *cache)
+{
+    int rc = db_env_create(&cache->env, 0);
+    if (rc) {
+	ERROR("env_create: %s", db_strerror(rc));
+	return false;
+    }
+    cache->env->set_errcall(cache->env, errcall);
+    cache->env->set_msgcall(cache->env, msgcall);
+    cache->env->set_cachesize(cache->env, 0, 1 << 20, 1);
+    return true;
+}
+
 bool qadb_open(struct cache *cache, const char *dir)
 {
     // initialize signals which we will block
@@ -49,26 +191,47 @@ bool qadb_open(struct cache *cache, const char *dir)
     // remember our process
     cache->pid = getpid();
 
-    // allocate env
-    int rc = db_env_create(&cache->env, 0);
-    if (rc) {
-	ERROR("env_create: %s", db_strerror(rc));
+    // the native engine, if selected
+    int hx = qahx_open(cache);
+    if (hx)
+	return hx > 0;
+
+    // a read-only cache must exist; the lock is not needed to look,
+    // since nothing is created below
+    if (cache->rdonly && qadb_nshard(cache) == 0) {
+	ERROR("%s: no cache", dir);
 	return false;
     }
 
-    // configure env
-    cache->env->set_errcall(cache->env, errcall);
-    cache->env->set_msgcall(cache->env, msgcall);
-    cache->env->set_cachesize(cache->env, 0, 1 << 20, 1);
+    // allocate env
+    if (!qadb_env_create(cache))
+	return false;
 
     // enter ciritical section
     LOCK_DIR(cache, LOCK_EX);
     BLOCK_SIGNALS(cache);
     SET_UMASK(cache);
 
-    // open env
-    rc = (cache->env->open)(cache->env, dir,
-	    DB_CREATE | DB_INIT_MPOOL, 0666);
+    // open env; in read-only mode, nothing is created in the directory:
+    // the writers' env is joined if there is one, otherwise the buffer
+    // pool is private (DB_CREATE then only creates it in memory)
+    if (cache->rdonly)
+	cache->env->set_errcall(cache->env, NULL);
+    int rc = (cache->env->open)(cache->env, dir,
+	    cache->rdonly ? DB_INIT_MPOOL : DB_CREATE | DB_INIT_MPOOL, 0666);
+    if (rc && cache->rdonly) {
+	cache->env->close(cache->env, 0);
+	if (!qadb_env_create(cache)) {
+	    UNSET_UMASK(cache);
+	    UNBLOCK_SIGNALS(cache);
+	    UNLOCK_DIR(cache);
+	    return false;
+	}
+	rc = (cache->env->open)(cache->env, dir,
+		DB_PRIVATE | DB_CREATE | DB_INIT_MPOOL, 0666);
+    }
+    else if (cache->rdonly)
+	cache->env->set_errcall(cache->env, errcall);
     if (rc) {
 	ERROR("env_open %s: %s", dir, db_strerror(rc));
     undo:
@@ -82,19 +245,25 @@ bool qadb_open(struct cache *cache, const char *dir)
 	return false;
     }
 
-    // allocate db
-    rc = db_create(&cache->db, cache->env, 0);
-    if (rc) {
-	ERROR("db_create: %s", db_strerror(rc));
+    // allocate shards
+    cache->nshard = qadb_nshard(cache);
+    if (cache->nshard == 0) {
+	ERROR("%s: no cache", dir);
+	goto undo;
+    }
+    cache->shard = malloc(cache->nshard * sizeof(*cache->shard));
+    if (cache->shard == NULL) {
+	ERROR("malloc: %m");
 	goto undo;
     }
 
-    // open db
-    rc = cache->db->open(cache->db, NULL, "cache.db", NULL,
-	    DB_BTREE, DB_CREATE, 0666);
-    if (rc) {
-	ERROR("db_open: %s", db_strerror(rc));
-	cache->db->close(cache->db, 0);
+    // open db files
+    for (int i = 0; i < cache->nshard; i++) {
+	if (qadb_open_shard(cache, &cache->shard[i], i))
+	    continue;
+	while (i-- > 0)
+	    qadb_close_shard(cache, &cache->shard[i]);
+	free(cache->shard);
 	goto undo;
     }
 
@@ -105,21 +274,91 @@ bool qadb_open(struct cache *cache, const char *dir)
     return true;
 }
 
+struct qadb_key {
+    int size;
+    char data[];
+};
+
+// Write out pending atime updates.  The entries are re-read under
+// the exclusive lock, because they could have been updated or deleted
+// in the meantime (a partial put would otherwise resurrect them).
+static
+void qadb_flush_atime(struct cache *cache, struct qadb_shard *sh)
+{
+    if (sh->natime == 0)
+	return;
+
+    LOCK_SHARD(cache, sh, LOCK_EX);
+    BLOCK_SIGNALS(cache);
+
+    for (int i = 0; i < sh->natime; i++) {
+	struct qadb_key *key = sh->atime[i];
+	DBT k = {
+	    .data = key->data,
+	    .size = key->size,
+	};
+	struct cache_ent vbuf;
+	DBT v = {
+	    .data = &vbuf,
+	    .ulen = sizeof(vbuf),
+	    .dlen = sizeof(vbuf),
+	    .flags = DB_DBT_USERMEM | DB_DBT_PARTIAL,
+	};
+	int rc = sh->db->get(sh->db, NULL, &k, &v, 0);
+	if (rc == 0 && v.size == sizeof(vbuf) && vbuf.atime < cache->now) {
+	    vbuf.atime = cache->now;
+	    rc = sh->db->put(sh->db, NULL, &k, &v, 0);
+	    if (rc)
+		ERROR("db_put: %s", db_strerror(rc));
+	}
+	else if (rc && rc != DB_NOTFOUND)
+	    ERROR("db_get: %s", db_strerror(rc));
+	free(key);
+    }
+    sh->natime = 0;
+
+    UNBLOCK_SIGNALS(cache);
+    UNLOCK_SHARD(sh);
+}
+
+static
+void qadb_touch(struct cache *cache, struct qadb_shard *sh,
+	const void *key, int keysize)
+{
+    struct qadb_key *k = malloc(sizeof(*k) + keysize);
+    if (k == NULL) {
+	ERROR("malloc: %m");
+	return;
+    }
+    k->size = keysize;
+    memcpy(k->data, key, keysize);
+    sh->atime[sh->natime++] = k;
+    if (sh->natime == QADB_ATIME_BATCH)
+	qadb_flush_atime(cache, sh);
+}
+
 void qadb_close(struct cache *cache)
 {
     // don't close after fork
     if (cache->pid != getpid())
 	return;
 
+    if (cache->hx) {
+	qahx_close(cache);
+	return;
+    }
+
+    for (int i = 0; i < cache->nshard; i++)
+	qadb_flush_atime(cache, &cache->shard[i]);
+
     int rc;
 
     LOCK_DIR(cache, LOCK_EX);
     BLOCK_SIGNALS(cache);
 
-    // close db
-    rc = cache->db->close(cache->db, 0);
-    if (rc)
-	ERROR("db_close: %s", db_strerror(rc));
+    // close db files
+    for (int i = 0; i < cache->nshard; i++)
+	qadb_close_shard(cache, &cache->shard[i]);
 
     // close env
     rc = cache->env->close(cache->env, 0);
@@ -128,12 +367,16 @@ void qadb_close(struct cache *cache)
 
     UNBLOCK_SIGNALS(cache);
     UNLOCK_DIR(cache);
+
+    free(cache->shard);
 }
 
 bool qadb_get(struct cache *cache,
 	const void *key, int keysize,
 	struct cache_ent *vent, int *ventsize)
 {
+    if (cache->hx)
+	return qahx_get(cache, key, keysize, vent, ventsize);
     DBT k = {
 	.data = key,
 	.size = keysize,
@@ -143,18 +386,20 @@ bool qadb_get(struct cache *cache,
 	.ulen = *ventsize,
 	.flags = DB_DBT_USERMEM,
     };
+    struct qadb_shard *sh = qadb_shard(cache, key, keysize);
 
-    // RMW lock
-    LOCK_DIR(cache, LOCK_EX);
+    // hits are served under the shared lock
+    LOCK_SHARD(cache, sh, LOCK_SH);
 
     // db->get can trigger mpool->put
     BLOCK_SIGNALS(cache);
 
-    int rc = cache->db->get(cache->db, NULL, &k, &v, 0);
+    int rc = sh->db->get(sh->db, NULL, &k, &v, 0);
+
+    UNBLOCK_SIGNALS(cache);
+    UNLOCK_SHARD(sh);
 
     if (rc) {
-	UNBLOCK_SIGNALS(cache);
-	UNLOCK_DIR(cache);
 	if (rc != DB_NOTFOUND)
 	    ERROR("db_get: %s", db_strerror(rc));
 	return false;
@@ -163,28 +408,185 @@ bool qadb_get(struct cache *cache,
     // sucessful return
     *ventsize = v.size;
 
-    // update atime
-    if (v.size >= sizeof(*vent) && vent->atime < cache->now) {
-	v.size = sizeof(*vent);
-	v.dlen = sizeof(*vent);
-	v.flags |= DB_DBT_PARTIAL;
-	vent->atime = cache->now;
-	rc = cache->db->put(cache->db, NULL, &k, &v, 0);
+    // defer atime update
+    if (v.size >= sizeof(*vent) && vent->atime < cache->now && !cache->rdonly)
+	qadb_touch(cache, sh, key, keysize);
+
+    return true;
+}
+
+struct mget_ctx {
+    struct cache *cache;
+    const void **keys;
+    const int *keysizes;
+    const unsigned char *shard;
+};
+
+// Order the keys by shard, and then as the btree does.
+static
+int mget_cmp(const void *a, const void *b, void *arg)
+{
+    const struct mget_ctx *ctx = arg;
+    int i = *(const int *) a;
+    int j = *(const int *) b;
+    if (ctx->shard[i] != ctx->shard[j])
+	return ctx->shard[i] - ctx->shard[j];
+    int size = ctx->keysizes[i] < ctx->keysizes[j] ?
+	       ctx->keysizes[i] : ctx->keysizes[j];
+    int cmp = memcmp(ctx->keys[i], ctx->keys[j], size);
+    if (cmp)
+	return cmp;
+    return ctx->keysizes[i] - ctx->keysizes[j];
+}
+
+// Look up n keys, with a single cursor pass over each shard under the
+// shared lock.  Found entries are returned in malloc'd vents[i], with
+// ventsizes[i] set; otherwise, vents[i] is set to NULL.
+void qadb_mget(struct cache *cache, int n,
+	const void *keys[], const int keysizes[],
+	void *vents[], int ventsizes[])
+{
+    if (cache->hx) {
+	qahx_mget(cache, n, keys, keysizes, vents, ventsizes);
+	return;
     }
+    for (int i = 0; i < n; i++)
+	vents[i] = NULL;
+    if (n < 1)
+	return;
 
-    UNBLOCK_SIGNALS(cache);
-    UNLOCK_DIR(cache);
+    int *order = malloc(n * (sizeof(int) + 1));
+    if (order == NULL) {
+	ERROR("malloc: %m");
+	return;
+    }
+    unsigned char *shard = (unsigned char *) (order + n);
+    for (int i = 0; i < n; i++) {
+	order[i] = i;
+	shard[i] = qadb_shard(cache, keys[i], keysizes[i]) - cache->shard;
+    }
+    struct mget_ctx ctx = { cache, keys, keysizes, shard };
+    qsort_r(order, n, sizeof(*order), mget_cmp, &ctx);
 
-    if (rc)
-	ERROR("db_put: %s", db_strerror(rc));
+    for (int j = 0; j < n; ) {
+	struct qadb_shard *sh = &cache->shard[shard[order[j]]];
+	int end = j;
+	while (end < n && shard[order[end]] == shard[order[j]])
+	    end++;
 
-    return true;
+	LOCK_SHARD(cache, sh, LOCK_SH);
+	BLOCK_SIGNALS(cache);
+
+	DBC *dbc;
+	int rc = sh->db->cursor(sh->db, NULL, &dbc, 0);
+	if (rc)
+	    ERROR("db_cursor: %s", db_strerror(rc));
+	else {
+	    for (int k = j; k < end; k++) {
+		int i = order[k];
+		DBT key = {
+		    .data = (void *) keys[i],
+		    .size = keysizes[i],
+		};
+		DBT v = {
+		    .flags = DB_DBT_MALLOC,
+		};
+		rc = dbc->get(dbc, &key, &v, DB_SET);
+		if (rc) {
+		    if (rc != DB_NOTFOUND)
+			ERROR("dbc_get: %s", db_strerror(rc));
+		    continue;
+		}
+		vents[i] = v.data;
+		ventsizes[i] = v.size;
+	    }
+	    rc = dbc->close(dbc);
+	    if (rc)
+		ERROR("dbc_close: %s", db_strerror(rc));
+	}
+
+	UNBLOCK_SIGNALS(cache);
+	UNLOCK_SHARD(sh);
+
+	// defer atime updates
+	for (int k = j; k < end && !cache->rdonly; k++) {
+	    int i = order[k];
+	    struct cache_ent *vent = vents[i];
+	    if (vent && ventsizes[i] >= (int) sizeof(*vent) && vent->atime < cache->now)
+		qadb_touch(cache, sh, keys[i], keysizes[i]);
+	}
+
+	j = end;
+    }
+
+    free(order);
+}
+
+// Walk over all db entries, shard by shard, under the shared lock,
+// until the callback returns false.
+void qadb_walk(struct cache *cache,
+	bool (*cb)(void *arg, const void *key, int keysize,
+		const struct cache_ent *vent, int ventsize),
+	void *arg)
+{
+    if (cache->hx) {
+	qahx_walk(cache, cb, arg);
+	return;
+    }
+    bool more = true;
+    for (int i = 0; i < cache->nshard && more; i++) {
+	struct qadb_shard *sh = &cache->shard[i];
+
+	LOCK_SHARD(cache, sh, LOCK_SH);
+
+	DBC *dbc;
+	BLOCK_SIGNALS(cache);
+	int rc = sh->db->cursor(sh->db, NULL, &dbc, 0);
+	UNBLOCK_SIGNALS(cache);
+
+	if (rc) {
+	    UNLOCK_SHARD(sh);
+	    ERROR("db_cursor: %s", db_strerror(rc));
+	    continue;
+	}
+
+	DBT k = { .flags = DB_DBT_REALLOC };
+	DBT v = { .flags = DB_DBT_REALLOC };
+	while (more) {
+	    BLOCK_SIGNALS(cache);
+	    rc = dbc->get(dbc, &k, &v, DB_NEXT);
+	    UNBLOCK_SIGNALS(cache);
+
+	    if (rc) {
+		if (rc != DB_NOTFOUND)
+		    ERROR("dbc_get: %s", db_strerror(rc));
+		break;
+	    }
+
+	    more = cb(arg, k.data, k.size, v.data, v.size);
+	}
+	free(k.data);
+	free(v.data);
+
+	BLOCK_SIGNALS(cache);
+	rc = dbc->close(dbc);
+	UNBLOCK_SIGNALS(cache);
+
+	if (rc)
+	    ERROR("dbc_close: %s", db_strerror(rc));
+
+	UNLOCK_SHARD(sh);
+    }
 }
 
 void qadb_put(struct cache *cache,
 	const void *key, int keysize,
 	struct cache_ent *vent, int ventsize)
 {
+    if (cache->hx) {
+	qahx_put(cache, key, keysize, vent, ventsize);
+	return;
+    }
     DBT k = {
 	.data = key,
 	.size = keysize,
@@ -195,14 +597,15 @@ void qadb_put(struct cache *cache,
     };
     vent->mtime = cache->now;
     vent->atime = cache->now;
+    struct qadb_shard *sh = qadb_shard(cache, key, keysize);
 
-    LOCK_DIR(cache, LOCK_EX);
+    LOCK_SHARD(cache, sh, LOCK_EX);
     BLOCK_SIGNALS(cache);
 
-    int rc = cache->db->put(cache->db, NULL, &k, &v, 0);
+    int rc = sh->db->put(sh->db, NULL, &k, &v, 0);
 
     UNBLOCK_SIGNALS(cache);
-    UNLOCK_DIR(cache);
+    UNLOCK_SHARD(sh);
 
     if (rc)
 	ERROR("db_put: %s", db_strerror(rc));
@@ -211,46 +614,133 @@ void qadb_put(struct cache *cache,
 void qadb_del(struct cache *cache,
 	const void *key, int keysize)
 {
+    if (cache->hx) {
+	qahx_del(cache, key, keysize);
+	return;
+    }
     DBT k = {
 	.data = key,
 	.size = keysize,
     };
+    struct qadb_shard *sh = qadb_shard(cache, key, keysize);
 
-    LOCK_DIR(cache, LOCK_EX);
+    LOCK_SHARD(cache, sh, LOCK_EX);
     BLOCK_SIGNALS(cache);
 
-    int rc = cache->db->del(cache->db, NULL, &k, 0);
+    int rc = sh->db->del(sh->db, NULL, &k, 0);
 
     UNBLOCK_SIGNALS(cache);
-    UNLOCK_DIR(cache);
+    UNLOCK_SHARD(sh);
 
     if (rc && rc != DB_NOTFOUND)
 	ERROR("db_del: %s", db_strerror(rc));
 }
 
-void qadb_clean(struct cache *cache, int days)
+// Records are cleaned in chunks, and the lock is released between
+// the chunks, so that readers and writers can get in.
+#define QADB_CLEAN_CHUNK 1024
+
+// With a time budget, the position where the cleaning stopped is saved,
+// so that the next run can resume from there.  The file holds the shard
+// number followed by the last key.
+#define CLEANPOS_FNAME "clean.pos"
+
+struct cleanpos {
+    int shard;
+    DBT key;		// the last key processed, DB_DBT_REALLOC
+};
+
+static
+void load_cleanpos(struct cache *cache, struct cleanpos *pos)
 {
-    LOCK_DIR(cache, LOCK_EX);
+    int fd = openat(cache->dirfd, CLEANPOS_FNAME, O_RDONLY);
+    if (fd < 0) {
+	if (errno != ENOENT)
+	    ERROR("openat: %m");
+	return;
+    }
+    char buf[sizeof(int) + 4096];
+    ssize_t n = read(fd, buf, sizeof(buf));
+    close(fd);
+    if (n < (ssize_t) sizeof(int) + 1 || n == sizeof(buf))
+	return;
+    int shard;
+    memcpy(&shard, buf, sizeof(int));
+    if (shard < 0 || shard >= cache->nshard)
+	return;
+    void *key = malloc(n - sizeof(int));
+    if (key == NULL) {
+	ERROR("malloc: %m");
+	return;
+    }
+    memcpy(key, buf + sizeof(int), n - sizeof(int));
+    pos->shard = shard;
+    pos->key.data = key;
+    pos->key.size = n - sizeof(int);
+}
+
+static
+void save_cleanpos(struct cache *cache, const struct cleanpos *pos)
+{
+    char tmp[sizeof(CLEANPOS_FNAME) + 9];
+    snprintf(tmp, sizeof tmp, "%s.%08x", CLEANPOS_FNAME, (unsigned) getpid());
+    SET_UMASK(cache);
+    int fd = openat(cache->dirfd, tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    UNSET_UMASK(cache);
+    if (fd < 0) {
+	ERROR("openat: %m");
+	return;
+    }
+    bool ok = write(fd, &pos->shard, sizeof(int)) == sizeof(int) &&
+	      write(fd, pos->key.data, pos->key.size) == (ssize_t) pos->key.size;
+    if (!ok)
+	ERROR("write: %m");
+    if (close(fd) < 0) {
+	ERROR("close: %m");
+	ok = false;
+    }
+    if (ok && renameat(cache->dirfd, tmp, cache->dirfd, CLEANPOS_FNAME) == 0)
+	return;
+    if (ok)
+	ERROR("renameat: %m");
+    unlinkat(cache->dirfd, tmp, 0);
+}
+
+// Process up to QADB_CLEAN_CHUNK records after pos->key (or from the
+// beginning if pos->key is empty) under the lock.  Returns false when
+// there are no more records.
+static
+bool qadb_clean_chunk(struct cache *cache, struct qadb_shard *sh, int days,
+	struct cleanpos *pos)
+{
+    LOCK_SHARD(cache, sh, LOCK_EX);
 
     DBC *dbc;
     BLOCK_SIGNALS(cache);
-    int rc = cache->db->cursor(cache->db, NULL, &dbc, 0);
+    int rc = sh->db->cursor(sh->db, NULL, &dbc, 0);
     UNBLOCK_SIGNALS(cache);
 
     if (rc) {
-	UNLOCK_DIR(cache);
+	UNLOCK_SHARD(sh);
 	ERROR("db_cursor: %s", db_strerror(rc));
-	return;
+	return false;
     }
 
-    while (1) {
-	unsigned char sha1[20] __attribute__((aligned(4)));
-	DBT k = {
-	    .data = sha1,
-	    .ulen = sizeof(sha1),
-	    .flags = DB_DBT_USERMEM,
-	};
+    // the key to resume from
+    void *last = NULL;
+    u_int32_t lastsize = pos->key.size;
+    if (lastsize) {
+	last = malloc(lastsize);
+	if (last == NULL) {
+	    ERROR("malloc: %m");
+	    rc = ENOMEM;
+	    goto out;
+	}
+	memcpy(last, pos->key.data, lastsize);
+    }
 
+    bool more = true;
+    for (int n = 0; n < QADB_CLEAN_CHUNK; n++) {
 	struct cache_ent vbuf;
 	struct cache_ent *vent = &vbuf;
 	DBT v = {
@@ -260,22 +750,25 @@ void qadb_clean(struct cache *cache, int days)
 	    .flags = DB_DBT_USERMEM | DB_DBT_PARTIAL,
 	};
 
+	// DB_SET_RANGE finds the smallest key >= last
+	int op = (n == 0 && last) ? DB_SET_RANGE : DB_NEXT;
 	BLOCK_SIGNALS(cache);
-	rc = dbc->get(dbc, &k, &v, DB_NEXT);
+	rc = dbc->get(dbc, &pos->key, &v, op);
 	UNBLOCK_SIGNALS(cache);
 
 	if (rc) {
 	    if (rc != DB_NOTFOUND)
 		ERROR("dbc_get: %s", db_strerror(rc));
+	    more = false;
 	    break;
 	}
 
-	if (k.size < sizeof(sha1)) {
-	    ERROR("sha1 too small");
+	// the last key has already been processed
+	if (op == DB_SET_RANGE && pos->key.size == lastsize &&
+		memcmp(pos->key.data, last, lastsize) == 0)
 	    continue;
-	}
 
-	if (v.size < sizeof(vent)) {
+	if (v.size < sizeof(*vent)) {
 	    ERROR("vent too small");
 	    continue;
 	}
@@ -290,13 +783,93 @@ void qadb_clean(struct cache *cache, int days)
 	if (rc)
 	    ERROR("dbc_del: %s", db_strerror(rc));
     }
+    free(last);
+    rc = more ? 0 : DB_NOTFOUND;
 
+out:
     BLOCK_SIGNALS(cache);
-    rc = dbc->close(dbc);
+    int crc = dbc->close(dbc);
     UNBLOCK_SIGNALS(cache);
 
-    if (rc)
-	ERROR("dbc_close: %s", db_strerror(rc));
+    if (crc)
+	ERROR("dbc_close: %s", db_strerror(crc));
 
-    UNLOCK_DIR(cache);
+    UNLOCK_SHARD(sh);
+    return rc == 0;
+}
+
+#include <time.h>
+#include <sched.h>
+
+void qadb_clean(struct cache *cache, int days, int budget)
+{
+    // the native engine does not hold readers while cleaning
+    if (cache->hx) {
+	qahx_clean(cache, days);
+	return;
+    }
+    struct cleanpos pos = {
+	.key = { .flags = DB_DBT_REALLOC },
+    };
+    time_t deadline = 0;
+    if (budget > 0) {
+	deadline = time(NULL) + budget;
+	load_cleanpos(cache, &pos);
+    }
+
+    for (; pos.shard < cache->nshard; pos.shard++) {
+	struct qadb_shard *sh = &cache->shard[pos.shard];
+
+	// entries which we have just read should survive
+	qadb_flush_atime(cache, sh);
+
+	while (qadb_clean_chunk(cache, sh, days, &pos)) {
+	    if (deadline && time(NULL) >= deadline) {
+		save_cleanpos(cache, &pos);
+		free(pos.key.data);
+		return;
+	    }
+	    sched_yield();
+	}
+	free(pos.key.data);
+	pos.key.data = NULL;
+	pos.key.size = 0;
+    }
+
+    // the walk is complete, start over next time
+    if (unlinkat(cache->dirfd, CLEANPOS_FNAME, 0) < 0 && errno != ENOENT)
+	ERROR("unlinkat: %m");
+}
+
+void qadb_stat(struct cache *cache, struct cache_scan *scan)
+{
+    if (cache->hx) {
+	qahx_stat(cache, scan);
+	return;
+    }
+    for (int i = 0; i < cache->nshard; i++) {
+	struct qadb_shard *sh = &cache->shard[i];
+
+	LOCK_SHARD(cache, sh, LOCK_SH);
+
+	DB_BTREE_STAT *sp;
+	BLOCK_SIGNALS(cache);
+	int rc = sh->db->stat(sh->db, NULL, &sp, 0);
+	UNBLOCK_SIGNALS(cache);
+
+	UNLOCK_SHARD(sh);
+
+	if (rc) {
+	    ERROR("db_stat: %s", db_strerror(rc));
+	    continue;
+	}
+	scan->pagesize = sp->bt_pagesize;
+	scan->pages += sp->bt_pagecnt;
+	scan->free_pages += sp->bt_free;
+	scan->leaf_pages += sp->bt_leaf_pg;
+	scan->overflow_pages += sp->bt_over_pg;
+	scan->leaf_free_bytes += sp->bt_leaf_pgfree;
+	scan->dbfile_bytes += (unsigned long long) sp->bt_pagecnt * sp->bt_pagesize;
+	free(sp);
+    }
 }
@@ -0,0 +1,303 @@
+#include "cache.h"
+#include "cache-impl.h"
+#include <zdict.h>
+
+// The dictionary is stored in the cache directory, next to cache.db.
+// It is also linked under its id, as zstd.dict.ID, and kept under this
+// name after retraining, so that older entries can still be decoded.
+#define DICT_FNAME "zstd.dict"
+#define DICT_IDNAME_SIZE (sizeof(DICT_FNAME) + 9)
+
+// Dictionaries larger than this are not loaded.
+#define MAX_DICT_SIZE (1 << 20)
+
+// The default dictionary size, as in zstd --train.
+#define DEF_DICT_SIZE (110 << 10)
+
+// Compression level, same as without the dictionary.
+#define DICT_LEVEL 3
+
+struct qaddict {
+    unsigned id;
+    ZSTD_DDict *ddict;	// NULL if it cannot be loaded
+};
+
+static
+void dict_idname(char *name, unsigned dictid)
+{
+    snprintf(name, DICT_IDNAME_SIZE, "%s.%08x", DICT_FNAME, dictid);
+}
+
+// Read a dictionary file into a malloc'd buffer; returns its id,
+// or 0 if there is no dictionary.
+static
+unsigned dict_read(struct cache *cache, const char *fname, char **bufp, size_t *sizep)
+{
+    int fd = openat(cache->dirfd, fname, O_RDONLY);
+    if (fd < 0) {
+	if (errno != ENOENT)
+	    ERROR("openat: %m");
+	return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+	ERROR("fstat: %m");
+	close(fd);
+	return 0;
+    }
+    if (st.st_size < 8 || st.st_size > MAX_DICT_SIZE) {
+	ERROR("%s: bad dictionary size", fname);
+	close(fd);
+	return 0;
+    }
+    size_t size = st.st_size;
+    char *buf = malloc(size);
+    if (buf == NULL) {
+	ERROR("malloc: %m");
+	close(fd);
+	return 0;
+    }
+    ssize_t n = pread(fd, buf, size, 0);
+    close(fd);
+    if (n != (ssize_t) size) {
+	if (n < 0)
+	    ERROR("pread: %m");
+	else
+	    ERROR("%s: short read", fname);
+	free(buf);
+	return 0;
+    }
+
+    // only trained dictionaries have an id, which is also recorded
+    // in the frames, so that the dictionary can be found
+    unsigned dictid = ZDICT_getDictID(buf, size);
+    if (dictid == 0) {
+	ERROR("%s: not a zstd dictionary", fname);
+	free(buf);
+	return 0;
+    }
+    *bufp = buf;
+    *sizep = size;
+    return dictid;
+}
+
+void qadict_load(struct cache *cache)
+{
+    cache->cdict = NULL;
+    cache->ddict = NULL;
+    cache->dictid = 0;
+    cache->ddicts = NULL;
+    cache->nddict = 0;
+
+    char *buf;
+    size_t size;
+    unsigned dictid = dict_read(cache, DICT_FNAME, &buf, &size);
+    if (dictid == 0)
+	return;
+    cache->cdict = ZSTD_createCDict(buf, size, DICT_LEVEL);
+    cache->ddict = ZSTD_createDDict(buf, size);
+    free(buf);
+    if (cache->cdict == NULL || cache->ddict == NULL) {
+	ERROR("cannot load zstd dictionary");
+	qadict_free(cache);
+	return;
+    }
+    cache->dictid = dictid;
+}
+
+// The dictionary to decode a frame with the given dict id: the current
+// one, or a previous one, which is loaded once per cache_open.
+const ZSTD_DDict *qadict_ddict(struct cache *cache, unsigned dictid)
+{
+    if (dictid == 0)
+	return NULL;
+    if (dictid == cache->dictid)
+	return cache->ddict;
+    for (int i = 0; i < cache->nddict; i++)
+	if (cache->ddicts[i].id == dictid)
+	    return cache->ddicts[i].ddict;
+    struct qaddict *ddicts = realloc(cache->ddicts,
+	    (cache->nddict + 1) * sizeof(*ddicts));
+    if (ddicts == NULL) {
+	ERROR("realloc: %m");
+	return NULL;
+    }
+    cache->ddicts = ddicts;
+    struct qaddict *d = &ddicts[cache->nddict++];
+    d->id = dictid;
+    d->ddict = NULL;
+    char name[DICT_IDNAME_SIZE];
+    dict_idname(name, dictid);
+    char *buf;
+    size_t size;
+    unsigned id = dict_read(cache, name, &buf, &size);
+    if (id == 0)
+	return NULL;
+    if (id != dictid)
+	ERROR("%s: dictionary id mismatch", name);
+    else if ((d->ddict = ZSTD_createDDict(buf, size)) == NULL)
+	ERROR("cannot load zstd dictionary");
+    free(buf);
+    return d->ddict;
+}
+
+void qadict_free(struct cache *cache)
+{
+    ZSTD_freeCDict(cache->cdict);
+    ZSTD_freeDDict(cache->ddict);
+    for (int i = 0; i < cache->nddict; i++)
+	ZSTD_freeDDict(cache->ddicts[i].ddict);
+    free(cache->ddicts);
+    cache->cdict = NULL;
+    cache->ddict = NULL;
+    cache->dictid = 0;
+    cache->ddicts = NULL;
+    cache->nddict = 0;
+}
+
+// Link the dictionary file under its id, unless it is already there.
+static
+bool dict_link(struct cache *cache, const char *fname, unsigned dictid)
+{
+    char name[DICT_IDNAME_SIZE];
+    dict_idname(name, dictid);
+    if (linkat(cache->dirfd, fname, cache->dirfd, name, 0) < 0 && errno != EEXIST) {
+	ERROR("linkat: %m");
+	return false;
+    }
+    return true;
+}
+
+struct samples {
+    struct cache *cache;
+    char *buf;
+    size_t size, maxsize;
+    size_t *sizes;
+    unsigned n, alloc;
+};
+
+static
+bool add_sample(void *arg, const void *key, int keysize,
+	const struct cache_ent *vent, int ventsize)
+{
+    (void) key;
+    (void) keysize;
+    struct samples *ss = arg;
+    void *val;
+    int valsize;
+    if (!cache_decode(ss->cache, vent, ventsize, false, &val, &valsize))
+	return true;
+    if (valsize == 0)
+	return true;
+    if (ss->size + valsize > ss->maxsize) {
+	free(val);
+	// keep going unless the buffer is nearly full
+	return ss->size < ss->maxsize - ss->maxsize / 16;
+    }
+    if (ss->n == ss->alloc) {
+	unsigned alloc = ss->alloc ? 2 * ss->alloc : 1024;
+	size_t *sizes = realloc(ss->sizes, alloc * sizeof(*sizes));
+	if (sizes == NULL) {
+	    ERROR("realloc: %m");
+	    free(val);
+	    return false;
+	}
+	ss->sizes = sizes;
+	ss->alloc = alloc;
+    }
+    memcpy(ss->buf + ss->size, val, valsize);
+    ss->size += valsize;
+    ss->sizes[ss->n++] = valsize;
+    free(val);
+    return true;
+}
+
+bool cache_train(struct cache *cache, int dictsize)
+{
+    if (cache->rdonly) {
+	ERROR("cache opened in read-only mode");
+	return false;
+    }
+    if (dictsize <= 0)
+	dictsize = DEF_DICT_SIZE;
+    if (dictsize > MAX_DICT_SIZE) {
+	ERROR("dictionary size too big: %d", dictsize);
+	return false;
+    }
+
+    // zstd recommends about 100 times as much samples as the dictionary
+    struct samples ss = {
+	.cache = cache,
+	.maxsize = 100 * (size_t) dictsize,
+    };
+    ss.buf = malloc(ss.maxsize);
+    if (ss.buf == NULL) {
+	ERROR("malloc: %m");
+	return false;
+    }
+    qadb_walk(cache, add_sample, &ss);
+
+    bool ok = false;
+    char *dict = malloc(dictsize);
+    if (dict == NULL) {
+	ERROR("malloc: %m");
+	goto out;
+    }
+    size_t size = ZDICT_trainFromBuffer(dict, dictsize, ss.buf, ss.sizes, ss.n);
+    if (ZDICT_isError(size)) {
+	ERROR("ZDICT_trainFromBuffer: %s (%u samples)", ZDICT_getErrorName(size), ss.n);
+	goto out;
+    }
+
+    // write to a temporary file, then rename
+    char tmp[sizeof(DICT_FNAME) + 16];
+    snprintf(tmp, sizeof tmp, "%s.tmp.%d", DICT_FNAME, (int) getpid());
+    SET_UMASK(cache);
+    int fd = openat(cache->dirfd, tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    UNSET_UMASK(cache);
+    if (fd < 0) {
+	ERROR("openat: %m");
+	goto out;
+    }
+    ssize_t n = write(fd, dict, size);
+    if (n != (ssize_t) size) {
+	if (n < 0)
+	    ERROR("write: %m");
+	else
+	    ERROR("write: short write");
+	close(fd);
+	unlinkat(cache->dirfd, tmp, 0);
+	goto out;
+    }
+    if (close(fd) < 0) {
+	ERROR("close: %m");
+	unlinkat(cache->dirfd, tmp, 0);
+	goto out;
+    }
+    // the dictionary which is replaced may not be linked under its id
+    // yet, if it was trained by an older version
+    char *old;
+    size_t oldsize;
+    unsigned oldid = dict_read(cache, DICT_FNAME, &old, &oldsize);
+    if (oldid) {
+	free(old);
+	dict_link(cache, DICT_FNAME, oldid);
+    }
+    if (!dict_link(cache, tmp, ZDICT_getDictID(dict, size))) {
+	unlinkat(cache->dirfd, tmp, 0);
+	goto out;
+    }
+    if (renameat(cache->dirfd, tmp, cache->dirfd, DICT_FNAME) < 0) {
+	ERROR("renameat: %m");
+	unlinkat(cache->dirfd, tmp, 0);
+	goto out;
+    }
+    ok = true;
+out:
+    free(dict);
+    free(ss.sizes);
+    free(ss.buf);
+    return ok;
+}
+
+// ex:ts=8 sts=4 sw=4 noet
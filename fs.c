@@ -44,16 +44,23 @@ bool qafs_get(struct cache *cache,
     int rc = fstat(fd, &st);
     if (rc < 0) {
 	ERROR("fstat: %m");
+	close(fd);
 	return false;
     }
     int valsize = st.st_size;
-    void *val = mmap(NULL, valsize, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+    // large entries are read sequentially, possibly in a streaming
+    // fashion, and need not be resident all at once
+    bool large = valsize >= QAFS_STREAM_SIZE;
+    void *val = mmap(NULL, valsize, PROT_READ,
+	    large ? MAP_SHARED : MAP_SHARED | MAP_POPULATE, fd, 0);
     if (val == MAP_FAILED) {
 	ERROR("mmap: %m");
 	close(fd);
 	return false;
     }
     close(fd);
+    if (large && madvise(val, valsize, MADV_SEQUENTIAL) < 0)
+	ERROR("madvise: %m");
     if (valp)
 	*valp = val;
     if (valsizep)
@@ -61,6 +68,228 @@ bool qafs_get(struct cache *cache,
     return true;
 }
 
+#ifdef HAVE_LIBURING
+#include <stdint.h>
+#include <liburing.h>
+
+// The number of entries in flight.
+#define QAFS_URING_DEPTH 64
+
+struct uring_req {
+    char fname[42];
+    int fd;
+    bool stat_ok;
+    struct statx stx;
+};
+
+// The ring is set up by the first qafs_mget and kept with the cache.
+struct qafs_uring {
+    struct io_uring ring;
+    pid_t pid;				// a forked child sets up its own
+    struct uring_req ur[QAFS_URING_DEPTH];
+};
+
+// Tags of completions: the request index, and the stage.
+#define TAG(k, op) ((void *) (uintptr_t) (2 * (k) + (op)))
+#define TAG_K(tag) ((uintptr_t) (tag) / 2)
+#define TAG_OP(tag) ((uintptr_t) (tag) % 2)
+
+// The state of the ring after a batch.  After a short submit, the
+// leftover entries are still queued, and the ring must be set up anew.
+// If completions cannot be reaped, the kernel may still be writing into
+// the buffers; they are leaked along with the ring.
+enum { URING_OK, URING_RESET, URING_STUCK };
+
+static
+int uring_wait(struct io_uring *ring, struct io_uring_cqe **cqe)
+{
+    int rc;
+    do
+	rc = io_uring_wait_cqe(ring, cqe);
+    while (rc == -EINTR);
+    if (rc < 0) {
+	errno = -rc;
+	ERROR("io_uring_wait_cqe: %m");
+    }
+    return rc;
+}
+
+// Submit n prepared entries, returns the number actually submitted.
+static
+int uring_submit(struct io_uring *ring, int n)
+{
+    int done = 0;
+    while (done < n) {
+	int rc = io_uring_submit(ring);
+	if (rc == -EINTR)
+	    continue;
+	if (rc < 0) {
+	    errno = -rc;
+	    ERROR("io_uring_submit: %m");
+	    break;
+	}
+	if (rc == 0) {
+	    ERROR("io_uring_submit: %d entries left", n - done);
+	    break;
+	}
+	done += rc;
+    }
+    return done;
+}
+
+static
+int uring_batch(struct cache *cache, struct io_uring *ring,
+	int m, struct qafs_mreq *req, struct uring_req *ur)
+{
+    // open and stat all files at once
+    for (int k = 0; k < m; k++) {
+	sha1_filename(req[k].sha1, ur[k].fname, 0);
+	ur[k].fd = -1;
+	ur[k].stat_ok = false;
+	struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+	io_uring_prep_openat(sqe, cache->dirfd, ur[k].fname, O_RDONLY | O_CLOEXEC, 0);
+	io_uring_sqe_set_data(sqe, TAG(k, 0));
+	sqe = io_uring_get_sqe(ring);
+	io_uring_prep_statx(sqe, cache->dirfd, ur[k].fname, 0, STATX_SIZE, &ur[k].stx);
+	io_uring_sqe_set_data(sqe, TAG(k, 1));
+    }
+    int status = URING_OK;
+    int n = uring_submit(ring, 2 * m);
+    if (n < 2 * m)
+	status = URING_RESET;
+    for (int c = 0; c < n; c++) {
+	struct io_uring_cqe *cqe;
+	if (uring_wait(ring, &cqe) < 0) {
+	    // the fds which did arrive can go, statx may still be pending
+	    status = URING_STUCK;
+	    goto out;
+	}
+	void *tag = io_uring_cqe_get_data(cqe);
+	int k = TAG_K(tag);
+	int res = cqe->res;
+	io_uring_cqe_seen(ring, cqe);
+	if (TAG_OP(tag) == 0) {
+	    if (res >= 0)
+		ur[k].fd = res;
+	    else if (res == -ENOENT)
+		req[k].ventsize = -1;
+	}
+	else
+	    ur[k].stat_ok = res == 0;
+    }
+    if (status != URING_OK)
+	goto out;
+
+    // then read all files at once; large files are left for qafs_get.
+    // statx went by name, and the file could have been replaced after
+    // the open: one more byte is read, to check the size at EOF.
+    int nread = 0;
+    for (int k = 0; k < m; k++) {
+	if (ur[k].fd < 0 || !ur[k].stat_ok)
+	    continue;
+	unsigned long long size = ur[k].stx.stx_size;
+	if (size < 1 || size >= QAFS_STREAM_SIZE)
+	    continue;
+	req[k].vent = malloc(size + 1);
+	if (req[k].vent == NULL) {
+	    ERROR("malloc: %m");
+	    continue;
+	}
+	req[k].ventsize = size;
+	struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+	io_uring_prep_read(sqe, ur[k].fd, req[k].vent, size + 1, 0);
+	io_uring_sqe_set_data(sqe, TAG(k, 0));
+	nread++;
+    }
+    n = uring_submit(ring, nread);
+    if (n < nread)
+	status = URING_RESET;
+    bool done[QAFS_URING_DEPTH] = { false };
+    for (int c = 0; c < n; c++) {
+	struct io_uring_cqe *cqe;
+	if (uring_wait(ring, &cqe) < 0) {
+	    status = URING_STUCK;
+	    break;
+	}
+	int k = TAG_K(io_uring_cqe_get_data(cqe));
+	done[k] = cqe->res == req[k].ventsize;
+	io_uring_cqe_seen(ring, cqe);
+    }
+    // short, long or failed reads are retried with qafs_get
+    for (int k = 0; k < m; k++) {
+	if (req[k].vent && !done[k]) {
+	    if (status != URING_STUCK)
+		free(req[k].vent);
+	    req[k].vent = NULL;
+	    req[k].ventsize = 0;
+	}
+    }
+out:
+    for (int k = 0; k < m; k++)
+	if (ur[k].fd >= 0)
+	    close(ur[k].fd);
+    return status;
+}
+
+static
+struct qafs_uring *uring_get(struct cache *cache)
+{
+    struct qafs_uring *u = cache->uring;
+    if (u && u->pid != getpid()) {
+	io_uring_queue_exit(&u->ring);
+	free(u);
+	u = cache->uring = NULL;
+    }
+    if (u || cache->no_uring)
+	return u;
+    u = malloc(sizeof(*u));
+    if (u == NULL) {
+	ERROR("malloc: %m");
+	return NULL;
+    }
+    int rc = io_uring_queue_init(2 * QAFS_URING_DEPTH, &u->ring, 0);
+    if (rc < 0) {
+	// old kernel, or io_uring disabled: qafs_get will do
+	free(u);
+	cache->no_uring = true;
+	return NULL;
+    }
+    u->pid = getpid();
+    return cache->uring = u;
+}
+#endif
+
+void qafs_mget(struct cache *cache, int n, struct qafs_mreq *req)
+{
+    for (int k = 0; k < n; k++) {
+	req[k].vent = NULL;
+	req[k].ventsize = 0;
+    }
+#ifdef HAVE_LIBURING
+    if (n < 2)
+	return;
+    struct qafs_uring *u = uring_get(cache);
+    if (u == NULL)
+	return;
+    for (int k = 0; k < n; k += QAFS_URING_DEPTH) {
+	int m = n - k < QAFS_URING_DEPTH ? n - k : QAFS_URING_DEPTH;
+	int status = uring_batch(cache, &u->ring, m, req + k, u->ur);
+	if (status == URING_OK)
+	    continue;
+	if (status == URING_RESET) {
+	    io_uring_queue_exit(&u->ring);
+	    free(u);
+	}
+	else
+	    cache->no_uring = true;
+	cache->uring = NULL;
+	break;
+    }
+#else
+    (void) cache;
+#endif
+}
+
 void qafs_unget(void *val, int valsize)
 {
     int rc = munmap(val, valsize);
@@ -68,94 +297,278 @@ void qafs_unget(void *val, int valsize)
 	ERROR("munmap: %m");
 }
 
+void qafs_open(struct cache *cache)
+{
+    memset(cache->subdirs, 0, sizeof(cache->subdirs));
+    cache->no_tmpfile = false;
+    cache->fsdirty = false;
+    cache->uring = NULL;
+    cache->no_uring = false;
+    cache->sync = QAFS_SYNC_NONE;
+    const char *sync = getenv("QACACHE_SYNC");
+    if (sync == NULL || *sync == '\0' || strcmp(sync, "none") == 0)
+	return;
+    if (strcmp(sync, "fdatasync") == 0)
+	cache->sync = QAFS_SYNC_FDATASYNC;
+    else if (strcmp(sync, "syncfs") == 0)
+	cache->sync = QAFS_SYNC_SYNCFS;
+    else
+	ERROR("QACACHE_SYNC: invalid value: %s", sync);
+}
+
+void qafs_close(struct cache *cache)
+{
+    if (cache->sync == QAFS_SYNC_SYNCFS && cache->fsdirty) {
+	if (syncfs(cache->dirfd) < 0)
+	    ERROR("syncfs: %m");
+    }
+#ifdef HAVE_LIBURING
+    struct qafs_uring *u = cache->uring;
+    if (u) {
+	io_uring_queue_exit(&u->ring);
+	free(u);
+    }
+#endif
+}
+
+#define SUBDIR_KNOWN(cache, sha1) \
+    (cache->subdirs[sha1[0] >> 3] & (1 << (sha1[0] & 7)))
+#define SUBDIR_SET(cache, sha1) \
+    cache->subdirs[sha1[0] >> 3] |= (1 << (sha1[0] & 7))
+#define SUBDIR_CLEAR(cache, sha1) \
+    cache->subdirs[sha1[0] >> 3] &= ~(1 << (sha1[0] & 7))
+
+static
+bool qafs_write(int fd, const void *val, int valsize)
+{
+    int off = 0;
+    while (off < valsize) {
+	ssize_t n = pwrite(fd, (const char *) val + off, valsize - off, off);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    ERROR("pwrite: %m");
+	    return false;
+	}
+	off += n;
+    }
+    return true;
+}
+
+// Give an O_TMPFILE file a name.  AT_EMPTY_PATH requires
+// CAP_DAC_READ_SEARCH; otherwise, the file is linked through /proc.
+static
+int qafs_linkat(int fd, int dirfd, const char *fname)
+{
+    int rc = linkat(fd, "", dirfd, fname, AT_EMPTY_PATH);
+    if (rc == 0 || (errno != ENOENT && errno != EPERM))
+	return rc;
+    char proc[sizeof("/proc/self/fd/") + 11];
+    snprintf(proc, sizeof proc, "/proc/self/fd/%d", fd);
+    return linkat(AT_FDCWD, proc, dirfd, fname, AT_SYMLINK_FOLLOW);
+}
+
+// Link an O_TMPFILE file in place.  Unlike rename, linkat does not
+// replace an existing entry; in this case, the file is linked under
+// the temporary name, and then renamed.  Returns false, with errno
+// set, if the file cannot be linked at all.
+static
+bool qafs_link(struct cache *cache, int fd, const char *tmpfname, const char *fname)
+{
+    int rc = qafs_linkat(fd, cache->dirfd, fname);
+    if (rc == 0)
+	return true;
+    if (errno != EEXIST)
+	return false;
+    rc = qafs_linkat(fd, cache->dirfd, tmpfname);
+    if (rc < 0)
+	return false;
+    rc = renameat(cache->dirfd, tmpfname, cache->dirfd, fname);
+    if (rc < 0) {
+	ERROR("renameat: %m");
+	unlinkat(cache->dirfd, tmpfname, 0);
+    }
+    return true;
+}
+
 void qafs_put(struct cache *cache,
 	const unsigned char *sha1,
 	const void *val, int valsize)
 {
-    // open tmp file
     char fname[51];
     sha1_filename(sha1, fname, cache->pid);
-    fname[2] = '\0';
     SET_UMASK(cache);
-    int rc = mkdirat(cache->dirfd, fname, 0777);
-    if (rc < 0 && errno != EEXIST)
-	ERROR("mkdirat: %m");
-    fname[2] = '/';
-    int fd = openat(cache->dirfd, fname, O_RDWR | O_CREAT | O_EXCL, 0666);
+
+    // make the subdirectory, unless we know it exists
+    int rc;
+    if (!SUBDIR_KNOWN(cache, sha1)) {
+	fname[2] = '\0';
+	rc = mkdirat(cache->dirfd, fname, 0777);
+	if (rc < 0 && errno != EEXIST)
+	    ERROR("mkdirat: %m");
+	else
+	    SUBDIR_SET(cache, sha1);
+	fname[2] = '/';
+    }
+
+    // open anonymous file in the subdirectory, if supported
+    int fd;
+    bool tmpfile;
+retry:
+    fd = -1;
+    tmpfile = false;
+    if (!cache->no_tmpfile) {
+	fname[2] = '\0';
+	fd = openat(cache->dirfd, fname, O_WRONLY | O_TMPFILE, 0666);
+	fname[2] = '/';
+	if (fd >= 0)
+	    tmpfile = true;
+	else if (errno == EOPNOTSUPP || errno == EISDIR || errno == EINVAL)
+	    cache->no_tmpfile = true;
+    }
+    // otherwise, open tmp file
+    if (fd < 0)
+	fd = openat(cache->dirfd, fname, O_WRONLY | O_CREAT | O_EXCL, 0666);
     if (fd < 0) {
+	// the subdirectory could have been removed
+	if (errno == ENOENT)
+	    SUBDIR_CLEAR(cache, sha1);
 	ERROR("openat: %m");
 	UNSET_UMASK(cache);
 	return;
     }
     UNSET_UMASK(cache);
 
-    // extend and mmap for write
-    rc = ftruncate(fd, valsize);
-    if (rc < 0) {
-	ERROR("ftruncate: %m");
-	close(fd);
-	return;
-    }
-    void *dest = mmap(NULL, valsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
-    if (dest == MAP_FAILED) {
-	ERROR("mmap: %m");
+    // write data
+    if (!qafs_write(fd, val, valsize)) {
 	close(fd);
+	if (!tmpfile)
+	    unlinkat(cache->dirfd, fname, 0);
 	return;
     }
-    close(fd);
-
-    // write data
-    memcpy(dest, val, valsize);
-    rc = munmap(dest, valsize);
-    if (rc < 0)
-	ERROR("munmap: %m");
+    if (cache->sync == QAFS_SYNC_FDATASYNC && fdatasync(fd) < 0)
+	ERROR("fdatasync: %m");
 
     // move to permanent location
     char outfname[42];
     memcpy(outfname, fname, 41);
     outfname[41] = '\0';
-    rc = renameat(cache->dirfd, fname, cache->dirfd, outfname);
-    if (rc < 0)
-	ERROR("renameat: %m");
+    if (tmpfile) {
+	if (!qafs_link(cache, fd, fname, outfname)) {
+	    // without /proc, the file cannot be linked; unless the
+	    // subdirectory has been removed, write it under the tmp name
+	    int err = errno;
+	    fname[2] = '\0';
+	    bool gone = err == ENOENT && faccessat(cache->dirfd, fname, F_OK, 0) < 0;
+	    fname[2] = '/';
+	    errno = err;
+	    if (gone) {
+		SUBDIR_CLEAR(cache, sha1);
+		ERROR("linkat: %m");
+	    }
+	    else if (err == ENOENT || err == EPERM) {
+		close(fd);
+		cache->no_tmpfile = true;
+		SET_UMASK(cache);
+		goto retry;
+	    }
+	    else
+		ERROR("linkat: %m");
+	}
+    }
+    else {
+	rc = renameat(cache->dirfd, fname, cache->dirfd, outfname);
+	if (rc < 0) {
+	    ERROR("renameat: %m");
+	    unlinkat(cache->dirfd, fname, 0);
+	}
+    }
+    close(fd);
+    cache->fsdirty = true;
 }
 
-void qafs_clean(struct cache *cache, int days)
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// Only atime and mtime are needed, and they need not be exact,
+// which statx can provide more cheaply, e.g. on network filesystems.
+static
+bool qafs_times(int dirfd, const char *name,
+	unsigned short *mtime, unsigned short *atime)
 {
-    static const char hex[] = "0123456789abcdef";
-    const char *a1, *a2;
-    for (a1 = hex; *a1; a1++)
-    for (a2 = hex; *a2; a2++) {
-	int rc;
-	const char dir[] = { *a1, *a2, '\0' };
-	int dirfd = openat(cache->dirfd, dir, O_RDONLY | O_DIRECTORY);
-	if (dirfd < 0) {
+#ifdef STATX_ATIME
+    static int no_statx;
+    if (!__atomic_load_n(&no_statx, __ATOMIC_RELAXED)) {
+	struct statx stx;
+	if (statx(dirfd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+		    STATX_ATIME | STATX_MTIME, &stx) == 0) {
+	    *mtime = stx.stx_mtime.tv_sec / 3600 / 24;
+	    *atime = stx.stx_atime.tv_sec / 3600 / 24;
+	    return true;
+	}
+	if (errno != ENOSYS) {
 	    if (errno != ENOENT)
-		ERROR("openat: %m");
-	    continue;
+		ERROR("statx: %m");
+	    return false;
 	}
+	__atomic_store_n(&no_statx, 1, __ATOMIC_RELAXED);
+    }
+#endif
+    struct stat st;
+    if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW)) {
+	if (errno != ENOENT)
+	    ERROR("fstatat: %m");
+	return false;
+    }
+    *mtime = st.st_mtime / 3600 / 24;
+    *atime = st.st_atime / 3600 / 24;
+    return true;
+}
 
-	DIR *dirp = fdopendir(dirfd);
-	if (dirp == NULL) {
-	    ERROR("fdopendir: %m");
-	    close(dirfd);
-	    continue;
+static
+void qafs_clean_subdir(struct cache *cache, int days, int i,
+	unsigned long *nscan, unsigned long *nfree)
+{
+    static const char hex[] = "0123456789abcdef";
+    const char dir[] = { hex[i >> 4], hex[i & 0x0f], '\0' };
+    int dirfd = openat(cache->dirfd, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd < 0) {
+	if (errno != ENOENT)
+	    ERROR("openat: %m");
+	return;
+    }
+
+    char buf[32 << 10] __attribute__((aligned(8)));
+    while (1) {
+	long nread = syscall(SYS_getdents64, dirfd, buf, sizeof(buf));
+	if (nread < 0) {
+	    ERROR("getdents64: %m");
+	    break;
 	}
+	if (nread == 0)
+	    break;
+	for (long off = 0; off < nread; ) {
+	    struct linux_dirent64 *dent = (void *) (buf + off);
+	    off += dent->d_reclen;
 
-	struct dirent *dent;
-	while ((dent = readdir(dirp)) != NULL) {
 	    int len = strlen(dent->d_name);
 	    if (len < 38)
 		continue;
 
-	    struct stat st;
-	    rc = fstatat(dirfd, dent->d_name, &st, 0);
-	    if (rc) {
-		ERROR("fstatat: %m");
+	    unsigned short mtime, atime;
+	    if (!qafs_times(dirfd, dent->d_name, &mtime, &atime))
 		continue;
-	    }
+	    (*nscan)++;
 
-	    unsigned short mtime = st.st_mtime / 3600 / 24;
-	    unsigned short atime = st.st_atime / 3600 / 24;
 	    if (len == 38) {
 		if (mtime + days >= cache->now) continue;
 		if (atime + days >= cache->now) continue;
@@ -166,13 +579,163 @@ void qafs_clean(struct cache *cache, int days)
 		if (atime + 1 >= cache->now) continue;
 	    }
 
-	    rc = unlinkat(dirfd, dent->d_name, 0);
-	    if (rc)
-		ERROR("unlinkat: %m");
+	    if (unlinkat(dirfd, dent->d_name, 0)) {
+		if (errno != ENOENT)
+		    ERROR("unlinkat: %m");
+		continue;
+	    }
+	    (*nfree)++;
 	}
+    }
+
+    if (close(dirfd))
+	ERROR("close: %m");
+}
+
+// The entry header and the beginning of the compressed data, enough
+// for the zstd frame header.
+#define QAFS_SCAN_HDR 64
 
-	rc = closedir(dirp);
-	if (rc)
-	    ERROR("closedir: %m");
+// Read the headers with O_NOATIME, so that the scan does not count as use;
+// the flag is only permitted to the owner, otherwise only sizes are taken.
+static
+void qafs_scan_subdir(struct cache *cache, struct cache_scan *scan, int i)
+{
+    static const char hex[] = "0123456789abcdef";
+    const char dir[] = { hex[i >> 4], hex[i & 0x0f], '\0' };
+    int dirfd = openat(cache->dirfd, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd < 0) {
+	if (errno != ENOENT)
+	    ERROR("openat: %m");
+	return;
+    }
+
+    char buf[32 << 10] __attribute__((aligned(8)));
+    while (1) {
+	long nread = syscall(SYS_getdents64, dirfd, buf, sizeof(buf));
+	if (nread < 0) {
+	    ERROR("getdents64: %m");
+	    break;
+	}
+	if (nread == 0)
+	    break;
+	for (long off = 0; off < nread; ) {
+	    struct linux_dirent64 *dent = (void *) (buf + off);
+	    off += dent->d_reclen;
+
+	    // temporary files are not entries yet
+	    if (strlen(dent->d_name) != 38)
+		continue;
+
+	    char hdr[QAFS_SCAN_HDR] __attribute__((aligned(8)));
+	    ssize_t n = 0;
+	    struct stat st;
+	    int fd = openat(dirfd, dent->d_name, O_RDONLY | O_NOATIME | O_CLOEXEC);
+	    if (fd >= 0) {
+		if (fstat(fd, &st) < 0) {
+		    ERROR("fstat: %m");
+		    close(fd);
+		    continue;
+		}
+		n = pread(fd, hdr, sizeof hdr, 0);
+		if (n < 0) {
+		    ERROR("pread: %m");
+		    n = 0;
+		}
+		close(fd);
+	    }
+	    else if (errno == EPERM) {
+		if (fstatat(dirfd, dent->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+		    continue;
+	    }
+	    else {
+		if (errno != ENOENT)
+		    ERROR("openat: %m");
+		continue;
+	    }
+	    if (st.st_size > INT_MAX)
+		continue;
+	    qascan_ent(cache, scan, true, (void *) hdr, n, st.st_size,
+		    st.st_mtime / 3600 / 24, st.st_atime / 3600 / 24);
+	}
+    }
+
+    if (close(dirfd))
+	ERROR("close: %m");
+}
+
+void qafs_scan(struct cache *cache, struct cache_scan *scan)
+{
+    for (int i = 0; i < 256; i++)
+	qafs_scan_subdir(cache, scan, i);
+}
+
+struct clean_ctx {
+    struct cache *cache;
+    int days;
+    int next;
+    pthread_mutex_t mutex;
+    struct cache_clean_stats st;
+    cache_clean_cb progress;
+    void *arg;
+};
+
+// Workers take subdirectories one by one.
+static
+void *qafs_clean_worker(void *arg)
+{
+    struct clean_ctx *ctx = arg;
+    while (1) {
+	int i = __atomic_fetch_add(&ctx->next, 1, __ATOMIC_RELAXED);
+	if (i >= 256)
+	    break;
+	unsigned long nscan = 0, nfree = 0;
+	qafs_clean_subdir(ctx->cache, ctx->days, i, &nscan, &nfree);
+	pthread_mutex_lock(&ctx->mutex);
+	ctx->st.ndirs++;
+	ctx->st.nscan += nscan;
+	ctx->st.nfree += nfree;
+	if (ctx->progress)
+	    ctx->progress(ctx->arg, &ctx->st);
+	pthread_mutex_unlock(&ctx->mutex);
+    }
+    return NULL;
+}
+
+// The number of worker threads, unless specified.
+#define QAFS_CLEAN_MAX_JOBS 16
+
+void qafs_clean(struct cache *cache, int days, int jobs,
+	cache_clean_cb progress, void *arg)
+{
+    if (jobs < 1) {
+	jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (jobs > QAFS_CLEAN_MAX_JOBS)
+	    jobs = QAFS_CLEAN_MAX_JOBS;
+	if (jobs < 1)
+	    jobs = 1;
+    }
+    struct clean_ctx ctx = {
+	.cache = cache,
+	.days = days,
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.progress = progress,
+	.arg = arg,
+    };
+    // the calling thread is one of the workers
+    pthread_t thr[jobs];
+    int nthr = 0;
+    while (nthr < jobs - 1) {
+	int rc = pthread_create(&thr[nthr], NULL, qafs_clean_worker, &ctx);
+	if (rc) {
+	    errno = rc;
+	    ERROR("pthread_create: %m");
+	    break;
+	}
+	nthr++;
     }
+    qafs_clean_worker(&ctx);
+    while (nthr-- > 0)
+	pthread_join(thr[nthr], NULL);
+    pthread_mutex_destroy(&ctx.mutex);
 }
@@ -2,89 +2,1092 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <ctype.h>
 #include <assert.h>
 #include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
 #include <rpm/rpmlib.h>
 #include <lz4.h>
 #include "hdrcache.h"
+#include "cache.h"
 #include "mcdb.h"
 
+// In-process LRU of recently read headers, enabled by setting
+// RPMHDRCACHE_LRU to the memory budget, e.g. "64M".  Hits return
+// the same Header object with a new reference; since headers are
+// mutable, this is only useful if the consumers don't modify them
+// (nor release them in a few threads at once).
+struct lru_ent {
+    struct lru_ent *prev, *next;	// most recently used first
+    struct lru_ent *hnext;		// hash chain
+    unsigned hash;
+    Header h;
+    unsigned off;
+    rpmRC rc;
+    size_t size;
+    struct rpmkey key;
+};
+
+#define LRU_NBUCKET 4096
+
+struct lru {
+    size_t size, maxsize;
+    struct lru_ent *first, *last;
+    struct lru_ent *bucket[LRU_NBUCKET];
+    unsigned long hits, misses;
+};
+
+// Headers are written to the cache by a background thread, which takes
+// the unloaded blobs, so that compression and the backend write are off
+// the caller's path.  When the queue is full, the caller waits.
+#define WQ_MAX_BYTES (32 << 20)
+
+struct wq_ent {
+    struct wq_ent *next;
+    struct rpmkey key;
+    void *blob;
+    int blobsize;
+    unsigned off;
+    rpmRC rc;
+};
+
+struct wq {
+    pthread_mutex_t lock;
+    pthread_cond_t more;	// new entries or stop
+    pthread_cond_t room;	// the queue has shrunk
+    pthread_t thr;
+    int pid;			// the process running the thread, 0 if none
+    bool stop;
+    struct wq_ent *head, **tail;
+    size_t bytes;
+};
+
+// Any valid rpm header must provide at least the number of its
+// index entries and the size of its data.
+#define HDRSIZE_MIN 8
+// The maximum size of RPM header which we even try to deal with.
+// Note that the default size limit in memcached is 1MiB, but it
+// can be increased to 128MiB.  Thus the uncompressed size of
+// a header is limited to 256MiB.  This is also the limit imposed
+// in recent rpm releases.
+#define HDRSIZE_MAX (1 << 28)
+
+// Assume that LZ4 cannot compress an 8-byte header.
+#define ENTSIZE_MIN (sizeof(struct cache_ent) + HDRSIZE_MIN)
+
+// Entry format: <header> <proj> <rc> <off>, with the projection id, the
+// rc returned by rpm and the offset past the header, in host byte order.
+// Older entries have no projection, or neither projection nor rc, which
+// then are 0 (the full header) and RPMRC_OK.
+//
+// Failed reads (RPMRC_FAIL, RPMRC_NOTFOUND) are cached as <rc> <time>,
+// which is too short to be a header, and replayed for
+// RPMHDRCACHE_NEGATIVE_TTL seconds, 300 by default; "0" disables it.
+#define NEG_DEF_TTL 300
+
+struct neg {
+    uint32_t rc;
+    uint32_t time;
+};
+
+// Directory-level prefetch: when a package is read from a directory, the
+// directory is listed, and the headers of the packages which follow (by
+// name) are fetched in a batch into a holding area, from which the later
+// calls are served.  The directory is listed when the second package
+// from it is read, so that reading a single package costs nothing extra.
+// The prefetch is enabled by setting RPMHDRCACHE_PREFETCH to the size of
+// the holding area, e.g. "64M"; when the area is full, nothing more is
+// fetched until the held headers are taken.
+//
+// A few directories are followed at once, so that threads reading from
+// different directories do not reset each other's state.  The batches
+// are fetched without the lock; the threads which want a package from
+// a batch in flight wait for it.
+
+// The number of packages fetched at once.
+#define PF_BATCH 256
+
+// The number of directories followed at once.
+#define PF_NDIR 8
+
+enum { PF_NEW, PF_BUSY, PF_DONE };
+
+struct pf_ent {
+    char *name;
+    struct rpmkey key;
+    int state;		// PF_BUSY while being fetched
+    void *blob;		// held, with the offset at the end
+    int blobsize;
+};
+
+struct pf_dir {
+    dev_t dev;
+    ino_t ino;
+    char *dname;	// the name it was last opened by
+    unsigned long used;	// the last use, for replacement
+    int refs;		// threads using the entries without the lock
+    bool listed;
+    bool listing;	// being listed without the lock
+    int n;
+    struct pf_ent *ent;	// sorted by name, fixed once listed
+};
+
+struct pf {
+    pthread_mutex_t lock;
+    pthread_cond_t done;	// a batch has been fetched
+    size_t bytes, maxbytes;
+    size_t fetched;		// the bytes and number of entries fetched,
+    unsigned long nfetched;	// which tell the typical entry size
+    unsigned long tick;
+    struct pf_dir dir[PF_NDIR];
+    unsigned long hits;
+};
+
+// Tag projection: with "rpmhdrcache tags TAG,..." in rpmcache.conf, only
+// the listed tags are kept in cached headers; with "-TAG,...", they are
+// dropped.  The entries record the projection by its id, a hash of the
+// tags; an entry with another projection than the process's is a miss,
+// unless it has the full header.
+struct proj {
+    uint32_t id;	// 0 for the full header
+    bool drop;
+    int n;
+    rpmTagVal *tag;	// sorted
+};
+
+// With RPMHDRCACHE_KEY=digest, packages are keyed by the header digest,
+// see rpmcache_digest_key, so that copies of the same package share the
+// entry whatever their mtime.  The digest is read from the package; with
+// RPMHDRCACHE_KEYMAP=DIR, the digest keys are also remembered in a local
+// qacache under the usual basename+size+mtime keys, which saves reading
+// the signature, and lets the prefetch work with digest keys.
+
+// A single context serves all the threads of the process: the cache is
+// opened once, and rpmcache handles can be used by a few threads at once.
 struct ctx {
     struct rpmcache *rpmcache;
+    pthread_mutex_t lock;	// guards the lru
+    struct lru *lru;
+    struct pf pf;
+    struct wq wq;
+    struct proj proj;
+    bool digest;
+    struct cache *keymap;	// guarded by the lock
+    unsigned negttl;
     int initialized;
 };
 
-static __thread
-struct ctx thr_ctx;
+static
+struct ctx the_ctx = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .pf = { .lock = PTHREAD_MUTEX_INITIALIZER, .done = PTHREAD_COND_INITIALIZER },
+};
+static
+pthread_once_t the_ctx_once = PTHREAD_ONCE_INIT;
+
+static
+unsigned lru_hash(const struct rpmkey *key)
+{
+    unsigned h = 2166136261U;
+    for (size_t i = 0; i < key->len; i++)
+	h = (h ^ (unsigned char) key->str[i]) * 16777619U;
+    return h;
+}
+
+static
+void lru_unlink(struct lru *lru, struct lru_ent *e)
+{
+    if (e->prev)
+	e->prev->next = e->next;
+    else
+	lru->first = e->next;
+    if (e->next)
+	e->next->prev = e->prev;
+    else
+	lru->last = e->prev;
+}
+
+static
+void lru_push(struct lru *lru, struct lru_ent *e)
+{
+    e->prev = NULL;
+    e->next = lru->first;
+    if (lru->first)
+	lru->first->prev = e;
+    else
+	lru->last = e;
+    lru->first = e;
+}
+
+static
+struct lru_ent **lru_find(struct lru *lru, const struct rpmkey *key, unsigned hash)
+{
+    struct lru_ent **pe = &lru->bucket[hash % LRU_NBUCKET];
+    for (; *pe; pe = &(*pe)->hnext) {
+	struct lru_ent *e = *pe;
+	if (e->hash == hash && e->key.len == key->len &&
+		memcmp(e->key.str, key->str, key->len) == 0)
+	    break;
+    }
+    return pe;
+}
+
+static
+void lru_evict(struct lru *lru, struct lru_ent *e)
+{
+    struct lru_ent **pe = lru_find(lru, &e->key, e->hash);
+    assert(*pe == e);
+    *pe = e->hnext;
+    lru_unlink(lru, e);
+    lru->size -= e->size;
+    headerFree(e->h);
+    free(e);
+}
+
+static
+Header lru_get(struct lru *lru, const struct rpmkey *key, unsigned *off, rpmRC *rcp)
+{
+    struct lru_ent *e = *lru_find(lru, key, lru_hash(key));
+    if (e == NULL) {
+	lru->misses++;
+	return NULL;
+    }
+    lru->hits++;
+    lru_unlink(lru, e);
+    lru_push(lru, e);
+    if (off)
+	*off = e->off;
+    *rcp = e->rc;
+    return headerLink(e->h);
+}
+
+static
+void lru_put(struct lru *lru, const struct rpmkey *key, Header h, unsigned off, rpmRC rc,
+	size_t size)
+{
+    if (size > lru->maxsize)
+	return;
+    unsigned hash = lru_hash(key);
+    struct lru_ent *e = *lru_find(lru, key, hash);
+    if (e)
+	lru_evict(lru, e);
+    while (lru->size + size > lru->maxsize)
+	lru_evict(lru, lru->last);
+    e = malloc(sizeof(*e));
+    if (e == NULL)
+	return;
+    e->hash = hash;
+    e->h = headerLink(h);
+    e->off = off;
+    e->rc = rc;
+    e->size = size;
+    e->key = *key;
+    struct lru_ent **pb = &lru->bucket[hash % LRU_NBUCKET];
+    e->hnext = *pb;
+    *pb = e;
+    lru_push(lru, e);
+    lru->size += size;
+}
+
+// A memory budget from the environment, e.g. "64M"; 0 if unset or invalid.
+static
+unsigned long long env_size(const char *name, unsigned long long def)
+{
+    const char *env = getenv(name);
+    if (env == NULL || *env == '\0')
+	return def;
+    char *end;
+    unsigned long long size = strtoull(env, &end, 10);
+    switch (*end) {
+    case 'G': size <<= 10; /* fall through */
+    case 'M': size <<= 10; /* fall through */
+    case 'K': size <<= 10; end++;
+    }
+    if (*end) {
+	fprintf(stderr, "%s: %s: invalid value: %s\n", __func__, name, env);
+	return 0;
+    }
+    return size;
+}
+
+static
+int proj_cmp(const void *a, const void *b)
+{
+    rpmTagVal x = *(const rpmTagVal *) a;
+    rpmTagVal y = *(const rpmTagVal *) b;
+    return (x > y) - (x < y);
+}
+
+// Parse the tag list; on error, the projection is left off.
+static
+void proj_parse(struct proj *proj, const char *str)
+{
+    int n = 1;
+    for (const char *s = str; *s; s++)
+	n += *s == ',';
+    rpmTagVal *tag = malloc(n * sizeof(*tag));
+    char *buf = strdup(str);
+    if (tag == NULL || buf == NULL) {
+	free(tag);
+	free(buf);
+	return;
+    }
+    n = 0;
+    int ndrop = 0;
+    char *save;
+    for (char *t = strtok_r(buf, ", \t", &save); t; t = strtok_r(NULL, ", \t", &save)) {
+	if (*t == '-') {
+	    ndrop++;
+	    t++;
+	}
+	rpmTagVal v = isdigit(*t) ? atoi(t) : rpmTagGetValue(t);
+	if (v == RPMTAG_NOT_FOUND || v <= 0) {
+	    fprintf(stderr, "%s: %s: unknown tag\n", __func__, t);
+	    goto err;
+	}
+	tag[n++] = v;
+    }
+    if (n == 0 || (ndrop && ndrop != n)) {
+	fprintf(stderr, "%s: %s: %s\n", __func__, str,
+		n ? "cannot both keep and drop tags" : "no tags");
+	goto err;
+    }
+    qsort(tag, n, sizeof(*tag), proj_cmp);
+    uint32_t id = 2166136261U;
+    id = (id ^ (ndrop > 0)) * 16777619U;
+    for (int i = 0; i < n; i++)
+	for (int j = 0; j < 4; j++)
+	    id = (id ^ ((uint32_t) tag[i] >> 8 * j & 0xff)) * 16777619U;
+    proj->id = id ? id : 1;
+    proj->drop = ndrop > 0;
+    proj->n = n;
+    proj->tag = tag;
+    free(buf);
+    return;
+err:
+    free(tag);
+    free(buf);
+}
+
+// Copy the tags which are kept, as they are, i18n strings included.
+static
+Header proj_apply(const struct proj *proj, Header h)
+{
+    Header nh = headerNew();
+    rpmtd td = rpmtdNew();
+    HeaderIterator hi = headerInitIterator(h);
+    rpmTagVal tag;
+    while ((tag = headerNextTag(hi)) != RPMTAG_NOT_FOUND) {
+	bool listed = bsearch(&tag, proj->tag, proj->n, sizeof(tag), proj_cmp);
+	if (listed == proj->drop)
+	    continue;
+	if (headerGet(h, tag, td, HEADERGET_MINMEM | HEADERGET_RAW)) {
+	    headerPut(nh, td, HEADERPUT_DEFAULT);
+	    rpmtdFreeData(td);
+	}
+    }
+    headerFreeIterator(hi);
+    rpmtdFree(td);
+    return nh;
+}
+
+static
+struct lru *lru_open(void)
+{
+    unsigned long long maxsize = env_size("RPMHDRCACHE_LRU", 0);
+    if (maxsize == 0)
+	return NULL;
+    struct lru *lru = calloc(1, sizeof(*lru));
+    if (lru)
+	lru->maxsize = maxsize;
+    return lru;
+}
+
+static
+void lru_close(struct lru *lru)
+{
+    if (lru == NULL)
+	return;
+    const char *stats = getenv("RPMHDRCACHE_LRU_STATS");
+    if (stats && *stats && *stats != '0')
+	fprintf(stderr, "%s: %s: %lu hits, %lu misses, %zu bytes\n",
+		program_invocation_short_name, "rpmhdrcache lru",
+		lru->hits, lru->misses, lru->size);
+    while (lru->first)
+	lru_evict(lru, lru->first);
+    free(lru);
+}
+
+static
+void pf_clear(struct pf *pf, struct pf_dir *d)
+{
+    for (int i = 0; i < d->n; i++) {
+	free(d->ent[i].name);
+	if (d->ent[i].blob) {
+	    free(d->ent[i].blob);
+	    pf->bytes -= d->ent[i].blobsize;
+	}
+    }
+    free(d->ent);
+    d->ent = NULL;
+    d->n = 0;
+    d->listed = false;
+}
+
+static
+void pf_close(struct pf *pf)
+{
+    const char *stats = getenv("RPMHDRCACHE_PREFETCH_STATS");
+    if (pf->maxbytes && stats && *stats && *stats != '0')
+	fprintf(stderr, "%s: %s: %lu hits\n",
+		program_invocation_short_name, "rpmhdrcache prefetch", pf->hits);
+    for (int i = 0; i < PF_NDIR; i++) {
+	pf_clear(pf, &pf->dir[i]);
+	free(pf->dir[i].dname);
+    }
+}
+
+static
+int pf_cmp(const void *a, const void *b)
+{
+    const struct pf_ent *x = a, *y = b;
+    return strcmp(x->name, y->name);
+}
+
+// Find the state of the directory by the name it was opened by, which
+// saves opening it again.  The name may refer to another directory by
+// now; the keys of the entries are checked anyway.
+static
+struct pf_dir *pf_find(struct pf *pf, const char *dname)
+{
+    for (int i = 0; i < PF_NDIR; i++) {
+	struct pf_dir *d = &pf->dir[i];
+	if (d->used && d->dname && strcmp(d->dname, dname) == 0) {
+	    d->used = ++pf->tick;
+	    return d;
+	}
+    }
+    return NULL;
+}
+
+// Find the state of the directory.  If it is not followed yet, it
+// replaces the least recently used one which is not in use, and NULL
+// is returned.
+static
+struct pf_dir *pf_dir(struct pf *pf, const struct stat *dst, const char *dname)
+{
+    struct pf_dir *victim = NULL;
+    for (int i = 0; i < PF_NDIR; i++) {
+	struct pf_dir *d = &pf->dir[i];
+	if (d->used && d->dev == dst->st_dev && d->ino == dst->st_ino) {
+	    d->used = ++pf->tick;
+	    char *name = strdup(dname);
+	    if (name) {
+		free(d->dname);
+		d->dname = name;
+	    }
+	    return d;
+	}
+	if (d->refs == 0 && (victim == NULL || d->used < victim->used))
+	    victim = d;
+    }
+    if (victim) {
+	pf_clear(pf, victim);
+	free(victim->dname);
+	victim->dname = strdup(dname);
+	victim->dev = dst->st_dev;
+	victim->ino = dst->st_ino;
+	victim->used = ++pf->tick;
+    }
+    return NULL;
+}
+
+// Replace the keys with the digest keys found in the keymap; the packages
+// which are not there yet won't match, and are not prefetched.
+static
+void pf_map(struct ctx *ctx, struct pf_ent *ent, int n)
+{
+    if (n == 0)
+	return;
+    const void **keys = malloc(n * (2 * sizeof(void *) + 2 * sizeof(int)));
+    if (keys == NULL)
+	return;
+    void **vals = (void **) (keys + n);
+    int *keysizes = (int *) (vals + n);
+    int *valsizes = keysizes + n;
+    for (int i = 0; i < n; i++) {
+	keys[i] = ent[i].key.str;
+	keysizes[i] = ent[i].key.len;
+    }
+    pthread_mutex_lock(&ctx->lock);
+    cache_mget(ctx->keymap, n, keys, keysizes, vals, valsizes);
+    pthread_mutex_unlock(&ctx->lock);
+    for (int i = 0; i < n; i++) {
+	if (valsizes[i] > 0 && valsizes[i] <= MAXRPMKEYLEN) {
+	    struct rpmkey *key = &ent[i].key;
+	    memcpy(key->str, vals[i], valsizes[i] + 1);
+	    key->len = valsizes[i];
+	}
+	free(vals[i]);
+    }
+    free(keys);
+}
+
+// List the rpm packages in the directory, with a single stat pass, into
+// a new array sorted by name.  Called without the lock.
+static
+int pf_list(struct ctx *ctx, int dirfd, struct pf_ent **entp)
+{
+    *entp = NULL;
+    DIR *dir = fdopendir(dirfd);
+    if (dir == NULL) {
+	close(dirfd);
+	return 0;
+    }
+    struct pf_ent *ent = NULL;
+    int n = 0, alloc = 0;
+    struct dirent *de;
+    while ((de = readdir(dir))) {
+	size_t len = strlen(de->d_name);
+	if (len < 5 || strcmp(de->d_name + len - 4, ".rpm"))
+	    continue;
+	struct stat st;
+	if (fstatat(dirfd, de->d_name, &st, 0) || !S_ISREG(st.st_mode))
+	    continue;
+	if (n == alloc) {
+	    alloc = alloc ? 2 * alloc : 1024;
+	    struct pf_ent *more = realloc(ent, alloc * sizeof(*ent));
+	    if (more == NULL)
+		break;
+	    ent = more;
+	}
+	struct pf_ent *e = &ent[n];
+	if (!rpmcache_key(de->d_name, st.st_size, st.st_mtime, &e->key))
+	    continue;
+	e->name = strdup(de->d_name);
+	if (e->name == NULL)
+	    break;
+	e->state = PF_NEW;
+	e->blob = NULL;
+	e->blobsize = 0;
+	n++;
+    }
+    closedir(dir);
+    qsort(ent, n, sizeof(*ent), pf_cmp);
+    if (ctx->keymap)
+	pf_map(ctx, ent, n);
+    *entp = ent;
+    return n;
+}
+
+// Fetch the headers of the packages starting with the i-th one.  Called
+// with the lock held, which is released during the fetch.
+static
+void pf_fetch(struct ctx *ctx, struct pf_dir *d, int i)
+{
+    struct pf *pf = &ctx->pf;
+    if (pf->bytes >= pf->maxbytes)
+	return;
+    struct rpmkey *keys = malloc(PF_BATCH * (sizeof(*keys) + sizeof(void *) + 2 * sizeof(int)));
+    if (keys == NULL)
+	return;
+    void **vals = (void **) (keys + PF_BATCH);
+    int *valsizes = (int *) (vals + PF_BATCH);
+    int *idx = valsizes + PF_BATCH;
+    // don't fetch much more than fits in the holding area
+    int batch = PF_BATCH;
+    if (pf->nfetched) {
+	size_t avg = pf->fetched / pf->nfetched + 1;
+	size_t fit = (pf->maxbytes - pf->bytes) / avg + 1;
+	if (fit < (size_t) batch)
+	    batch = fit;
+    }
+    int n = 0;
+    for (; i < d->n && n < batch; i++) {
+	if (d->ent[i].state != PF_NEW)
+	    continue;
+	d->ent[i].state = PF_BUSY;
+	keys[n] = d->ent[i].key;
+	idx[n++] = i;
+    }
+    d->refs++;
+    pthread_mutex_unlock(&pf->lock);
+    rpmcache_mget(ctx->rpmcache, n, keys, vals, valsizes);
+    pthread_mutex_lock(&pf->lock);
+    d->refs--;
+    for (int j = 0; j < n; j++) {
+	struct pf_ent *e = &d->ent[idx[j]];
+	e->state = PF_DONE;
+	if (valsizes[j] < 0)
+	    continue;
+	pf->fetched += valsizes[j];
+	pf->nfetched++;
+	// when the holding area is full, the rest can be fetched later
+	if (pf->bytes + valsizes[j] > pf->maxbytes) {
+	    e->state = PF_NEW;
+	    free(vals[j]);
+	    continue;
+	}
+	// the entry is bad
+	if (valsizes[j] < (int) sizeof(struct neg)) {
+	    free(vals[j]);
+	    continue;
+	}
+	e->blob = vals[j];
+	e->blobsize = valsizes[j];
+	pf->bytes += valsizes[j];
+    }
+    pthread_cond_broadcast(&pf->done);
+    free(keys);
+}
+
+// Take the held blob for the package, prefetching as needed.
+static
+void *pf_take(struct ctx *ctx, const char *fname, const struct rpmkey *key, int *blobsizep)
+{
+    struct pf *pf = &ctx->pf;
+    const char *slash = strrchr(fname, '/');
+    const char *base = slash ? slash + 1 : fname;
+    char *dname = slash ? strndup(fname, slash - fname + 1) : strdup(".");
+    if (dname == NULL)
+	return NULL;
+    void *blob = NULL;
+    int dirfd = -1;
+    pthread_mutex_lock(&pf->lock);
+    struct pf_dir *d = pf_find(pf, dname);
+    if (d == NULL) {
+	// the directory is opened the first time it is seen by the name
+	pthread_mutex_unlock(&pf->lock);
+	dirfd = open(dname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	struct stat dst;
+	if (dirfd < 0 || fstat(dirfd, &dst)) {
+	    if (dirfd >= 0)
+		close(dirfd);
+	    free(dname);
+	    return NULL;
+	}
+	pthread_mutex_lock(&pf->lock);
+	d = pf_dir(pf, &dst, dname);
+	if (d == NULL)
+	    goto out;
+    }
+    if (!d->listed) {
+	// another thread is listing the directory
+	if (d->listing)
+	    goto out;
+	d->listing = true;
+	d->refs++;
+	pthread_mutex_unlock(&pf->lock);
+	if (dirfd < 0)
+	    dirfd = open(dname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	struct pf_ent *ent = NULL;
+	int n = dirfd < 0 ? 0 : pf_list(ctx, dirfd, &ent);
+	dirfd = -1;
+	pthread_mutex_lock(&pf->lock);
+	d->refs--;
+	d->listing = false;
+	d->listed = true;
+	d->ent = ent;
+	d->n = n;
+    }
+
+    struct pf_ent k = { .name = (char *) base };
+    struct pf_ent *e = bsearch(&k, d->ent, d->n, sizeof(*d->ent), pf_cmp);
+    // the package may have changed since the directory was listed
+    if (e == NULL || e->key.len != key->len || memcmp(e->key.str, key->str, key->len))
+	goto out;
+    if (e->state == PF_NEW)
+	pf_fetch(ctx, d, e - d->ent);
+    // another thread is fetching the batch
+    d->refs++;
+    while (e->state == PF_BUSY)
+	pthread_cond_wait(&pf->done, &pf->lock);
+    d->refs--;
+    blob = e->blob;
+    if (blob == NULL)
+	goto out;
+    *blobsizep = e->blobsize;
+    e->blob = NULL;
+    pf->bytes -= e->blobsize;
+    pf->hits++;
+out:
+    pthread_mutex_unlock(&pf->lock);
+    if (dirfd >= 0)
+	close(dirfd);
+    free(dname);
+    return blob;
+}
+
+// Append <proj> <rc> <off> to the unloaded header; on failure, the blob
+// is left to the caller.
+static
+void *ent_make(void *blob, int blobsize, uint32_t proj, rpmRC rc, unsigned off)
+{
+    char *ent = realloc(blob, blobsize + 12);
+    if (ent == NULL)
+	return NULL;
+    uint32_t rc32 = rc;
+    memcpy(ent + blobsize, &proj, 4);
+    memcpy(ent + blobsize + 4, &rc32, 4);
+    memcpy(ent + blobsize + 8, &off, 4);
+    return ent;
+}
+
+// Returns the size of the header in the entry, or -1 if the entry is bad.
+static
+int ent_parse(const char *ent, int entsize, uint32_t *projp, rpmRC *rcp, unsigned *offp)
+{
+    if (entsize < HDRSIZE_MIN + 4)
+	return -1;
+    // the header starts with the number of index entries, 16 bytes
+    // each, and the size of the data, in network byte order
+    uint32_t il, dl;
+    memcpy(&il, ent, 4);
+    memcpy(&dl, ent + 4, 4);
+    unsigned long long hsize = 8 + 16ULL * ntohl(il) + ntohl(dl);
+    uint32_t proj = 0, rc = RPMRC_OK;
+    if (hsize + 12 == (unsigned long long) entsize) {
+	memcpy(&proj, ent + hsize, 4);
+	memcpy(&rc, ent + hsize + 4, 4);
+    }
+    else if (hsize + 8 == (unsigned long long) entsize)
+	memcpy(&rc, ent + hsize, 4);
+    else if (hsize + 4 != (unsigned long long) entsize)
+	return -1;
+    if (rc != RPMRC_OK && rc != RPMRC_NOTTRUSTED && rc != RPMRC_NOKEY)
+	return -1;
+    *projp = proj;
+    *rcp = rc;
+    memcpy(offp, ent + entsize - 4, 4);
+    return hsize;
+}
+
+static
+void *wq_thread(void *arg)
+{
+    struct ctx *ctx = arg;
+    struct wq *wq = &ctx->wq;
+    pthread_mutex_lock(&wq->lock);
+    while (1) {
+	struct wq_ent *e = wq->head;
+	if (e == NULL) {
+	    // the queue is drained before the thread exits
+	    if (wq->stop)
+		break;
+	    pthread_cond_wait(&wq->more, &wq->lock);
+	    continue;
+	}
+	wq->head = e->next;
+	if (wq->head == NULL)
+	    wq->tail = &wq->head;
+	pthread_mutex_unlock(&wq->lock);
+	void *ent = ent_make(e->blob, e->blobsize, ctx->proj.id, e->rc, e->off);
+	if (ent)
+	    rpmcache_put(ctx->rpmcache, &e->key, ent, e->blobsize + 12);
+	else
+	    ent = e->blob;
+	free(ent);
+	pthread_mutex_lock(&wq->lock);
+	wq->bytes -= e->blobsize;
+	pthread_cond_signal(&wq->room);
+	free(e);
+    }
+    pthread_mutex_unlock(&wq->lock);
+    return NULL;
+}
+
+static
+void wq_init(struct wq *wq)
+{
+    pthread_mutex_init(&wq->lock, NULL);
+    pthread_cond_init(&wq->more, NULL);
+    pthread_cond_init(&wq->room, NULL);
+    wq->pid = 0;
+    wq->stop = false;
+    wq->head = NULL;
+    wq->tail = &wq->head;
+    wq->bytes = 0;
+}
+
+// Queue the blob, taking its ownership; returns false if the blob
+// should be written synchronously.
+static
+bool wq_put(struct ctx *ctx, const struct rpmkey *key,
+	void *blob, int blobsize, unsigned off, rpmRC rc)
+{
+    struct wq *wq = &ctx->wq;
+    struct wq_ent *e = malloc(sizeof(*e));
+    if (e == NULL)
+	return false;
+    e->next = NULL;
+    e->key = *key;
+    e->blob = blob;
+    e->blobsize = blobsize;
+    e->off = off;
+    e->rc = rc;
+    pthread_mutex_lock(&wq->lock);
+    // the thread is started by the first put, from whichever thread
+    if (wq->pid == 0) {
+	int rc = pthread_create(&wq->thr, NULL, wq_thread, ctx);
+	if (rc) {
+	    pthread_mutex_unlock(&wq->lock);
+	    free(e);
+	    fprintf(stderr, "%s: %s: %s\n", __func__, "pthread_create", strerror(rc));
+	    return false;
+	}
+	wq->pid = getpid();
+    }
+    while (wq->bytes && wq->bytes + blobsize > WQ_MAX_BYTES)
+	pthread_cond_wait(&wq->room, &wq->lock);
+    *wq->tail = e;
+    wq->tail = &e->next;
+    wq->bytes += blobsize;
+    pthread_cond_signal(&wq->more);
+    pthread_mutex_unlock(&wq->lock);
+    return true;
+}
+
+static
+void wq_drain(struct wq *wq)
+{
+    if (wq->pid != getpid())
+	return;
+    pthread_mutex_lock(&wq->lock);
+    wq->stop = true;
+    pthread_cond_signal(&wq->more);
+    pthread_mutex_unlock(&wq->lock);
+    pthread_join(wq->thr, NULL);
+    wq->pid = 0;
+}
 
 static
 void finalize(int rc, void *arg)
 {
     (void) rc;
     struct ctx *ctx = arg;
+    wq_drain(&ctx->wq);
+    lru_close(ctx->lru);
+    pf_close(&ctx->pf);
+    free(ctx->proj.tag);
+    if (ctx->keymap)
+	cache_close(ctx->keymap);
     rpmcache_close(ctx->rpmcache);
 }
 
+// The locks are held across fork, so that the child gets the lru and
+// the prefetch in a consistent state; the child then starts with fresh
+// locks, as the threads which could wait on them are gone.
 static
-struct ctx *initialize()
+void atfork_prepare(void)
+{
+    struct ctx *ctx = &the_ctx;
+    pthread_mutex_lock(&ctx->pf.lock);
+    pthread_mutex_lock(&ctx->lock);
+    pthread_mutex_lock(&ctx->wq.lock);
+}
+
+static
+void atfork_parent(void)
+{
+    struct ctx *ctx = &the_ctx;
+    pthread_mutex_unlock(&ctx->wq.lock);
+    pthread_mutex_unlock(&ctx->lock);
+    pthread_mutex_unlock(&ctx->pf.lock);
+}
+
+static
+void atfork_child(void)
 {
-    struct ctx *ctx = &thr_ctx;
-    if (ctx->initialized)
-	return ctx->initialized > 0 ? ctx : NULL;
+    struct ctx *ctx = &the_ctx;
+    pthread_mutex_init(&ctx->lock, NULL);
+    struct pf *pf = &ctx->pf;
+    pthread_mutex_init(&pf->lock, NULL);
+    pthread_cond_init(&pf->done, NULL);
+    // the batches in flight are not coming
+    for (int i = 0; i < PF_NDIR; i++) {
+	struct pf_dir *d = &pf->dir[i];
+	d->refs = 0;
+	d->listing = false;
+	for (int j = 0; j < d->n; j++)
+	    if (d->ent[j].state == PF_BUSY)
+		d->ent[j].state = PF_NEW;
+    }
+    // the child has no writer thread; the entries which are
+    // still in the queue are left to the parent
+    wq_init(&ctx->wq);
+}
+
+static
+void init_once(void)
+{
+    struct ctx *ctx = &the_ctx;
     ctx->rpmcache = rpmcache_open("rpmhdrcache");
     if (ctx->rpmcache == NULL) {
 	ctx->initialized = -1;
-	return NULL;
+	return;
     }
+    ctx->lru = lru_open();
+    ctx->pf.maxbytes = env_size("RPMHDRCACHE_PREFETCH", 0);
+    const char *tags = rpmcache_tags(ctx->rpmcache);
+    if (tags)
+	proj_parse(&ctx->proj, tags);
+    const char *mode = getenv("RPMHDRCACHE_KEY");
+    ctx->digest = mode && strcmp(mode, "digest") == 0;
+    const char *keymap = getenv("RPMHDRCACHE_KEYMAP");
+    if (ctx->digest && keymap && *keymap)
+	ctx->keymap = cache_open(keymap);
+    ctx->negttl = NEG_DEF_TTL;
+    const char *ttl = getenv("RPMHDRCACHE_NEGATIVE_TTL");
+    if (ttl && *ttl)
+	ctx->negttl = strtoul(ttl, NULL, 10);
+    wq_init(&ctx->wq);
+    pthread_atfork(atfork_prepare, atfork_parent, atfork_child);
     ctx->initialized = 1;
     on_exit(finalize, ctx);
-    return ctx;
 }
 
-// Any valid rpm header must provide at least the number of its
-// index entries and the size of its data.
-#define HDRSIZE_MIN 8
-// The maximum size of RPM header which we even try to deal with.
-// Note that the default size limit in memcached is 1MiB, but it
-// can be increased to 128MiB.  Thus the uncompressed size of
-// a header is limited to 256MiB.  This is also the limit imposed
-// in recent rpm releases.
-#define HDRSIZE_MAX (1 << 28)
+static
+struct ctx *initialize()
+{
+    pthread_once(&the_ctx_once, init_once);
+    return the_ctx.initialized > 0 ? &the_ctx : NULL;
+}
 
-// Assume that LZ4 cannot compress an 8-byte header.
-#define ENTSIZE_MIN (sizeof(struct cache_ent) + HDRSIZE_MIN)
+bool hdrcache_key(const char *fname, int fd, unsigned fsize, unsigned mtime,
+	struct rpmkey *key)
+{
+    if (!rpmcache_key(fname, fsize, mtime, key))
+	return false;
+    struct ctx *ctx = initialize();
+    if (ctx == NULL || !ctx->digest)
+	return true;
+    if (ctx->keymap) {
+	void *val;
+	int valsize;
+	pthread_mutex_lock(&ctx->lock);
+	bool ok = cache_get(ctx->keymap, key->str, key->len, &val, &valsize);
+	pthread_mutex_unlock(&ctx->lock);
+	if (ok && valsize > 0 && valsize <= MAXRPMKEYLEN) {
+	    memcpy(key->str, val, valsize + 1);
+	    key->len = valsize;
+	    free(val);
+	    return true;
+	}
+	if (ok)
+	    free(val);
+    }
+    // packages without the digest are keyed by mtime
+    struct rpmkey dkey;
+    if (!rpmcache_digest_key(fname, fd, fsize, &dkey))
+	return true;
+    if (ctx->keymap) {
+	pthread_mutex_lock(&ctx->lock);
+	cache_put(ctx->keymap, key->str, key->len, dkey.str, dkey.len);
+	pthread_mutex_unlock(&ctx->lock);
+    }
+    *key = dkey;
+    return true;
+}
 
-Header hdrcache_get(const struct rpmkey *key, unsigned *off)
+Header hdrcache_get(const char *fname, const struct rpmkey *key, unsigned *off, rpmRC *rcp)
 {
+    *rcp = RPMRC_OK;
     struct ctx *ctx = initialize();
     if (ctx == NULL)
 	return NULL;
-    void *blob;
+    void *blob = NULL;
     int blobsize;
-    if (!rpmcache_get(ctx->rpmcache, key, &blob, &blobsize))
+    if (ctx->lru) {
+	pthread_mutex_lock(&ctx->lock);
+	Header h = lru_get(ctx->lru, key, off, rcp);
+	pthread_mutex_unlock(&ctx->lock);
+	if (h)
+	    return h;
+    }
+    if (ctx->pf.maxbytes)
+	blob = pf_take(ctx, fname, key, &blobsize);
+    if (blob == NULL && !rpmcache_get(ctx->rpmcache, key, &blob, &blobsize))
+	return NULL;
+    if (blobsize == sizeof(struct neg)) {
+	struct neg neg;
+	memcpy(&neg, blob, sizeof neg);
+	free(blob);
+	if ((neg.rc == RPMRC_FAIL || neg.rc == RPMRC_NOTFOUND) &&
+		(uint32_t) time(NULL) - neg.time < ctx->negttl)
+	    *rcp = neg.rc;
 	return NULL;
-    Header h = headerImport(blob, blobsize - 4, HEADERIMPORT_FAST);
+    }
+    uint32_t proj;
+    rpmRC rc;
+    unsigned hoff;
+    int hsize = ent_parse(blob, blobsize, &proj, &rc, &hoff);
+    if (hsize < 0) {
+	fprintf(stderr, "%s %s: %s\n", __func__, key->str, "bad entry");
+	free(blob);
+	return NULL;
+    }
+    // the header lacks tags which this process wants
+    if (proj && proj != ctx->proj.id) {
+	free(blob);
+	return NULL;
+    }
+    Header h = headerImport(blob, hsize, HEADERIMPORT_FAST);
     if (h == NULL) {
 	fprintf(stderr, "%s %s: %s failed\n", __func__, key->str, "headerLoad");
 	free(blob);
 	return NULL;
     }
     if (off)
-	memcpy(off, blob + blobsize - 4, 4);
+	*off = hoff;
+    *rcp = rc;
+    if (ctx->lru) {
+	pthread_mutex_lock(&ctx->lock);
+	lru_put(ctx->lru, key, h, hoff, rc, blobsize);
+	pthread_mutex_unlock(&ctx->lock);
+    }
     return h;
 }
 
-void hdrcache_put(const struct rpmkey *key, Header h, unsigned off)
+void hdrcache_put(const struct rpmkey *key, Header h, unsigned off, rpmRC rc)
 {
     struct ctx *ctx = initialize();
     if (ctx == NULL)
 	return;
-    int blobsize = headerSizeof(h, HEADER_MAGIC_NO);
-    if (blobsize < HDRSIZE_MIN || blobsize > HDRSIZE_MAX)
+    // the caller keeps the full header
+    Header ph = ctx->proj.id ? proj_apply(&ctx->proj, h) : headerLink(h);
+    int blobsize = headerSizeof(ph, HEADER_MAGIC_NO);
+    void *blob = NULL;
+    if (blobsize >= HDRSIZE_MIN && blobsize <= HDRSIZE_MAX)
+	blob = headerUnload(ph);
+    headerFree(ph);
+    if (blob == NULL)
+	return;
+    if (!wq_put(ctx, key, blob, blobsize, off, rc)) {
+	void *ent = ent_make(blob, blobsize, ctx->proj.id, rc, off);
+	if (ent) {
+	    blob = ent;
+	    rpmcache_put(ctx->rpmcache, key, ent, blobsize + 12);
+	}
+	free(blob);
+    }
+    if (ctx->lru) {
+	pthread_mutex_lock(&ctx->lock);
+	lru_put(ctx->lru, key, h, off, rc, blobsize);
+	pthread_mutex_unlock(&ctx->lock);
+    }
+}
+
+void hdrcache_put_failed(const struct rpmkey *key, rpmRC rc)
+{
+    struct ctx *ctx = initialize();
+    if (ctx == NULL || ctx->negttl == 0)
 	return;
-    void *blob = headerUnload(h);
-    blob = realloc(blob, blobsize + 4);
-    memcpy(blob + blobsize, &off, 4);
-    rpmcache_put(ctx->rpmcache, key, blob, blobsize + 4);
-    free(blob);
+    struct neg neg = { rc, time(NULL) };
+    rpmcache_put(ctx->rpmcache, key, &neg, sizeof neg);
 }
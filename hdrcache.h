@@ -1,3 +1,13 @@
 #include "rpmcache.h"
-Header hdrcache_get(const struct rpmkey *key, unsigned *off);
-void hdrcache_put(const struct rpmkey *key, Header h, unsigned off);
+// Make the key for the package open as fd, with rpmcache_key, or with
+// rpmcache_digest_key if RPMHDRCACHE_KEY=digest.
+bool hdrcache_key(const char *fname, int fd, unsigned fsize, unsigned mtime,
+	struct rpmkey *key);
+// The file name is used to prefetch the other packages in the directory.
+// Returns the header, with *rcp set to what rpmReadPackageFile returned;
+// or NULL, with *rcp set to RPMRC_FAIL or RPMRC_NOTFOUND if the failure
+// was cached, and to RPMRC_OK on a miss.
+Header hdrcache_get(const char *fname, const struct rpmkey *key, unsigned *off, rpmRC *rcp);
+void hdrcache_put(const struct rpmkey *key, Header h, unsigned off, rpmRC rc);
+// Remember a failed read for a while, see RPMHDRCACHE_NEGATIVE_TTL.
+void hdrcache_put_failed(const struct rpmkey *key, rpmRC rc);
@@ -0,0 +1,629 @@
+#include "cache-impl.h"
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+
+// The native storage engine for small entries, an alternative to BDB.
+// The index is an open-addressing hash table of 64-bit slots, mapped
+// into memory; each slot refers to a record in the append-only heap.
+// Readers don't take any locks: they probe the slots with atomic loads.
+// Writers are serialized by flock on the index file; they append the
+// record to the heap first, and then publish it with an atomic store.
+// Deleted records become garbage, which is reclaimed by cache_clean:
+// the live records are copied into a new index and a new heap, the new
+// index is renamed into place, and the old one is marked obsolete, so
+// that other processes switch over.
+
+#define HX_INDEX "index.hx"
+#define HX_HEAP "heap-%08x.hx"
+#define HX_MAGIC "QAHX0001"
+
+struct hx_hdr {
+    char magic[8];
+    uint32_t nslot;	// power of two
+    uint32_t gen;	// heap file generation
+    uint32_t obsolete;	// the index has been replaced
+    uint32_t pad;
+    uint64_t heapsize;	// the end of the heap
+    uint64_t nused;	// non-empty slots, including deleted
+    uint64_t nlive;	// live records
+    uint64_t garbage;	// bytes in dead records
+};
+
+#define HX_HDR_SIZE 4096
+
+// Slot layout: 16-bit hash tag, heap offset / 8 (32 bits), length / 8.
+// The heap starts with the magic, so offset 0 marks special slots.
+#define HX_EMPTY 0
+#define HX_TOMB 1
+#define REF(tag, off, len) (((uint64_t) (tag) << 48) | ((off) >> 3 << 16) | ((len) >> 3))
+#define REF_TAG(ref) ((ref) >> 48)
+#define REF_OFF(ref) ((((ref) >> 16) & 0xffffffff) << 3)
+#define REF_LEN(ref) (((ref) & 0xffff) << 3)
+#define HASH_TAG(hash) ((hash) >> 48)
+
+// Records are at most 512K, and the heap is at most 32G; the whole heap
+// is mapped at once (pages past the end of the file are not touched).
+#define HX_MAX_REC (0xffff << 3)
+#define HX_HEAP_MAX (sizeof(void *) < 8 ? (size_t) 1 << 30 : (size_t) 1 << 35)
+
+// The default number of slots in a new index; grown by compaction.
+#define HX_DEF_NSLOT (1 << 20)
+
+// Inserts are refused when the index gets this full.
+#define HX_FULL(hdr) ((hdr)->nused >= (hdr)->nslot / 4 * 3)
+// Puts compact the index before it gets full, and when more than half
+// of a sizeable heap is garbage, so that the cache keeps taking entries
+// between the runs of cache_clean.
+#define HX_COMPACT_MIN_HEAP (16 << 20)
+#define HX_WANT_COMPACT(hdr) ((hdr)->nused + 1 >= (hdr)->nslot / 4 * 3 || \
+	((hdr)->heapsize > HX_COMPACT_MIN_HEAP && (hdr)->garbage > (hdr)->heapsize / 2))
+
+struct hx_rec {
+    uint32_t keysize;
+    uint32_t ventsize;
+    char data[];	// key, padded to 8 bytes, then vent
+};
+
+#define ALIGN8(n) (((n) + 7) & ~(size_t) 7)
+#define REC_VENT(rec) ((struct cache_ent *) ((rec)->data + ALIGN8((rec)->keysize)))
+#define REC_SIZE(keysize, ventsize) \
+    ALIGN8(sizeof(struct hx_rec) + ALIGN8(keysize) + (ventsize))
+
+// In read-only mode, the files are opened and mapped read-only.
+#define HX_OPEN_FLAGS(cache) (((cache)->rdonly ? O_RDONLY : O_RDWR) | O_CLOEXEC)
+#define HX_PROT(cache) ((cache)->rdonly ? PROT_READ : PROT_READ | PROT_WRITE)
+
+struct qahx {
+    int ifd, hfd;
+    struct hx_hdr *hdr;
+    size_t isize;
+    uint64_t *slot;
+    char *heap;
+};
+
+static
+uint64_t hx_hash(const void *key, int keysize)
+{
+    const unsigned char *p = key;
+    uint64_t h = 14695981039346656037ULL;
+    for (int i = 0; i < keysize; i++)
+	h = (h ^ p[i]) * 1099511628211ULL;
+    // the tag must not be confused with special slots
+    return h | (1ULL << 48);
+}
+
+static
+void hx_unmap(struct qahx *hx)
+{
+    if (hx->heap && munmap(hx->heap, HX_HEAP_MAX) < 0)
+	ERROR("munmap: %m");
+    if (hx->hdr && munmap(hx->hdr, hx->isize) < 0)
+	ERROR("munmap: %m");
+    if (hx->hfd >= 0)
+	close(hx->hfd);
+    if (hx->ifd >= 0)
+	close(hx->ifd);
+    hx->heap = NULL;
+    hx->hdr = NULL;
+    hx->hfd = hx->ifd = -1;
+}
+
+// Map the index file and the heap which it refers to.
+static
+bool hx_map(struct cache *cache, struct qahx *hx, int ifd)
+{
+    hx->ifd = ifd;
+    hx->hfd = -1;
+    hx->hdr = NULL;
+    hx->heap = NULL;
+    struct stat st;
+    if (fstat(ifd, &st) < 0) {
+	ERROR("fstat: %m");
+	goto fail;
+    }
+    hx->isize = st.st_size;
+    if (hx->isize < HX_HDR_SIZE) {
+	ERROR("%s: bad index size", HX_INDEX);
+	goto fail;
+    }
+    hx->hdr = mmap(NULL, hx->isize, HX_PROT(cache), MAP_SHARED, ifd, 0);
+    if (hx->hdr == MAP_FAILED) {
+	hx->hdr = NULL;
+	ERROR("mmap: %m");
+	goto fail;
+    }
+    uint32_t nslot = hx->hdr->nslot;
+    if (memcmp(hx->hdr->magic, HX_MAGIC, 8) ||
+	    nslot == 0 || (nslot & (nslot - 1)) ||
+	    hx->isize != HX_HDR_SIZE + (size_t) nslot * 8) {
+	ERROR("%s: bad index", HX_INDEX);
+	goto fail;
+    }
+    hx->slot = (uint64_t *) ((char *) hx->hdr + HX_HDR_SIZE);
+    char fname[sizeof(HX_HEAP) + 8];
+    snprintf(fname, sizeof fname, HX_HEAP, hx->hdr->gen);
+    hx->hfd = openat(cache->dirfd, fname, HX_OPEN_FLAGS(cache));
+    if (hx->hfd < 0) {
+	ERROR("openat %s: %m", fname);
+	goto fail;
+    }
+    hx->heap = mmap(NULL, HX_HEAP_MAX, HX_PROT(cache), MAP_SHARED | MAP_NORESERVE, hx->hfd, 0);
+    if (hx->heap == MAP_FAILED) {
+	hx->heap = NULL;
+	ERROR("mmap: %m");
+	goto fail;
+    }
+    return true;
+fail:
+    hx_unmap(hx);
+    return false;
+}
+
+// Create new index and heap files, of generation gen.  The index is
+// created under a temporary name, which is returned in tmp.  The caller
+// holds the directory lock or the writer lock, so a heap file of this
+// generation can only be left over from a crash; it is replaced with a
+// new file, and never truncated.
+static
+int hx_create(struct cache *cache, uint32_t nslot, uint32_t gen, char *tmp)
+{
+    char fname[sizeof(HX_HEAP) + 8];
+    snprintf(fname, sizeof fname, HX_HEAP, gen);
+    if (unlinkat(cache->dirfd, fname, 0) < 0 && errno != ENOENT) {
+	ERROR("unlinkat %s: %m", fname);
+	return -1;
+    }
+    SET_UMASK(cache);
+    int hfd = openat(cache->dirfd, fname, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (hfd < 0) {
+	ERROR("openat %s: %m", fname);
+	UNSET_UMASK(cache);
+	return -1;
+    }
+    if (write(hfd, HX_MAGIC, 8) != 8) {
+	ERROR("write: %m");
+	close(hfd);
+	UNSET_UMASK(cache);
+	return -1;
+    }
+    close(hfd);
+    sprintf(tmp, "%s.%08x", HX_INDEX, (unsigned) getpid());
+    int ifd = openat(cache->dirfd, tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    UNSET_UMASK(cache);
+    if (ifd < 0) {
+	ERROR("openat: %m");
+	return -1;
+    }
+    struct hx_hdr hdr = {
+	.magic = HX_MAGIC,
+	.nslot = nslot,
+	.gen = gen,
+	.heapsize = 8,
+    };
+    if (ftruncate(ifd, HX_HDR_SIZE + (off_t) nslot * 8) < 0 ||
+	    pwrite(ifd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+	ERROR("%s: %m", tmp);
+	close(ifd);
+	unlinkat(cache->dirfd, tmp, 0);
+	return -1;
+    }
+    return ifd;
+}
+
+static
+void hx_lock(struct qahx *hx)
+{
+    int rc;
+    do
+	rc = flock(hx->ifd, LOCK_EX);
+    while (rc < 0 && errno == EINTR);
+    if (rc)
+	ERROR("LOCK_EX: %m");
+}
+
+static
+void hx_unlock(struct qahx *hx)
+{
+    if (flock(hx->ifd, LOCK_UN))
+	ERROR("LOCK_UN: %m");
+}
+
+// Switch to the new index, if the current one has been replaced.
+// If the new index cannot be mapped, the old one is kept, so that
+// the next call can try again.
+static
+bool hx_check(struct cache *cache, struct qahx *hx)
+{
+    if (!__atomic_load_n(&hx->hdr->obsolete, __ATOMIC_ACQUIRE))
+	return true;
+    int ifd = openat(cache->dirfd, HX_INDEX, HX_OPEN_FLAGS(cache));
+    if (ifd < 0) {
+	ERROR("openat %s: %m", HX_INDEX);
+	return false;
+    }
+    struct qahx nhx;
+    if (!hx_map(cache, &nhx, ifd))
+	return false;
+    hx_unmap(hx);
+    *hx = nhx;
+    return true;
+}
+
+// Take the writer lock on the current index.
+static
+bool hx_wrlock(struct cache *cache, struct qahx *hx)
+{
+    while (1) {
+	if (!hx_check(cache, hx))
+	    return false;
+	uint64_t t0 = stats_now();
+	hx_lock(hx);
+	stats_time(&cache->hist[QSH_LOCK], t0);
+	if (!__atomic_load_n(&hx->hdr->obsolete, __ATOMIC_ACQUIRE))
+	    return true;
+	hx_unlock(hx);
+    }
+}
+
+static
+struct hx_rec *hx_rec(struct qahx *hx, uint64_t ref)
+{
+    uint64_t off = REF_OFF(ref);
+    uint64_t len = REF_LEN(ref);
+    uint64_t heapsize = __atomic_load_n(&hx->hdr->heapsize, __ATOMIC_ACQUIRE);
+    if (off < 8 || off + len > heapsize || len < sizeof(struct hx_rec))
+	return NULL;
+    struct hx_rec *rec = (struct hx_rec *) (hx->heap + off);
+    if (REC_SIZE(rec->keysize, rec->ventsize) != len)
+	return NULL;
+    return rec;
+}
+
+// Find the slot holding the key.  If not found and freep is not NULL,
+// *freep is set to the first slot which can take the key.
+static
+uint64_t *hx_find(struct qahx *hx, uint64_t hash,
+	const void *key, int keysize,
+	struct hx_rec **recp, uint64_t **freep)
+{
+    uint64_t mask = hx->hdr->nslot - 1;
+    if (freep)
+	*freep = NULL;
+    for (uint64_t i = 0; i <= mask; i++) {
+	uint64_t *slot = &hx->slot[(hash + i) & mask];
+	uint64_t ref = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	if (ref == HX_EMPTY) {
+	    if (freep && *freep == NULL)
+		*freep = slot;
+	    return NULL;
+	}
+	if (ref == HX_TOMB) {
+	    if (freep && *freep == NULL)
+		*freep = slot;
+	    continue;
+	}
+	if (REF_TAG(ref) != HASH_TAG(hash))
+	    continue;
+	struct hx_rec *rec = hx_rec(hx, ref);
+	if (rec && rec->keysize == (uint32_t) keysize &&
+		memcmp(rec->data, key, keysize) == 0) {
+	    if (recp)
+		*recp = rec;
+	    return slot;
+	}
+    }
+    return NULL;
+}
+
+int qahx_open(struct cache *cache)
+{
+    cache->hx = NULL;
+    int ifd = openat(cache->dirfd, HX_INDEX, HX_OPEN_FLAGS(cache));
+    if (ifd < 0) {
+	if (errno != ENOENT) {
+	    ERROR("openat %s: %m", HX_INDEX);
+	    return -1;
+	}
+	// a new cache can be created with the native engine,
+	// but not in read-only mode
+	const char *engine = getenv("QACACHE_ENGINE");
+	if (engine == NULL || strcmp(engine, "hx") || cache->rdonly)
+	    return 0;
+	// only one process builds the index, under the directory lock;
+	// the others open the winner's files
+	int rc;
+	do
+	    rc = flock(cache->dirfd, LOCK_EX);
+	while (rc < 0 && errno == EINTR);
+	if (rc) {
+	    ERROR("LOCK_EX: %m");
+	    return -1;
+	}
+	ifd = openat(cache->dirfd, HX_INDEX, O_RDWR | O_CLOEXEC);
+	if (ifd < 0 && errno == ENOENT) {
+	    if (faccessat(cache->dirfd, "cache.db", F_OK, 0) == 0 ||
+		faccessat(cache->dirfd, "cache-00.db", F_OK, 0) == 0) {
+		flock(cache->dirfd, LOCK_UN);
+		return 0;
+	    }
+	    char tmp[sizeof(HX_INDEX) + 9];
+	    ifd = hx_create(cache, HX_DEF_NSLOT, 1, tmp);
+	    if (ifd >= 0 && renameat(cache->dirfd, tmp, cache->dirfd, HX_INDEX) < 0) {
+		ERROR("renameat: %m");
+		close(ifd);
+		unlinkat(cache->dirfd, tmp, 0);
+		ifd = -1;
+	    }
+	}
+	else if (ifd < 0)
+	    ERROR("openat %s: %m", HX_INDEX);
+	if (flock(cache->dirfd, LOCK_UN))
+	    ERROR("LOCK_UN: %m");
+	if (ifd < 0)
+	    return -1;
+    }
+    struct qahx *hx = malloc(sizeof(*hx));
+    if (hx == NULL) {
+	ERROR("malloc: %m");
+	close(ifd);
+	return -1;
+    }
+    if (!hx_map(cache, hx, ifd)) {
+	free(hx);
+	return -1;
+    }
+    cache->hx = hx;
+    return 1;
+}
+
+void qahx_close(struct cache *cache)
+{
+    hx_unmap(cache->hx);
+    free(cache->hx);
+    cache->hx = NULL;
+}
+
+bool qahx_get(struct cache *cache,
+	const void *key, int keysize,
+	struct cache_ent *vent, int *ventsize)
+{
+    struct qahx *hx = cache->hx;
+    if (!hx_check(cache, hx))
+	return false;
+    struct hx_rec *rec;
+    if (!hx_find(hx, hx_hash(key, keysize), key, keysize, &rec, NULL))
+	return false;
+    int size = rec->ventsize;
+    if (size > *ventsize) {
+	ERROR("vent too big");
+	return false;
+    }
+    struct cache_ent *rvent = REC_VENT(rec);
+    memcpy(vent, rvent, size);
+    *ventsize = size;
+    // atime is only a hint, and is updated in place
+    if (size >= (int) sizeof(*vent) && vent->atime < cache->now && !cache->rdonly)
+	__atomic_store_n(&rvent->atime, cache->now, __ATOMIC_RELAXED);
+    return true;
+}
+
+void qahx_mget(struct cache *cache, int n,
+	const void *keys[], const int keysizes[],
+	void *vents[], int ventsizes[])
+{
+    char vbuf[sizeof(struct cache_ent) + MAX_DB_VAL_SIZE] __attribute__((aligned(4)));
+    for (int i = 0; i < n; i++) {
+	vents[i] = NULL;
+	int size = sizeof(vbuf);
+	if (!qahx_get(cache, keys[i], keysizes[i], (void *) vbuf, &size))
+	    continue;
+	if ((vents[i] = malloc(size)) == NULL) {
+	    ERROR("malloc: %m");
+	    continue;
+	}
+	memcpy(vents[i], vbuf, size);
+	ventsizes[i] = size;
+    }
+}
+
+void qahx_walk(struct cache *cache,
+	bool (*cb)(void *arg, const void *key, int keysize,
+		const struct cache_ent *vent, int ventsize),
+	void *arg)
+{
+    struct qahx *hx = cache->hx;
+    if (!hx_check(cache, hx))
+	return;
+    for (uint32_t i = 0; i < hx->hdr->nslot; i++) {
+	uint64_t ref = __atomic_load_n(&hx->slot[i], __ATOMIC_ACQUIRE);
+	if (ref == HX_EMPTY || ref == HX_TOMB)
+	    continue;
+	struct hx_rec *rec = hx_rec(hx, ref);
+	if (rec && !cb(arg, rec->data, rec->keysize, REC_VENT(rec), rec->ventsize))
+	    break;
+    }
+}
+
+// Append the record to the heap; returns the slot value.
+static
+uint64_t hx_append(struct qahx *hx, uint64_t hash,
+	const void *key, int keysize,
+	const struct cache_ent *vent, int ventsize)
+{
+    size_t len = REC_SIZE(keysize, ventsize);
+    uint64_t off = hx->hdr->heapsize;
+    if (len > HX_MAX_REC || off + len > HX_HEAP_MAX) {
+	ERROR("heap full");
+	return HX_EMPTY;
+    }
+    struct hx_rec *rec = calloc(1, len);
+    if (rec == NULL) {
+	ERROR("calloc: %m");
+	return HX_EMPTY;
+    }
+    rec->keysize = keysize;
+    rec->ventsize = ventsize;
+    memcpy(rec->data, key, keysize);
+    memcpy(REC_VENT(rec), vent, ventsize);
+    ssize_t n = pwrite(hx->hfd, rec, len, off);
+    free(rec);
+    if (n != (ssize_t) len) {
+	ERROR("pwrite: %m");
+	return HX_EMPTY;
+    }
+    __atomic_store_n(&hx->hdr->heapsize, off + len, __ATOMIC_RELEASE);
+    return REF(HASH_TAG(hash), off, len);
+}
+
+// Insert or replace; called with the writer lock held.
+static
+void hx_insert(struct qahx *hx, uint64_t hash,
+	const void *key, int keysize,
+	const struct cache_ent *vent, int ventsize)
+{
+    struct hx_rec *old;
+    uint64_t *freeslot;
+    uint64_t *slot = hx_find(hx, hash, key, keysize, &old, &freeslot);
+    if (slot == NULL) {
+	if (freeslot == NULL || HX_FULL(hx->hdr)) {
+	    ERROR("index full");
+	    return;
+	}
+	slot = freeslot;
+    }
+    uint64_t ref = hx_append(hx, hash, key, keysize, vent, ventsize);
+    if (ref == HX_EMPTY)
+	return;
+    uint64_t oldref = *slot;
+    __atomic_store_n(slot, ref, __ATOMIC_RELEASE);
+    if (oldref == HX_EMPTY)
+	hx->hdr->nused++;
+    if (oldref == HX_EMPTY || oldref == HX_TOMB)
+	hx->hdr->nlive++;
+    else
+	hx->hdr->garbage += REF_LEN(oldref);
+}
+
+// Copy the live records into a new index and heap; called with
+// the writer lock held.
+static
+void hx_compact(struct cache *cache, struct qahx *hx)
+{
+    uint32_t nslot = hx->hdr->nslot;
+    while (hx->hdr->nlive >= nslot / 2 && nslot < (1U << 31))
+	nslot *= 2;
+    uint32_t gen = hx->hdr->gen + 1;
+    char tmp[sizeof(HX_INDEX) + 9];
+    int ifd = hx_create(cache, nslot, gen, tmp);
+    if (ifd < 0)
+	return;
+    struct qahx nhx;
+    if (!hx_map(cache, &nhx, ifd)) {
+	unlinkat(cache->dirfd, tmp, 0);
+	return;
+    }
+    for (uint32_t i = 0; i < hx->hdr->nslot; i++) {
+	uint64_t ref = hx->slot[i];
+	if (ref == HX_EMPTY || ref == HX_TOMB)
+	    continue;
+	struct hx_rec *rec = hx_rec(hx, ref);
+	if (rec == NULL)
+	    continue;
+	const void *key = rec->data;
+	hx_insert(&nhx, hx_hash(key, rec->keysize), key, rec->keysize,
+		REC_VENT(rec), rec->ventsize);
+    }
+    char fname[sizeof(HX_HEAP) + 8];
+    snprintf(fname, sizeof fname, HX_HEAP, hx->hdr->gen);
+    if (renameat(cache->dirfd, tmp, cache->dirfd, HX_INDEX) < 0) {
+	ERROR("renameat: %m");
+	unlinkat(cache->dirfd, tmp, 0);
+	snprintf(fname, sizeof fname, HX_HEAP, gen);
+	hx_unmap(&nhx);
+	unlinkat(cache->dirfd, fname, 0);
+	return;
+    }
+    // the old files stay alive while they are mapped
+    unlinkat(cache->dirfd, fname, 0);
+    __atomic_store_n(&hx->hdr->obsolete, 1, __ATOMIC_RELEASE);
+    hx_unmap(&nhx);
+}
+
+void qahx_put(struct cache *cache,
+	const void *key, int keysize,
+	struct cache_ent *vent, int ventsize)
+{
+    struct qahx *hx = cache->hx;
+    vent->mtime = cache->now;
+    vent->atime = cache->now;
+    if (!hx_wrlock(cache, hx))
+	return;
+    if (HX_WANT_COMPACT(hx->hdr)) {
+	hx_compact(cache, hx);
+	// switch to the new index
+	if (__atomic_load_n(&hx->hdr->obsolete, __ATOMIC_ACQUIRE)) {
+	    hx_unlock(hx);
+	    if (!hx_wrlock(cache, hx))
+		return;
+	}
+    }
+    hx_insert(hx, hx_hash(key, keysize), key, keysize, vent, ventsize);
+    hx_unlock(hx);
+}
+
+void qahx_del(struct cache *cache,
+	const void *key, int keysize)
+{
+    struct qahx *hx = cache->hx;
+    if (!hx_wrlock(cache, hx))
+	return;
+    uint64_t *slot = hx_find(hx, hx_hash(key, keysize), key, keysize, NULL, NULL);
+    if (slot) {
+	hx->hdr->garbage += REF_LEN(*slot);
+	hx->hdr->nlive--;
+	__atomic_store_n(slot, HX_TOMB, __ATOMIC_RELEASE);
+    }
+    hx_unlock(hx);
+}
+
+void qahx_clean(struct cache *cache, int days)
+{
+    struct qahx *hx = cache->hx;
+    if (!hx_wrlock(cache, hx))
+	return;
+    for (uint32_t i = 0; i < hx->hdr->nslot; i++) {
+	uint64_t ref = hx->slot[i];
+	if (ref == HX_EMPTY || ref == HX_TOMB)
+	    continue;
+	struct hx_rec *rec = hx_rec(hx, ref);
+	if (rec && rec->ventsize >= sizeof(struct cache_ent)) {
+	    struct cache_ent *vent = REC_VENT(rec);
+	    if (vent->mtime + days >= cache->now) continue;
+	    if (vent->atime + days >= cache->now) continue;
+	}
+	hx->hdr->garbage += REF_LEN(ref);
+	hx->hdr->nlive--;
+	__atomic_store_n(&hx->slot[i], HX_TOMB, __ATOMIC_RELEASE);
+    }
+    // reclaim the space when half of the heap is garbage,
+    // or when the index is getting full
+    if (hx->hdr->garbage > hx->hdr->heapsize / 2 || HX_FULL(hx->hdr))
+	hx_compact(cache, hx);
+    hx_unlock(hx);
+}
+
+void qahx_stat(struct cache *cache, struct cache_scan *scan)
+{
+    struct qahx *hx = cache->hx;
+    if (!hx_check(cache, hx))
+	return;
+    scan->hx = true;
+    scan->hx_slots = hx->hdr->nslot;
+    scan->hx_used = __atomic_load_n(&hx->hdr->nused, __ATOMIC_RELAXED);
+    scan->hx_live = __atomic_load_n(&hx->hdr->nlive, __ATOMIC_RELAXED);
+    scan->hx_garbage_bytes = __atomic_load_n(&hx->hdr->garbage, __ATOMIC_RELAXED);
+    scan->dbfile_bytes = hx->isize + __atomic_load_n(&hx->hdr->heapsize, __ATOMIC_RELAXED);
+}
+
+// ex:ts=8 sts=4 sw=4 noet
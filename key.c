@@ -1,8 +1,12 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <ctype.h>
 #include <assert.h>
+#include <unistd.h>
+#include <arpa/inet.h>
 #include "rpmcache.h"
 #include "sm3.h"
 
@@ -43,3 +47,88 @@ bool rpmcache_key(const char *fname, unsigned fsize, unsigned mtime, struct rpmk
     *p = '\0';
     return true;
 }
+
+// The signature header follows the 96-byte lead; it has the usual header
+// layout, with the magic, and is padded to 8 bytes.
+#define LEAD_SIZE 96
+#define SIGTAG_SHA1 269
+#define SIGTAG_SHA256 273
+#define SIG_MAX_SIZE (1 << 20)
+
+// Find the hex digest in the index of the signature header.
+static
+const char *sig_digest(const unsigned char *index, unsigned il,
+	const char *data, unsigned dl, unsigned tag, unsigned len)
+{
+    for (unsigned i = 0; i < il; i++) {
+	uint32_t e[4];
+	memcpy(e, index + 16 * i, 16);
+	if (ntohl(e[0]) != tag)
+	    continue;
+	unsigned off = ntohl(e[2]);
+	if (off > dl || dl - off < len + 1 || data[off + len] != '\0')
+	    return NULL;
+	for (unsigned j = 0; j < len; j++)
+	    if (!isxdigit((unsigned char) data[off + j]))
+		return NULL;
+	return data + off;
+    }
+    return NULL;
+}
+
+bool rpmcache_digest_key(const char *fname, int fd, unsigned fsize, struct rpmkey *key)
+{
+    const char *bn = strrchr(fname, '/');
+    bn = bn ? bn + 1 : fname;
+    size_t len = strlen(bn);
+    if (len < sizeof("a-1-1.src.rpm") - 1 || memcmp(bn + len - 4, ".rpm", 4))
+	return false;
+    unsigned char lead[LEAD_SIZE + 16];
+    if (pread(fd, lead, sizeof lead, 0) != sizeof lead)
+	return false;
+    static const unsigned char rpm_magic[] = { 0xed, 0xab, 0xee, 0xdb };
+    static const unsigned char hdr_magic[] = { 0x8e, 0xad, 0xe8, 0x01 };
+    if (memcmp(lead, rpm_magic, 4) || memcmp(lead + LEAD_SIZE, hdr_magic, 4))
+	return false;
+    uint32_t il, dl;
+    memcpy(&il, lead + LEAD_SIZE + 8, 4);
+    memcpy(&dl, lead + LEAD_SIZE + 12, 4);
+    il = ntohl(il);
+    dl = ntohl(dl);
+    if (il > SIG_MAX_SIZE / 16 || dl > SIG_MAX_SIZE || 16 * il + dl > SIG_MAX_SIZE)
+	return false;
+    size_t size = 16 * il + dl;
+    unsigned char *sig = malloc(size);
+    if (sig == NULL)
+	return false;
+    bool ok = false;
+    if (pread(fd, sig, size, LEAD_SIZE + 16) != (ssize_t) size)
+	goto out;
+    const char *data = (const char *) sig + 16 * il;
+    const char *digest = sig_digest(sig, il, data, dl, SIGTAG_SHA256, 64);
+    if (digest == NULL)
+	digest = sig_digest(sig, il, data, dl, SIGTAG_SHA1, 40);
+    if (digest == NULL)
+	goto out;
+    // The digest covers the header, but not the signature; since the
+    // header is located past the signature, the key also has its end,
+    // and a hash of the signature, which tells re-signed copies apart.
+    // The file size covers the payload.
+    unsigned hoff = LEAD_SIZE + 16 + size;
+    hoff += -hoff & 7;
+    uint32_t sighash = 2166136261U;
+    for (size_t i = 0; i < size; i++)
+	sighash = (sighash ^ sig[i]) * 16777619U;
+    // 40 hex characters of the digest are enough
+    int n = snprintf(key->str, sizeof key->str, "%.*s@%.40s.%u.%u.%08x",
+	    (int) len - 4, bn, digest, hoff, fsize, sighash);
+    if (n < 0 || n > MAXRPMKEYLEN) {
+	fprintf(stderr, "%s %s: name too long\n", __func__, bn);
+	goto out;
+    }
+    key->len = n;
+    ok = true;
+out:
+    free(sig);
+    return ok;
+}
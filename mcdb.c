@@ -1,17 +1,68 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
 #include <libmemcached-1.0/memcached.h>
+#include <libmemcachedutil-1.0/util.h>
 #include "mcdb.h"
 
 #define progname program_invocation_short_name
 
+// The handle can be shared by a few threads: each request takes
+// a connection from the pool.  Unless the config string says otherwise
+// (with --POOL-MAX), the pool grows up to MCDB_POOL_MAX connections.
+#define MCDB_POOL_MAX 8
+
+// How long to wait for a free connection, in seconds.
+#define MCDB_POOL_WAIT 5
+
+struct mcdb {
+    memcached_pool_st *pool;
+    unsigned long nerr;	// see mcdb_errors
+};
+
+static void mcdb_error(struct mcdb *db)
+{
+    __atomic_add_fetch(&db->nerr, 1, __ATOMIC_RELAXED);
+}
+
+static memcached_st *mcdb_fetch(struct mcdb *db)
+{
+    struct timespec wait = { MCDB_POOL_WAIT, 0 };
+    memcached_return_t rc;
+    memcached_st *memc = memcached_pool_fetch(db->pool, &wait, &rc);
+    if (memc == NULL) {
+	fprintf(stderr, "%s: %s: %s\n", progname, "memcached_pool_fetch", memcached_strerror(NULL, rc));
+	mcdb_error(db);
+    }
+    return memc;
+}
+
+static void mcdb_release(struct mcdb *db, memcached_st *memc)
+{
+    memcached_return_t rc = memcached_pool_release(db->pool, memc);
+    if (rc != MEMCACHED_SUCCESS)
+	fprintf(stderr, "%s: %s: %s\n", progname, "memcached_pool_release", memcached_strerror(NULL, rc));
+}
+
 struct mcdb *mcdb_open(const char *configstring)
 {
     assert(configstring && *configstring);
-    memcached_st *memc = memcached(configstring, strlen(configstring));
-    if (!memc) {
+    struct mcdb *db = malloc(sizeof(*db));
+    if (db == NULL) {
+	fprintf(stderr, "%s: %s: %s\n", progname, "malloc", strerror(errno));
+	return NULL;
+    }
+    db->nerr = 0;
+    char *config = NULL;
+    if (strstr(configstring, "--POOL-MAX") == NULL &&
+	    asprintf(&config, "%s --POOL-MAX=%d", configstring, MCDB_POOL_MAX) < 0)
+	config = NULL;
+    if (config)
+	configstring = config;
+    db->pool = memcached_pool(configstring, strlen(configstring));
+    if (!db->pool) {
 	char buf[1024];
 	buf[0] = '\0';
 	memcached_return_t rc = libmemcached_check_configuration(configstring, strlen(configstring), buf, sizeof buf);
@@ -21,40 +72,157 @@ struct mcdb *mcdb_open(const char *configstring)
 	    fprintf(stderr, "%s: %s: %.*s\n", progname, "memcached", (int) sizeof buf, buf);
 	else
 	    fprintf(stderr, "%s: %s: %s\n", progname, "memcached", memcached_strerror(NULL, rc));
+	free(config);
+	free(db);
+	return NULL;
     }
-    return (void *) memc;
+    free(config);
+    return db;
 }
 
 void mcdb_close(struct mcdb *db)
 {
-    memcached_free((void *) db);
+    memcached_free(memcached_pool_destroy(db->pool));
+    free(db);
 }
 
 bool mcdb_get(struct mcdb *db,
 	const char *key, size_t keylen,
 	void **datap, size_t *datasizep)
 {
-    memcached_st *memc = (void *) db;
     memcached_return_t rc;
     uint32_t flags;
     assert(datap && datasizep);
-    *datap = memcached_get(memc, key, keylen, datasizep, &flags, &rc);
-    if (*datap == NULL) {
-        if (rc != MEMCACHED_NOTFOUND)
-	    fprintf(stderr, "%s: %s: %s\n", "memcached_get", key, memcached_strerror(memc, rc));
+    *datap = NULL;
+    memcached_st *memc = mcdb_fetch(db);
+    if (memc == NULL)
 	return false;
+    *datap = memcached_get(memc, key, keylen, datasizep, &flags, &rc);
+    if (*datap == NULL && rc != MEMCACHED_NOTFOUND) {
+	fprintf(stderr, "%s: %s: %s\n", "memcached_get", key, memcached_strerror(memc, rc));
+	mcdb_error(db);
+    }
+    mcdb_release(db, memc);
+    return *datap != NULL;
+}
+
+struct mget_ctx {
+    const char *const *keys;
+    const size_t *keylens;
+};
+
+static int mget_cmp(const void *a, const void *b, void *arg)
+{
+    const struct mget_ctx *ctx = arg;
+    size_t i = *(const size_t *) a;
+    size_t j = *(const size_t *) b;
+    size_t len = ctx->keylens[i] < ctx->keylens[j] ? ctx->keylens[i] : ctx->keylens[j];
+    int cmp = memcmp(ctx->keys[i], ctx->keys[j], len);
+    if (cmp)
+	return cmp;
+    return (ctx->keylens[i] > ctx->keylens[j]) - (ctx->keylens[i] < ctx->keylens[j]);
+}
+
+// Find the first index in the sorted order which matches the key.
+static size_t mget_find(const struct mget_ctx *ctx, const size_t *order, size_t n,
+	const char *key, size_t keylen)
+{
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+	size_t mid = lo + (hi - lo) / 2;
+	size_t i = order[mid];
+	size_t len = ctx->keylens[i] < keylen ? ctx->keylens[i] : keylen;
+	int cmp = memcmp(ctx->keys[i], key, len);
+	if (cmp < 0 || (cmp == 0 && ctx->keylens[i] < keylen))
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
+
+// A large multi-get is issued in batches, so that the server's replies
+// don't pile up while the client is still sending the keys.
+#define MGET_BATCH 1024
+
+static void mget_batch(struct mcdb *db, memcached_st *memc, size_t n,
+	const char *const keys[], const size_t keylens[],
+	void *datap[], size_t datasizep[], size_t *order)
+{
+    memcached_return_t rc = memcached_mget(memc, keys, keylens, n);
+    if (rc != MEMCACHED_SUCCESS) {
+	fprintf(stderr, "%s: %s\n", "memcached_mget", memcached_strerror(memc, rc));
+	mcdb_error(db);
+	return;
+    }
+    struct mget_ctx ctx = { keys, keylens };
+    for (size_t i = 0; i < n; i++)
+	order[i] = i;
+    qsort_r(order, n, sizeof(*order), mget_cmp, &ctx);
+    memcached_result_st *res = memcached_result_create(memc, NULL);
+    if (res == NULL) {
+	fprintf(stderr, "%s: %s\n", progname, "memcached_result_create failed");
+	return;
     }
-    return true;
+    // the results come in no particular order
+    while (memcached_fetch_result(memc, res, &rc)) {
+	const char *key = memcached_result_key_value(res);
+	size_t keylen = memcached_result_key_length(res);
+	const char *data = memcached_result_value(res);
+	size_t datasize = memcached_result_length(res);
+	// the same key can be requested more than once
+	for (size_t k = mget_find(&ctx, order, n, key, keylen); k < n; k++) {
+	    size_t i = order[k];
+	    if (keylens[i] != keylen || memcmp(keys[i], key, keylen))
+		break;
+	    if (datap[i])
+		continue;
+	    datap[i] = malloc(datasize ? datasize : 1);
+	    if (datap[i] == NULL) {
+		fprintf(stderr, "%s: %s: %s\n", progname, "malloc", strerror(errno));
+		continue;
+	    }
+	    memcpy(datap[i], data, datasize);
+	    datasizep[i] = datasize;
+	}
+    }
+    if (rc != MEMCACHED_END && rc != MEMCACHED_SUCCESS && rc != MEMCACHED_NOTFOUND) {
+	fprintf(stderr, "%s: %s\n", "memcached_fetch_result", memcached_strerror(memc, rc));
+	mcdb_error(db);
+    }
+    memcached_result_free(res);
+}
+
+void mcdb_mget(struct mcdb *db, size_t n,
+	const char *const keys[], const size_t keylens[],
+	void *datap[], size_t datasizep[])
+{
+    for (size_t i = 0; i < n; i++)
+	datap[i] = NULL;
+    memcached_st *memc = mcdb_fetch(db);
+    if (memc == NULL)
+	return;
+    size_t order[MGET_BATCH];
+    for (size_t i = 0; i < n; i += MGET_BATCH) {
+	size_t m = n - i < MGET_BATCH ? n - i : MGET_BATCH;
+	mget_batch(db, memc, m, keys + i, keylens + i, datap + i, datasizep + i, order);
+    }
+    mcdb_release(db, memc);
 }
 
 void mcdb_put(struct mcdb *db,
 	const char *key, size_t keylen,
 	const void *data, size_t datasize)
 {
-    memcached_st *memc = (void *) db;
+    memcached_st *memc = mcdb_fetch(db);
+    if (memc == NULL)
+	return;
     memcached_return_t rc = memcached_set(memc, key, keylen, data, datasize, 0, 0);
-    if (rc != MEMCACHED_SUCCESS)
+    if (rc != MEMCACHED_SUCCESS) {
 	fprintf(stderr, "%s: %s: %s\n", "memcached_set", key, memcached_strerror(memc, rc));
+	mcdb_error(db);
+    }
+    mcdb_release(db, memc);
 }
 
 static memcached_return_t stat_cb(const memcached_instance_st *server,
@@ -80,9 +248,12 @@ static memcached_return_t stat_cb(const memcached_instance_st *server,
 
 int mcdb_max_item_size(struct mcdb *db)
 {
-    memcached_st *memc = (void *) db;
+    memcached_st *memc = mcdb_fetch(db);
+    if (memc == NULL)
+	return -1;
     int size = -1;
     memcached_return_t rc = memcached_stat_execute(memc, "settings", stat_cb, &size);
+    mcdb_release(db, memc);
     // fall back to the default size
     if (size == 0)
 	size = 1 << 20;
@@ -94,3 +265,8 @@ int mcdb_max_item_size(struct mcdb *db)
 	fprintf(stderr, "%s: %s\n", progname, "cannot connect to memcached");
     return -1;
 }
+
+unsigned long mcdb_errors(struct mcdb *db)
+{
+    return __atomic_load_n(&db->nerr, __ATOMIC_RELAXED);
+}
@@ -1,6 +1,8 @@
 // This is a tiny wrapper around libmemcached, which can
 // hopefully reduce the complexity of interacting with
 // memcached to only a few well-defined operations.
+// A handle can be used by a few threads at once, over a pool
+// of connections.
 
 struct mcdb *mcdb_open(const char *configstring);
 void mcdb_close(struct mcdb *db);
@@ -8,8 +10,15 @@ void mcdb_close(struct mcdb *db);
 bool mcdb_get(struct mcdb *db,
 	const char *key, size_t keylen,
 	void **datap /* malloc'd */, size_t *datasizep);
+// Fetch n keys at once; on return, datap[i] is NULL for missing keys.
+void mcdb_mget(struct mcdb *db, size_t n,
+	const char *const keys[], const size_t keylens[],
+	void *datap[] /* malloc'd */, size_t datasizep[]);
 void mcdb_put(struct mcdb *db,
 	const char *key, size_t keylen,
 	const void *data, size_t datasize);
 
 int mcdb_max_item_size(struct mcdb *db);
+
+// The number of failed requests (other than misses) so far.
+unsigned long mcdb_errors(struct mcdb *db);
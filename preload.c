@@ -28,13 +28,14 @@ rpmRC rpmReadPackageFile(rpmts ts, FD_t fd, const char *fn, Header *hdrp)
     // make the key
     struct rpmkey key;
     if (fname) {
-	if (!rpmcache_key(fname, st.st_size, st.st_mtime, &key))
+	if (!hdrcache_key(fname, Fileno(fd), st.st_size, st.st_mtime, &key))
 	    fname = NULL;
     }
     // get from the cache
     if (fname) {
 	unsigned off;
-	Header h = hdrcache_get(&key, &off);
+	rpmRC rc;
+	Header h = hdrcache_get(fname, &key, &off, &rc);
 	if (h) {
 	    int pos = lseek(Fileno(fd), off, SEEK_SET);
 	    if (pos != (int) off)
@@ -44,9 +45,15 @@ rpmRC rpmReadPackageFile(rpmts ts, FD_t fd, const char *fn, Header *hdrp)
 		    *hdrp = h;
 		else
 		    headerFree(h);
-		return RPMRC_OK;
+		return rc;
 	    }
 	}
+	// the package is known to be broken
+	else if (rc != RPMRC_OK) {
+	    if (hdrp)
+		*hdrp = NULL;
+	    return rc;
+	}
     }
     // set up and call the real __func__
     static
@@ -62,8 +69,10 @@ rpmRC rpmReadPackageFile(rpmts ts, FD_t fd, const char *fn, Header *hdrp)
 	if (rc == RPMRC_OK || rc == RPMRC_NOTTRUSTED || rc == RPMRC_NOKEY) {
 	    int pos = lseek(Fileno(fd), 0, SEEK_CUR);
 	    if (pos > 0)
-		hdrcache_put(&key, h, pos);
+		hdrcache_put(&key, h, pos, rc);
 	}
+	else if (rc == RPMRC_FAIL || rc == RPMRC_NOTFOUND)
+	    hdrcache_put_failed(&key, rc);
 	if (hdrp)
 	    *hdrp = h;
 	else if (h)
@@ -0,0 +1,414 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "rdb.h"
+
+#define progname program_invocation_short_name
+
+// Keys are sent in batches, each batch being a single command;
+// all the batches are sent before the replies are read.
+#define RDB_BATCH 1024
+
+// The replies are read through a buffer.
+#define RDB_BUFSIZE (64 << 10)
+
+// Give up on a stuck server.
+#define RDB_TIMEOUT 5
+
+struct rdb {
+    char *host, *port;	// or the path to a unix socket in host
+    int fd;		// -1 if not connected
+    // commands are built here
+    char *wbuf;
+    size_t wlen, walloc;
+    // replies are read here
+    size_t rpos, rlen;
+    char rbuf[RDB_BUFSIZE];
+    // failed requests, see rdb_errors
+    unsigned long nerr;
+};
+
+static bool rdb_connect(struct rdb *db)
+{
+    struct timeval tv = { RDB_TIMEOUT, 0 };
+    if (db->host[0] == '/') {
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	if (strlen(db->host) >= sizeof sun.sun_path) {
+	    fprintf(stderr, "%s: %s: %s\n", progname, db->host, "socket path too long");
+	    return false;
+	}
+	strcpy(sun.sun_path, db->host);
+	db->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (db->fd < 0) {
+	    fprintf(stderr, "%s: %s: %s\n", progname, "socket", strerror(errno));
+	    return false;
+	}
+	if (connect(db->fd, (struct sockaddr *) &sun, sizeof sun) < 0) {
+	    fprintf(stderr, "%s: %s: %s\n", progname, db->host, strerror(errno));
+	    close(db->fd);
+	    db->fd = -1;
+	    return false;
+	}
+    }
+    else {
+	struct addrinfo hints = {
+	    .ai_family = AF_UNSPEC,
+	    .ai_socktype = SOCK_STREAM,
+	};
+	struct addrinfo *res, *ai;
+	int rc = getaddrinfo(db->host, db->port, &hints, &res);
+	if (rc) {
+	    fprintf(stderr, "%s: %s: %s\n", progname, db->host, gai_strerror(rc));
+	    return false;
+	}
+	int err = 0;
+	for (ai = res; ai; ai = ai->ai_next) {
+	    db->fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+	    if (db->fd < 0) {
+		err = errno;
+		continue;
+	    }
+	    if (connect(db->fd, ai->ai_addr, ai->ai_addrlen) == 0)
+		break;
+	    err = errno;
+	    close(db->fd);
+	    db->fd = -1;
+	}
+	freeaddrinfo(res);
+	if (db->fd < 0) {
+	    fprintf(stderr, "%s: %s:%s: %s\n", progname, db->host, db->port, strerror(err));
+	    return false;
+	}
+	int one = 1;
+	setsockopt(db->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    }
+    setsockopt(db->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+    setsockopt(db->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+    db->rpos = db->rlen = 0;
+    return true;
+}
+
+// Drop the connection after an error; the next request will reconnect.
+static void rdb_fail(struct rdb *db, const char *what)
+{
+    fprintf(stderr, "%s: %s: %s\n", progname, "redis", what);
+    db->nerr++;
+    if (db->fd >= 0)
+	close(db->fd);
+    db->fd = -1;
+}
+
+struct rdb *rdb_open(const char *configstring)
+{
+    assert(configstring && *configstring);
+    struct rdb *db = malloc(sizeof(*db));
+    if (db == NULL) {
+	fprintf(stderr, "%s: %s: %s\n", progname, "malloc", strerror(errno));
+	return NULL;
+    }
+    db->fd = -1;
+    db->nerr = 0;
+    db->wbuf = NULL;
+    db->wlen = db->walloc = 0;
+    // the string is followed by the default port
+    size_t len = strlen(configstring);
+    db->host = malloc(len + sizeof("6379") + 1);
+    if (db->host == NULL) {
+	fprintf(stderr, "%s: %s: %s\n", progname, "malloc", strerror(errno));
+	free(db);
+	return NULL;
+    }
+    strcpy(db->host, configstring);
+    while (len && (db->host[len-1] == ' ' || db->host[len-1] == '\t'))
+	db->host[--len] = '\0';
+    db->port = db->host + len + 1;
+    strcpy(db->port, "6379");
+    if (db->host[0] != '/') {
+	// "[::1]:6379" or "host:6379", but not "::1"
+	char *colon = strrchr(db->host, ':');
+	if (db->host[0] == '[') {
+	    char *br = strchr(db->host, ']');
+	    if (br && br[1] == ':')
+		db->port = br + 2;
+	    if (br) {
+		*br = '\0';
+		memmove(db->host, db->host + 1, br - db->host);
+	    }
+	}
+	else if (colon && colon == strchr(db->host, ':')) {
+	    *colon = '\0';
+	    db->port = colon + 1;
+	}
+    }
+    if (!rdb_connect(db)) {
+	free(db->host);
+	free(db);
+	return NULL;
+    }
+    return db;
+}
+
+void rdb_close(struct rdb *db)
+{
+    if (db->fd >= 0)
+	close(db->fd);
+    free(db->wbuf);
+    free(db->host);
+    free(db);
+}
+
+static bool wput(struct rdb *db, const void *data, size_t size)
+{
+    if (db->wlen + size > db->walloc) {
+	size_t alloc = db->walloc ? db->walloc : 4096;
+	while (alloc < db->wlen + size)
+	    alloc *= 2;
+	char *wbuf = realloc(db->wbuf, alloc);
+	if (wbuf == NULL) {
+	    fprintf(stderr, "%s: %s: %s\n", progname, "realloc", strerror(errno));
+	    return false;
+	}
+	db->wbuf = wbuf;
+	db->walloc = alloc;
+    }
+    memcpy(db->wbuf + db->wlen, data, size);
+    db->wlen += size;
+    return true;
+}
+
+// Append a command with argc arguments, then the arguments, as per
+// the RESP protocol.
+static bool wcmd(struct rdb *db, size_t argc)
+{
+    char buf[32];
+    int len = snprintf(buf, sizeof buf, "*%zu\r\n", argc);
+    return wput(db, buf, len);
+}
+
+static bool warg(struct rdb *db, const void *arg, size_t size)
+{
+    char buf[32];
+    int len = snprintf(buf, sizeof buf, "$%zu\r\n", size);
+    return wput(db, buf, len) && wput(db, arg, size) && wput(db, "\r\n", 2);
+}
+
+static bool wflush(struct rdb *db)
+{
+    size_t off = 0;
+    while (off < db->wlen) {
+	// a closed connection fails with EPIPE, without SIGPIPE
+	ssize_t n = send(db->fd, db->wbuf + off, db->wlen - off, MSG_NOSIGNAL);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    rdb_fail(db, strerror(errno));
+	    return false;
+	}
+	off += n;
+    }
+    db->wlen = 0;
+    return true;
+}
+
+static bool rfill(struct rdb *db)
+{
+    if (db->rpos) {
+	memmove(db->rbuf, db->rbuf + db->rpos, db->rlen - db->rpos);
+	db->rlen -= db->rpos;
+	db->rpos = 0;
+    }
+    while (1) {
+	ssize_t n = read(db->fd, db->rbuf + db->rlen, sizeof(db->rbuf) - db->rlen);
+	if (n > 0) {
+	    db->rlen += n;
+	    return true;
+	}
+	if (n < 0 && errno == EINTR)
+	    continue;
+	rdb_fail(db, n < 0 ? strerror(errno) : "connection closed");
+	return false;
+    }
+}
+
+static bool rread(struct rdb *db, void *data, size_t size)
+{
+    char *p = data;
+    while (size) {
+	if (db->rpos == db->rlen && !rfill(db))
+	    return false;
+	size_t n = db->rlen - db->rpos;
+	if (n > size)
+	    n = size;
+	memcpy(p, db->rbuf + db->rpos, n);
+	db->rpos += n;
+	p += n;
+	size -= n;
+    }
+    return true;
+}
+
+// Read the first line of a reply: the type character and the number
+// which follows (the length, the number of elements, or the integer).
+static bool rhead(struct rdb *db, char *type, long long *num)
+{
+    char *eol;
+    while ((eol = memchr(db->rbuf + db->rpos, '\n', db->rlen - db->rpos)) == NULL) {
+	if (db->rlen - db->rpos == sizeof(db->rbuf)) {
+	    rdb_fail(db, "reply line too long");
+	    return false;
+	}
+	if (!rfill(db))
+	    return false;
+    }
+    char *line = db->rbuf + db->rpos;
+    db->rpos = eol + 1 - db->rbuf;
+    if (eol > line && eol[-1] == '\r')
+	eol--;
+    *eol = '\0';
+    *type = line[0];
+    *num = 0;
+    switch (*type) {
+    case '$':
+    case '*':
+    case ':':
+	*num = strtoll(line + 1, NULL, 10);
+	return true;
+    case '+':
+	return true;
+    case '-':
+	fprintf(stderr, "%s: %s: %s\n", progname, "redis", line + 1);
+	return true;
+    }
+    rdb_fail(db, "bad reply");
+    return false;
+}
+
+// Read a bulk string reply; *datap is set to NULL for nil.
+static bool rbulk(struct rdb *db, void **datap, size_t *datasizep)
+{
+    char type;
+    long long len;
+    if (!rhead(db, &type, &len))
+	return false;
+    if (type != '$') {
+	rdb_fail(db, "unexpected reply");
+	return false;
+    }
+    if (len < 0)
+	return true;
+    char *data = malloc(len ? len : 1);
+    if (data == NULL) {
+	rdb_fail(db, strerror(errno));
+	return false;
+    }
+    char crlf[2];
+    if (!rread(db, data, len) || !rread(db, crlf, 2)) {
+	free(data);
+	return false;
+    }
+    *datap = data;
+    *datasizep = len;
+    return true;
+}
+
+void rdb_mget(struct rdb *db, size_t n,
+	const char *const keys[], const size_t keylens[],
+	void *datap[], size_t datasizep[])
+{
+    for (size_t i = 0; i < n; i++)
+	datap[i] = NULL;
+    if (n == 0)
+	return;
+    if (db->fd < 0 && !rdb_connect(db)) {
+	db->nerr++;
+	return;
+    }
+    db->wlen = 0;
+    for (size_t i = 0; i < n; i += RDB_BATCH) {
+	size_t m = n - i < RDB_BATCH ? n - i : RDB_BATCH;
+	if (!wcmd(db, m + 1) || !warg(db, "MGET", 4))
+	    return;
+	for (size_t k = i; k < i + m; k++)
+	    if (!warg(db, keys[k], keylens[k]))
+		return;
+    }
+    if (!wflush(db))
+	return;
+    for (size_t i = 0; i < n; i += RDB_BATCH) {
+	size_t m = n - i < RDB_BATCH ? n - i : RDB_BATCH;
+	char type;
+	long long num;
+	if (!rhead(db, &type, &num))
+	    return;
+	if (type != '*' || num != (long long) m) {
+	    rdb_fail(db, "unexpected reply to MGET");
+	    return;
+	}
+	for (size_t k = i; k < i + m; k++)
+	    if (!rbulk(db, &datap[k], &datasizep[k]))
+		return;
+    }
+}
+
+bool rdb_get(struct rdb *db,
+	const char *key, size_t keylen,
+	void **datap, size_t *datasizep)
+{
+    assert(datap && datasizep);
+    rdb_mget(db, 1, &key, &keylen, datap, datasizep);
+    return *datap != NULL;
+}
+
+void rdb_mput(struct rdb *db, size_t n,
+	const char *const keys[], const size_t keylens[],
+	const void *const data[], const size_t datasizes[])
+{
+    if (n == 0)
+	return;
+    if (db->fd < 0 && !rdb_connect(db)) {
+	db->nerr++;
+	return;
+    }
+    db->wlen = 0;
+    for (size_t i = 0; i < n; i += RDB_BATCH) {
+	size_t m = n - i < RDB_BATCH ? n - i : RDB_BATCH;
+	if (!wcmd(db, 2 * m + 1) || !warg(db, "MSET", 4))
+	    return;
+	for (size_t k = i; k < i + m; k++)
+	    if (!warg(db, keys[k], keylens[k]) || !warg(db, data[k], datasizes[k]))
+		return;
+    }
+    if (!wflush(db))
+	return;
+    for (size_t i = 0; i < n; i += RDB_BATCH) {
+	char type;
+	long long num;
+	if (!rhead(db, &type, &num))
+	    return;
+	if (type != '+' && type != '-') {
+	    rdb_fail(db, "unexpected reply to MSET");
+	    return;
+	}
+    }
+}
+
+void rdb_put(struct rdb *db,
+	const char *key, size_t keylen,
+	const void *data, size_t datasize)
+{
+    rdb_mput(db, 1, &key, &keylen, &data, &datasize);
+}
+
+unsigned long rdb_errors(struct rdb *db)
+{
+    return db->nerr;
+}
@@ -0,0 +1,29 @@
+// A tiny redis client, with the same few operations as mcdb.h.
+// The config string is "host[:port]" (6379 by default), or the path
+// to a unix socket, starting with '/'.  Requests are pipelined: a batch
+// of keys goes in a single MGET or MSET command.
+
+struct rdb *rdb_open(const char *configstring);
+void rdb_close(struct rdb *db);
+
+bool rdb_get(struct rdb *db,
+	const char *key, size_t keylen,
+	void **datap /* malloc'd */, size_t *datasizep);
+// Fetch n keys at once; on return, datap[i] is NULL for missing keys.
+void rdb_mget(struct rdb *db, size_t n,
+	const char *const keys[], const size_t keylens[],
+	void *datap[] /* malloc'd */, size_t datasizep[]);
+void rdb_put(struct rdb *db,
+	const char *key, size_t keylen,
+	const void *data, size_t datasize);
+// Store n entries at once.
+void rdb_mput(struct rdb *db, size_t n,
+	const char *const keys[], const size_t keylens[],
+	const void *const data[], const size_t datasizes[]);
+
+// The number of failed requests (connection and protocol errors) so far.
+unsigned long rdb_errors(struct rdb *db);
+
+// Redis is not bound by memcached's item_size_max; this is the default
+// limit on the size of a string (proto-max-bulk-len).
+#define RDB_MAX_ITEM_SIZE (512 << 20)
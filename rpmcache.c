@@ -3,41 +3,143 @@
 #include <string.h>
 #include <assert.h>
 #include <limits.h>
-#include <lz4.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "cache.h"
 #include "rpmcache.h"
 #include "error.h"
 #include "cache.h"
 #include "mcdb.h"
+#include "rdb.h"
 #include "conf.h"
+#include "codec.h"
+#include "stats.h"
 
-struct rpmcache {
+// A cache can be a chain of backends, declared with a few lines in
+// rpmcache.conf, fastest first.  Reads try the tiers in order, and hits
+// are promoted into the faster tiers.  Writes go to all tiers; writes
+// to "TYPE,async" tiers are queued and done by a background thread.
+#define MAXTIERS 4
+
+// Operation counters and latency histograms, see rpmcache_stats.
+enum {
+    RST_GET,
+    RST_HIT,
+    RST_HIT_TIER0,	// by the tier which had the entry
+    RST_HIT_TIER1,
+    RST_HIT_TIER2,
+    RST_HIT_TIER3,
+    RST_PROMOTE,
+    RST_PUT,
+    RST_PUT_BYTES,
+    RST_OVERSIZE,	// too big for a remote tier
+    RST_CHUNKED,	// split into memcached items
+    RST_CHUNK_MISS,	// chunks evicted or overwritten
+    RST_WB_QUEUED,
+    RST_WB_DROPPED,
+    RST_REMOTE_ERRORS,	// taken from the backends when written
+    RST_NCNT
+};
+enum {
+    RSH_GET,
+    RSH_MGET,
+    RSH_PUT,
+    RSH_COMPRESS,	// remote entries only
+    RSH_DECOMPRESS,
+    RSH_NHIST
+};
+
+static const char *const cntname[RST_NCNT] = {
+    [RST_GET] = "get",
+    [RST_HIT] = "hit",
+    [RST_HIT_TIER0] = "hit_tier0",
+    [RST_HIT_TIER1] = "hit_tier1",
+    [RST_HIT_TIER2] = "hit_tier2",
+    [RST_HIT_TIER3] = "hit_tier3",
+    [RST_PROMOTE] = "promote",
+    [RST_PUT] = "put",
+    [RST_PUT_BYTES] = "put_bytes",
+    [RST_OVERSIZE] = "oversize",
+    [RST_CHUNKED] = "chunked",
+    [RST_CHUNK_MISS] = "chunk_miss",
+    [RST_WB_QUEUED] = "wb_queued",
+    [RST_WB_DROPPED] = "wb_dropped",
+    [RST_REMOTE_ERRORS] = "remote_errors",
+};
+
+static const char *const histname[RSH_NHIST] = {
+    [RSH_GET] = "get",
+    [RSH_MGET] = "mget",
+    [RSH_PUT] = "put",
+    [RSH_COMPRESS] = "compress",
+    [RSH_DECOMPRESS] = "decompress",
+};
+
+struct rstats {
+    unsigned long cnt[RST_NCNT];
+    struct stats_hist hist[RSH_NHIST];
+};
+
+struct tier {
     enum conftype t;	// the backend found in rpmcache.conf
     void *db;		// the backend's handle
     size_t max_item_size;
+    size_t max_ent_size;	// with chunking
+    bool async;		// write-back
+    struct codec_policy codec;
+    // the handle is shared by the threads, including the write-back
+    // thread; memcached handles take care of it themselves
+    bool mt;
+    pthread_mutex_t lock;
+    struct rstats *stats;	// the cache's
 };
 
-struct rpmcache *rpmcache_open(const char *name)
-{
-    struct conf *conf = NULL;
-    const char *fname = getenv("RPMCACHE_CONFIG");
-    if (fname && *fname) {
-	FILE *fp = fopen(fname, "r");
-	if (!fp) {
-	    ERROR("fopen: %s: %m", fname);
-	    return NULL;
-	}
-	conf = findconf(fp, name);
-	fclose(fp);
-    }
-    else {
-	// TODO: handle /etc/rpmcache.conf and ~/.config/rpmcache.conf
-    }
-    if (!conf) {
-	ERROR("%s: cache unconfigured", name);
-	return NULL;
-    }
+// Queued writes, up to WB_MAX_BYTES, beyond which they are dropped.
+#define WB_MAX_BYTES (64 << 20)
+
+struct wbent {
+    struct wbent *next;
+    unsigned tiers;	// bitmask
+    struct rpmkey key;
+    int valsize;
+    char val[];
+};
+
+// Entries too big for a memcached item are split into chunks, stored
+// under KEY#0..KEY#n-1, and the item under KEY is the manifest.
+// The chunks are written first, and the manifest's checksum makes
+// a partially evicted (or concurrently overwritten) set a miss.
+#define MAXCHUNKS 64
+// room for the item header and the key
+#define CHUNK_SLACK 512
+
+struct chunks {
+    uint32_t size;	// of the entry
+    uint32_t nchunk;
+    uint64_t sum;	// FNV-1a of the entry
+};
+
+struct rpmcache {
+    char *name;
+    char *tags;		// see rpmcache_tags
+    struct rstats stats;
+    int ntier;
+    struct tier tier[MAXTIERS];
+    int pid;		// the process which uses the locks, see wb_forked
+    // write-back
+    pthread_mutex_t wblock;
+    pthread_cond_t wbcond;
+    pthread_t wbthr;
+    int wbpid;		// the process running the thread, 0 if none
+    bool wbstop;
+    struct wbent *wbhead, **wbtail;
+    size_t wbbytes;
+};
 
+static
+bool tier_open(struct tier *tier, const char *name, const struct conf *conf,
+	const char *codec)
+{
     void *db = NULL;
     int max_item_size = INT_MAX;
     switch (conf->t) {
@@ -51,53 +153,239 @@ struct rpmcache *rpmcache_open(const char *name)
 	    if (max_item_size < 1024) {
 		ERROR("%s: cannot get max_item_size", name);
 		mcdb_close(db);
-		return NULL;
+		return false;
 	    }
 	}
 	break;
     case CONFTYPE_REDIS:
-	ERROR("redis not yet supported");
+	db = rdb_open(conf->str);
+	max_item_size = RDB_MAX_ITEM_SIZE;
+	break;
     }
     if (db == NULL) {
 	ERROR("%s: cannot open db", name);
+	return false;
+    }
+
+    tier->t = conf->t;
+    tier->db = db;
+    tier->max_item_size = max_item_size;
+    tier->max_ent_size = max_item_size;
+    if (conf->t == CONFTYPE_MEMCACHED) {
+	size_t max = (size_t) MAXCHUNKS * (max_item_size - CHUNK_SLACK);
+	tier->max_ent_size = max < INT_MAX ? max : INT_MAX;
+    }
+    tier->async = conf->async;
+    codec_parse(NULL, &tier->codec);
+    if (codec) {
+	if (conf->t == CONFTYPE_QACACHE)
+	    cache_codec(db, codec);
+	else
+	    codec_parse(codec, &tier->codec);
+    }
+    tier->mt = conf->t == CONFTYPE_MEMCACHED;
+    pthread_mutex_init(&tier->lock, NULL);
+    return true;
+}
+
+static inline
+void tier_lock(struct tier *tier)
+{
+    if (!tier->mt)
+	pthread_mutex_lock(&tier->lock);
+}
+
+static inline
+void tier_unlock(struct tier *tier)
+{
+    if (!tier->mt)
+	pthread_mutex_unlock(&tier->lock);
+}
+
+static
+void tier_close(struct tier *tier)
+{
+    switch (tier->t) {
+    case CONFTYPE_QACACHE:
+	cache_close(tier->db);
+	break;
+    case CONFTYPE_MEMCACHED:
+	mcdb_close(tier->db);
+	break;
+    case CONFTYPE_REDIS:
+	rdb_close(tier->db);
+	break;
+    }
+    pthread_mutex_destroy(&tier->lock);
+}
+
+struct rpmcache *rpmcache_open(const char *name)
+{
+    struct conf *conf[MAXTIERS];
+    int nconf = 0;
+    // "NAME codec POLICY" applies to all tiers
+    char *codec = NULL;
+    char *tags = NULL;
+    const char *fname = getenv("RPMCACHE_CONFIG");
+    if (fname && *fname) {
+	FILE *fp = fopen(fname, "r");
+	if (!fp) {
+	    ERROR("fopen: %s: %m", fname);
+	    return NULL;
+	}
+	while (nconf < MAXTIERS && (conf[nconf] = findconf(fp, name)))
+	    nconf++;
+	codec = findopt(fp, name, "codec");
+	tags = findopt(fp, name, "tags");
+	fclose(fp);
+    }
+    else {
+	// TODO: handle /etc/rpmcache.conf and ~/.config/rpmcache.conf
+    }
+    if (nconf == 0) {
+	ERROR("%s: cache unconfigured", name);
+	free(codec);
+	free(tags);
 	return NULL;
     }
 
-    struct rpmcache *rpmcache = malloc(sizeof(*rpmcache));
-    rpmcache->t = conf->t;
-    rpmcache->db = db;
-    rpmcache->max_item_size = max_item_size;
-    free(conf);
+    struct rpmcache *rpmcache = calloc(1, sizeof(*rpmcache));
+    if (rpmcache == NULL) {
+	ERROR("calloc: %m");
+	goto out;
+    }
+    rpmcache->name = strdup(name);
+    if (rpmcache->name == NULL) {
+	ERROR("strdup: %m");
+	free(rpmcache);
+	rpmcache = NULL;
+	goto out;
+    }
+    pthread_mutex_init(&rpmcache->wblock, NULL);
+    pthread_cond_init(&rpmcache->wbcond, NULL);
+    rpmcache->wbtail = &rpmcache->wbhead;
+    rpmcache->pid = getpid();
+    rpmcache->tags = tags;
+    tags = NULL;
+    for (int i = 0; i < nconf; i++) {
+	if (tier_open(&rpmcache->tier[rpmcache->ntier], name, conf[i], codec))
+	    rpmcache->tier[rpmcache->ntier++].stats = &rpmcache->stats;
+	else if (nconf == 1) {
+	    free(rpmcache->tags);
+	    free(rpmcache->name);
+	    free(rpmcache);
+	    rpmcache = NULL;
+	    goto out;
+	}
+	// with a few tiers, go on without the broken one
+    }
+    if (rpmcache->ntier == 0) {
+	free(rpmcache->tags);
+	free(rpmcache->name);
+	free(rpmcache);
+	rpmcache = NULL;
+    }
+out:
+    for (int i = 0; i < nconf; i++)
+	free(conf[i]);
+    free(codec);
+    free(tags);
     return rpmcache;
 }
 
 // Cache entry format:
 // - uncompressed: <blob> '\0'
 // - compressed: <uncompressed-size> <lz4-blob> '\1'
+// - compressed: <zstd-frame> '\2'
+// - chunked (memcached only): <struct chunks> '\3'
+// Older versions treat zstd entries as bad LZ4 entries (the frame
+// magic makes for an invalid size), and thus as misses.
 
-bool rpmcache_get(struct rpmcache *rpmcache,
-	const struct rpmkey *key,
-	void **valp, int *valsizep)
+// zstd contexts for memcached and redis entries, one per thread;
+// they are freed when the thread exits.
+struct zctx {
+    ZSTD_CCtx *cctx;
+    ZSTD_DCtx *dctx;
+};
+
+static pthread_key_t zctx_key;
+static pthread_once_t zctx_once = PTHREAD_ONCE_INIT;
+static bool zctx_ok;
+
+static
+void zctx_free(void *arg)
 {
-    if (rpmcache->t == CONFTYPE_QACACHE)
-	return cache_get(rpmcache->db, key->str, key->len, valp, valsizep);
+    struct zctx *z = arg;
+    ZSTD_freeCCtx(z->cctx);
+    ZSTD_freeDCtx(z->dctx);
+    free(z);
+}
 
-    char *ent;
-    size_t entsize;
+static
+void zctx_init(void)
+{
+    int rc = pthread_key_create(&zctx_key, zctx_free);
+    if (rc) {
+	errno = rc;
+	ERROR("pthread_key_create: %m");
+	return;
+    }
+    zctx_ok = true;
+}
 
-    switch (rpmcache->t) {
-    case CONFTYPE_QACACHE:
-	assert(!"possible");
-	return false;
-    case CONFTYPE_MEMCACHED:
-	if (!mcdb_get(rpmcache->db, key->str, key->len, (void *) &ent, &entsize))
-	    return false;
-	break;
-    case CONFTYPE_REDIS:
-	ERROR("redis not yet supported");
-	return false;
+// Returns NULL on failure; the codec then does without a context.
+static
+struct zctx *zctx_get(void)
+{
+    pthread_once(&zctx_once, zctx_init);
+    if (!zctx_ok)
+	return NULL;
+    struct zctx *z = pthread_getspecific(zctx_key);
+    if (z)
+	return z;
+    z = calloc(1, sizeof(*z));
+    if (z == NULL) {
+	ERROR("calloc: %m");
+	return NULL;
+    }
+    int rc = pthread_setspecific(zctx_key, z);
+    if (rc) {
+	errno = rc;
+	ERROR("pthread_setspecific: %m");
+	free(z);
+	return NULL;
     }
+    return z;
+}
 
+static
+ZSTD_CCtx *thr_cctx(void)
+{
+    struct zctx *z = zctx_get();
+    if (z == NULL)
+	return NULL;
+    if (z->cctx == NULL)
+	z->cctx = ZSTD_createCCtx();
+    return z->cctx;
+}
+
+static
+ZSTD_DCtx *thr_dctx(void)
+{
+    struct zctx *z = zctx_get();
+    if (z == NULL)
+	return NULL;
+    if (z->dctx == NULL)
+	z->dctx = ZSTD_createDCtx();
+    return z->dctx;
+}
+
+// Decode an entry fetched from memcached or redis; takes ownership of ent.
+static
+bool rpmcache_decode(struct rstats *stats, const struct rpmkey *key,
+	char *ent, size_t entsize,
+	void **valp, int *valsizep)
+{
     // empty entries are handled specially, as in cache.h
     if (entsize == 0) {
 	free(ent);
@@ -113,20 +401,31 @@ bool rpmcache_get(struct rpmcache *rpmcache,
     if (ent[entsize-1] == '\0') {
 	if (valp)
 	    *valp = ent;
+	else
+	    free(ent);
+	// the null byte is not part of the value, as with cache_get
 	if (valsizep)
-	    *valsizep = entsize;
+	    *valsizep = entsize - 1;
 	return true;
     }
 
-    // otherwise, the entry starts with the uncompresssed size
-    if (entsize <= 5) {
+    // otherwise, the last byte tells the codec
+    enum codec codec;
+    switch (ent[entsize-1]) {
+    case '\1':
+	codec = CODEC_LZ4;
+	break;
+    case '\2':
+	codec = CODEC_ZSTD;
+	break;
+    default:
 	ERROR("%s: bad entry", key->str);
 	free(ent);
 	return false;
     }
-    unsigned usize = *(unsigned *) ent;
+    int usize = codec_usize(codec, ent, entsize - 1);
 #define MIN_COMPRESS_SIZE 33
-    if (usize < MIN_COMPRESS_SIZE || usize > INT_MAX) {
+    if (usize < MIN_COMPRESS_SIZE) {
 	ERROR("%s: bad entry size", key->str);
 	free(ent);
 	return false;
@@ -143,107 +442,615 @@ bool rpmcache_get(struct rpmcache *rpmcache,
 	free(ent);
 	return false;
     }
-    int blobsize = LZ4_decompress_safe(ent + 4, blob, entsize - 5, usize);
+    uint64_t t0 = stats_now();
+    bool ok = codec_decode(codec, ent, entsize - 1, blob, usize,
+	    codec == CODEC_ZSTD ? thr_dctx() : NULL, NULL);
+    stats_time(&stats->hist[RSH_DECOMPRESS], t0);
     free(ent);
-    if (blobsize != (int) usize) {
-	ERROR("%s: %s failed", key->str, "LZ4_decompress_safe");
+    if (!ok) {
+	ERROR("%s: %s failed", key->str,
+		codec == CODEC_ZSTD ? "ZSTD_decompress" : "LZ4_decompress_safe");
 	free(blob);
 	return false;
     }
-    blob[blobsize] = '\0';
+    blob[usize] = '\0';
     *valp = blob;
     return true;
 }
 
-void rpmcache_put(struct rpmcache *rpmcache,
+static
+uint64_t chunks_sum(const void *data, size_t size)
+{
+    const unsigned char *p = data;
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; i++)
+	h = (h ^ p[i]) * 1099511628211ULL;
+    return h;
+}
+
+static inline
+bool is_manifest(const char *ent, size_t entsize)
+{
+    return entsize == sizeof(struct chunks) + 1 && ent[entsize-1] == '\3';
+}
+
+// The chunk keys are KEY#0..KEY#n-1; returns the length.
+static
+size_t chunk_key(char *buf, const struct rpmkey *key, unsigned i)
+{
+    memcpy(buf, key->str, key->len);
+    return key->len + sprintf(buf + key->len, "#%u", i);
+}
+
+// Replace the manifest with the entry reassembled from the chunks,
+// fetched with a single multi-get.  On a miss, returns false and frees
+// the manifest.
+static
+bool get_chunks(struct tier *tier, const struct rpmkey *key,
+	char **entp, size_t *entsizep)
+{
+    struct chunks m;
+    memcpy(&m, *entp, sizeof m);
+    free(*entp);
+    *entp = NULL;
+    if (m.nchunk < 2 || m.nchunk > MAXCHUNKS || m.size > tier->max_ent_size ||
+	    key->len + sizeof("#63") - 1 > MAXRPMKEYLEN) {
+	ERROR("%s: bad manifest", key->str);
+	return false;
+    }
+    char kbuf[MAXCHUNKS][MAXRPMKEYLEN+1];
+    const char *kv[MAXCHUNKS];
+    size_t kl[MAXCHUNKS];
+    void *chunk[MAXCHUNKS];
+    size_t csize[MAXCHUNKS];
+    for (unsigned i = 0; i < m.nchunk; i++) {
+	kv[i] = kbuf[i];
+	kl[i] = chunk_key(kbuf[i], key, i);
+    }
+    mcdb_mget(tier->db, m.nchunk, kv, kl, chunk, csize);
+    char *ent = NULL;
+    size_t off = 0;
+    for (unsigned i = 0; i < m.nchunk; i++)
+	if (chunk[i] == NULL || (off += csize[i]) > m.size)
+	    goto out;
+    if (off != m.size)
+	goto out;
+    ent = malloc(m.size);
+    if (ent == NULL) {
+	ERROR("%s: malloc: %m", key->str);
+	goto out;
+    }
+    off = 0;
+    for (unsigned i = 0; i < m.nchunk; i++) {
+	memcpy(ent + off, chunk[i], csize[i]);
+	off += csize[i];
+    }
+    if (chunks_sum(ent, m.size) != m.sum) {
+	free(ent);
+	ent = NULL;
+    }
+out:
+    for (unsigned i = 0; i < m.nchunk; i++)
+	free(chunk[i]);
+    if (ent == NULL) {
+	stats_add(&tier->stats->cnt[RST_CHUNK_MISS], 1);
+	return false;
+    }
+    *entp = ent;
+    *entsizep = m.size;
+    return true;
+}
+
+// Write the chunks, and then the manifest.
+static
+void put_chunks(struct tier *tier, const struct rpmkey *key,
+	const char *ent, size_t entsize)
+{
+    if (key->len + sizeof("#63") - 1 > MAXRPMKEYLEN) {
+	stats_add(&tier->stats->cnt[RST_OVERSIZE], 1);
+	return;
+    }
+    size_t csize = tier->max_item_size - CHUNK_SLACK;
+    struct chunks m = {
+	.size = entsize,
+	.nchunk = (entsize + csize - 1) / csize,
+	.sum = chunks_sum(ent, entsize),
+    };
+    assert(m.nchunk <= MAXCHUNKS);
+    char ckey[MAXRPMKEYLEN+1];
+    for (unsigned i = 0; i < m.nchunk; i++) {
+	size_t off = i * csize;
+	size_t n = entsize - off < csize ? entsize - off : csize;
+	mcdb_put(tier->db, ckey, chunk_key(ckey, key, i), ent + off, n);
+    }
+    char buf[sizeof m + 1];
+    memcpy(buf, &m, sizeof m);
+    buf[sizeof m] = '\3';
+    mcdb_put(tier->db, key->str, key->len, buf, sizeof buf);
+    stats_add(&tier->stats->cnt[RST_CHUNKED], 1);
+}
+
+static
+bool tier_get(struct tier *tier,
+	const struct rpmkey *key,
+	void **valp, int *valsizep)
+{
+    char *ent = NULL;
+    size_t entsize;
+    bool ok = false;
+
+    tier_lock(tier);
+    switch (tier->t) {
+    case CONFTYPE_QACACHE:
+	ok = cache_get(tier->db, key->str, key->len, valp, valsizep);
+	tier_unlock(tier);
+	return ok;
+    case CONFTYPE_MEMCACHED:
+	ok = mcdb_get(tier->db, key->str, key->len, (void *) &ent, &entsize);
+	break;
+    case CONFTYPE_REDIS:
+	ok = rdb_get(tier->db, key->str, key->len, (void *) &ent, &entsize);
+	break;
+    }
+    tier_unlock(tier);
+
+    if (!ok)
+	return false;
+    if (tier->t == CONFTYPE_MEMCACHED && is_manifest(ent, entsize) &&
+	    !get_chunks(tier, key, &ent, &entsize))
+	return false;
+    return rpmcache_decode(tier->stats, key, ent, entsize, valp, valsizep);
+}
+
+static
+int mget_qacache(struct tier *tier, int n,
+	const struct rpmkey keys[],
+	void *vals[], int valsizes[])
+{
+    const void **kv = malloc(n * (sizeof(*kv) + sizeof(int)));
+    if (kv == NULL) {
+	ERROR("malloc: %m");
+	return 0;
+    }
+    int *ks = (int *) (kv + n);
+    for (int i = 0; i < n; i++) {
+	kv[i] = keys[i].str;
+	ks[i] = keys[i].len;
+    }
+    tier_lock(tier);
+    int nhit = cache_mget(tier->db, n, kv, ks, vals, valsizes);
+    tier_unlock(tier);
+    free(kv);
+    return nhit;
+}
+
+static
+int mget_remote(struct tier *tier, int n,
+	const struct rpmkey keys[],
+	void *vals[], int valsizes[])
+{
+    const char **kv = malloc(n * (sizeof(*kv) + 2 * sizeof(size_t)));
+    if (kv == NULL) {
+	ERROR("malloc: %m");
+	return 0;
+    }
+    size_t *kl = (size_t *) (kv + n);
+    size_t *entsizes = kl + n;
+    for (int i = 0; i < n; i++) {
+	kv[i] = keys[i].str;
+	kl[i] = keys[i].len;
+    }
+    // raw entries are fetched into vals[], to be decoded in place
+    tier_lock(tier);
+    if (tier->t == CONFTYPE_MEMCACHED)
+	mcdb_mget(tier->db, n, kv, kl, vals, entsizes);
+    else
+	rdb_mget(tier->db, n, kv, kl, vals, entsizes);
+    tier_unlock(tier);
+    int nhit = 0;
+    for (int i = 0; i < n; i++) {
+	char *ent = vals[i];
+	vals[i] = NULL;
+	if (ent == NULL)
+	    continue;
+	if (tier->t == CONFTYPE_MEMCACHED && is_manifest(ent, entsizes[i]) &&
+		!get_chunks(tier, &keys[i], &ent, &entsizes[i]))
+	    continue;
+	if (rpmcache_decode(tier->stats, &keys[i], ent, entsizes[i], &vals[i], &valsizes[i]))
+	    nhit++;
+	else
+	    valsizes[i] = -1;
+    }
+    free(kv);
+    return nhit;
+}
+
+static
+int tier_mget(struct tier *tier, int n,
+	const struct rpmkey keys[],
+	void *vals[], int valsizes[])
+{
+    for (int i = 0; i < n; i++) {
+	vals[i] = NULL;
+	valsizes[i] = -1;
+    }
+    if (n < 1)
+	return 0;
+
+    switch (tier->t) {
+    case CONFTYPE_QACACHE:
+	return mget_qacache(tier, n, keys, vals, valsizes);
+    case CONFTYPE_MEMCACHED:
+    case CONFTYPE_REDIS:
+	return mget_remote(tier, n, keys, vals, valsizes);
+    }
+    return 0;
+}
+
+static
+void tier_put(struct tier *tier,
 	const struct rpmkey *key,
 	const void *val, int valsize)
 {
-    if (rpmcache->t == CONFTYPE_QACACHE)
-	return cache_put(rpmcache->db, key->str, key->len, val, valsize);
+    if (tier->t == CONFTYPE_QACACHE) {
+	tier_lock(tier);
+	cache_put(tier->db, key->str, key->len, val, valsize);
+	tier_unlock(tier);
+	return;
+    }
 
-    // Assume that LZ4 can compress by a factor of 2.
-    // The compressed item then must not exceed max_item_size.
-    if (valsize / 2 > rpmcache->max_item_size)
+    // Assume that zstd can compress by a factor of 4.
+    // The compressed entry then must not exceed max_ent_size.
+    if (valsize / 4 > tier->max_ent_size) {
+	stats_add(&tier->stats->cnt[RST_OVERSIZE], 1);
 	return;
+    }
 
-    size_t entsize;
-    bool limit = false;
-    if (valsize < MIN_COMPRESS_SIZE)
-	entsize = valsize ? valsize + 1 : 0;
-    else {
-	entsize = LZ4_compressBound(valsize);
-	if (entsize == 0) {
-	    ERROR("%s: %s failed", key->str, "LZ4_compressBound");
-	    return;
-	}
-	entsize += 5;
-	if (entsize > rpmcache->max_item_size) {
-	    entsize = rpmcache->max_item_size;
-	    limit = true;
-	}
+    int level;
+    enum codec codec = codec_choose(&tier->codec,
+	    CODEC_BIT(CODEC_LZ4) | CODEC_BIT(CODEC_LZ4HC) | CODEC_BIT(CODEC_ZSTD),
+	    val, valsize, MIN_COMPRESS_SIZE, &level);
+
+    // the compressed entry must not exceed max_ent_size,
+    // and there must be room for the uncompressed one
+    size_t entsize = valsize ? valsize + 1 : 0;
+    size_t bufsize = entsize;
+    if (codec != CODEC_NONE) {
+	entsize = (codec == CODEC_ZSTD ? ZSTD_compressBound(valsize) :
+		   codec_lz4_bound(valsize)) + 1;
+	if (entsize > tier->max_ent_size)
+	    entsize = tier->max_ent_size;
+	if (bufsize < entsize)
+	    bufsize = entsize;
     }
 
-    char *ent = valsize ? malloc(entsize) : "";
+    char *ent = valsize ? malloc(bufsize) : "";
     if (ent == NULL) {
 	ERROR("%s: malloc: %m", key->str);
 	return;
     }
 
-    if (valsize < MIN_COMPRESS_SIZE) {
-	if (valsize) {
-uncompressed1:
-	    memcpy(ent, val, valsize);
-	    entsize = valsize + 1;
-	    ent[entsize-1] = '\0';
+    if (codec != CODEC_NONE) {
+	uint64_t t0 = stats_now();
+	size_t csize;
+	if (codec == CODEC_ZSTD)
+	    csize = codec_zstd_compress(thr_cctx(), level, val, valsize, ent, entsize - 1);
+	else
+	    csize = codec_lz4_compress(codec, level, val, valsize, ent, entsize - 1);
+	stats_time(&tier->stats->hist[RSH_COMPRESS], t0);
+	// incompressible, or too big
+	if (csize == 0 || csize >= (size_t) valsize)
+	    codec = CODEC_NONE;
+	else {
+	    entsize = csize + 1;
+	    ent[entsize-1] = codec == CODEC_ZSTD ? '\2' : '\1';
 	}
     }
-    else {
-	size_t zblobsize = LZ4_compress_default(val, ent + 4, valsize, entsize - 5);
-	if (zblobsize == 0) {
-	    if (!limit)
-		ERROR("%s: %s failed", key->str, "LZ4_compress_default");
-uncompressed2:
-	    if (entsize >= valsize + 1)
-		goto uncompressed1;
+    if (codec == CODEC_NONE && valsize) {
+	entsize = valsize + 1;
+	if (entsize > tier->max_ent_size) {
+	    stats_add(&tier->stats->cnt[RST_OVERSIZE], 1);
 	    free(ent);
 	    return;
 	}
-	// incompressible?
-	if (zblobsize + 4 >= (size_t) valsize)
-	    goto uncompressed2;
-	*(unsigned *) ent = valsize;
-	entsize = zblobsize + 5;
-	ent[entsize-1] = '\1';
+	memcpy(ent, val, valsize);
+	ent[entsize-1] = '\0';
     }
 
-    switch (rpmcache->t) {
+    tier_lock(tier);
+    switch (tier->t) {
     case CONFTYPE_QACACHE:
 	assert(!"possible");
 	break;
     case CONFTYPE_MEMCACHED:
-	mcdb_put(rpmcache->db, key->str, key->len, ent, entsize);
+	if (entsize > tier->max_item_size)
+	    put_chunks(tier, key, ent, entsize);
+	else
+	    mcdb_put(tier->db, key->str, key->len, ent, entsize);
 	break;
     case CONFTYPE_REDIS:
-	ERROR("redis not yet supported");
+	rdb_put(tier->db, key->str, key->len, ent, entsize);
+	break;
     }
+    tier_unlock(tier);
 
     if (valsize)
 	free(ent);
 }
 
+static
+void *wb_thread(void *arg)
+{
+    struct rpmcache *rpmcache = arg;
+    pthread_mutex_lock(&rpmcache->wblock);
+    while (1) {
+	struct wbent *e = rpmcache->wbhead;
+	if (e == NULL) {
+	    // the queue is drained before the thread exits
+	    if (rpmcache->wbstop)
+		break;
+	    pthread_cond_wait(&rpmcache->wbcond, &rpmcache->wblock);
+	    continue;
+	}
+	rpmcache->wbhead = e->next;
+	if (rpmcache->wbhead == NULL)
+	    rpmcache->wbtail = &rpmcache->wbhead;
+	rpmcache->wbbytes -= e->valsize;
+	pthread_mutex_unlock(&rpmcache->wblock);
+	for (int i = 0; i < rpmcache->ntier; i++)
+	    if (e->tiers & (1U << i))
+		tier_put(&rpmcache->tier[i], &e->key, e->val, e->valsize);
+	free(e);
+	pthread_mutex_lock(&rpmcache->wblock);
+    }
+    pthread_mutex_unlock(&rpmcache->wblock);
+    return NULL;
+}
+
+// After fork, the child has no write-back thread, and the locks could
+// have been held by another thread in the parent, whether or not it was
+// the write-back thread.  The queued entries are left to the parent.
+static
+void wb_forked(struct rpmcache *rpmcache)
+{
+    int pid = getpid();
+    if (rpmcache->pid == pid)
+	return;
+    rpmcache->pid = pid;
+    rpmcache->wbpid = 0;
+    pthread_mutex_init(&rpmcache->wblock, NULL);
+    pthread_cond_init(&rpmcache->wbcond, NULL);
+    for (int i = 0; i < rpmcache->ntier; i++)
+	pthread_mutex_init(&rpmcache->tier[i].lock, NULL);
+    while (rpmcache->wbhead) {
+	struct wbent *e = rpmcache->wbhead;
+	rpmcache->wbhead = e->next;
+	free(e);
+    }
+    rpmcache->wbtail = &rpmcache->wbhead;
+    rpmcache->wbbytes = 0;
+}
+
+// Queue the value for the tiers; returns false if the value should
+// be written synchronously.
+static
+bool wb_put(struct rpmcache *rpmcache, unsigned tiers,
+	const struct rpmkey *key,
+	const void *val, int valsize)
+{
+    struct wbent *e = malloc(sizeof(*e) + valsize);
+    if (e == NULL) {
+	ERROR("malloc: %m");
+	return false;
+    }
+    e->next = NULL;
+    e->tiers = tiers;
+    e->key = *key;
+    e->valsize = valsize;
+    if (valsize)
+	memcpy(e->val, val, valsize);
+    pthread_mutex_lock(&rpmcache->wblock);
+    // the thread is started on demand; puts can come from a few threads
+    if (rpmcache->wbpid == 0) {
+	int rc = pthread_create(&rpmcache->wbthr, NULL, wb_thread, rpmcache);
+	if (rc) {
+	    pthread_mutex_unlock(&rpmcache->wblock);
+	    free(e);
+	    errno = rc;
+	    ERROR("pthread_create: %m");
+	    return false;
+	}
+	rpmcache->wbpid = getpid();
+    }
+    if (rpmcache->wbbytes + valsize > WB_MAX_BYTES) {
+	// the backlog is too big, it's only a cache
+	pthread_mutex_unlock(&rpmcache->wblock);
+	free(e);
+	stats_add(&rpmcache->stats.cnt[RST_WB_DROPPED], 1);
+	return true;
+    }
+    *rpmcache->wbtail = e;
+    rpmcache->wbtail = &e->next;
+    rpmcache->wbbytes += valsize;
+    pthread_cond_signal(&rpmcache->wbcond);
+    pthread_mutex_unlock(&rpmcache->wblock);
+    stats_add(&rpmcache->stats.cnt[RST_WB_QUEUED], 1);
+    return true;
+}
+
+// Write to the tiers given by the bitmask.
+static
+void put_tiers(struct rpmcache *rpmcache, unsigned tiers,
+	const struct rpmkey *key,
+	const void *val, int valsize)
+{
+    unsigned async = 0;
+    for (int i = 0; i < rpmcache->ntier; i++) {
+	if (!(tiers & (1U << i)))
+	    continue;
+	if (rpmcache->tier[i].async)
+	    async |= 1U << i;
+	else
+	    tier_put(&rpmcache->tier[i], key, val, valsize);
+    }
+    if (async == 0 || wb_put(rpmcache, async, key, val, valsize))
+	return;
+    for (int i = 0; i < rpmcache->ntier; i++)
+	if (async & (1U << i))
+	    tier_put(&rpmcache->tier[i], key, val, valsize);
+}
+
+bool rpmcache_get(struct rpmcache *rpmcache,
+	const struct rpmkey *key,
+	void **valp, int *valsizep)
+{
+    wb_forked(rpmcache);
+    struct rstats *stats = &rpmcache->stats;
+    uint64_t t0 = stats_now();
+    stats_add(&stats->cnt[RST_GET], 1);
+    for (int i = 0; i < rpmcache->ntier; i++) {
+	if (!tier_get(&rpmcache->tier[i], key, valp, valsizep))
+	    continue;
+	stats_add(&stats->cnt[RST_HIT], 1);
+	stats_add(&stats->cnt[RST_HIT_TIER0 + i], 1);
+	// promote into the faster tiers
+	if (i && valp) {
+	    put_tiers(rpmcache, (1U << i) - 1, key, *valp, *valsizep);
+	    stats_add(&stats->cnt[RST_PROMOTE], 1);
+	}
+	stats_time(&stats->hist[RSH_GET], t0);
+	return true;
+    }
+    stats_time(&stats->hist[RSH_GET], t0);
+    return false;
+}
+
+int rpmcache_mget(struct rpmcache *rpmcache, int n,
+	const struct rpmkey keys[],
+	void *vals[], int valsizes[])
+{
+    wb_forked(rpmcache);
+    struct rstats *stats = &rpmcache->stats;
+    uint64_t t0 = stats_now();
+    stats_add(&stats->cnt[RST_GET], n);
+    int nhit = tier_mget(&rpmcache->tier[0], n, keys, vals, valsizes);
+    stats_add(&stats->cnt[RST_HIT_TIER0], nhit);
+    if (nhit == n || rpmcache->ntier == 1)
+	goto out;
+
+    // the misses are looked up in the next tiers
+    struct rpmkey *mkeys = malloc(n * (sizeof(*mkeys) + sizeof(void *) + 2 * sizeof(int)));
+    if (mkeys == NULL) {
+	ERROR("malloc: %m");
+	goto out;
+    }
+    void **mvals = (void **) (mkeys + n);
+    int *msizes = (int *) (mvals + n);
+    int *idx = msizes + n;
+    for (int t = 1; t < rpmcache->ntier && nhit < n; t++) {
+	int m = 0;
+	for (int i = 0; i < n; i++) {
+	    if (valsizes[i] >= 0)
+		continue;
+	    idx[m] = i;
+	    mkeys[m] = keys[i];
+	    m++;
+	}
+	if (tier_mget(&rpmcache->tier[t], m, mkeys, mvals, msizes) == 0)
+	    continue;
+	for (int j = 0; j < m; j++) {
+	    if (msizes[j] < 0)
+		continue;
+	    int i = idx[j];
+	    vals[i] = mvals[j];
+	    valsizes[i] = msizes[j];
+	    put_tiers(rpmcache, (1U << t) - 1, &keys[i], vals[i], valsizes[i]);
+	    stats_add(&stats->cnt[RST_HIT_TIER0 + t], 1);
+	    stats_add(&stats->cnt[RST_PROMOTE], 1);
+	    nhit++;
+	}
+    }
+    free(mkeys);
+out:
+    stats_add(&stats->cnt[RST_HIT], nhit);
+    stats_time(&stats->hist[RSH_MGET], t0);
+    return nhit;
+}
+
+void rpmcache_put(struct rpmcache *rpmcache,
+	const struct rpmkey *key,
+	const void *val, int valsize)
+{
+    wb_forked(rpmcache);
+    uint64_t t0 = stats_now();
+    put_tiers(rpmcache, (1U << rpmcache->ntier) - 1, key, val, valsize);
+    stats_add(&rpmcache->stats.cnt[RST_PUT], 1);
+    stats_add(&rpmcache->stats.cnt[RST_PUT_BYTES], valsize);
+    stats_time(&rpmcache->stats.hist[RSH_PUT], t0);
+}
+
+// The counters are copied, to add up the errors of the remote backends.
+static
+void stats_desc(struct rpmcache *rpmcache, struct stats_desc *d, unsigned long cnt[])
+{
+    for (int i = 0; i < RST_NCNT; i++)
+	cnt[i] = __atomic_load_n(&rpmcache->stats.cnt[i], __ATOMIC_RELAXED);
+    for (int i = 0; i < rpmcache->ntier; i++) {
+	struct tier *tier = &rpmcache->tier[i];
+	tier_lock(tier);
+	if (tier->t == CONFTYPE_MEMCACHED)
+	    cnt[RST_REMOTE_ERRORS] += mcdb_errors(tier->db);
+	else if (tier->t == CONFTYPE_REDIS)
+	    cnt[RST_REMOTE_ERRORS] += rdb_errors(tier->db);
+	tier_unlock(tier);
+    }
+    *d = (struct stats_desc) {
+	.prefix = "rpmcache",
+	.label = "name",
+	.value = rpmcache->name,
+	.ncnt = RST_NCNT,
+	.cntname = cntname,
+	.cnt = cnt,
+	.nhist = RSH_NHIST,
+	.histname = histname,
+	.hist = rpmcache->stats.hist,
+    };
+}
+
+const char *rpmcache_tags(struct rpmcache *rpmcache)
+{
+    return rpmcache->tags;
+}
+
+bool rpmcache_stats(struct rpmcache *rpmcache, FILE *fp, const char *fmt)
+{
+    wb_forked(rpmcache);
+    unsigned long cnt[RST_NCNT];
+    struct stats_desc d;
+    stats_desc(rpmcache, &d, cnt);
+    return stats_write(fp, fmt, &d);
+}
+
 void rpmcache_close(struct rpmcache *rpmcache)
 {
-    switch (rpmcache->t) {
-    case CONFTYPE_QACACHE:
-	cache_close(rpmcache->db);
-	break;
-    case CONFTYPE_MEMCACHED:
-	mcdb_close(rpmcache->db);
-	break;
-    case CONFTYPE_REDIS:
-	ERROR("redis not yet supported");
+    wb_forked(rpmcache);
+    if (rpmcache->wbpid) {
+	pthread_mutex_lock(&rpmcache->wblock);
+	rpmcache->wbstop = true;
+	pthread_cond_signal(&rpmcache->wbcond);
+	pthread_mutex_unlock(&rpmcache->wblock);
+	pthread_join(rpmcache->wbthr, NULL);
     }
+    unsigned long cnt[RST_NCNT];
+    struct stats_desc d;
+    stats_desc(rpmcache, &d, cnt);
+    stats_dump(&d);
+    for (int i = 0; i < rpmcache->ntier; i++)
+	tier_close(&rpmcache->tier[i]);
+    pthread_mutex_destroy(&rpmcache->wblock);
+    pthread_cond_destroy(&rpmcache->wbcond);
+    free(rpmcache->tags);
+    free(rpmcache->name);
     free(rpmcache);
 }
 
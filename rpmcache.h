@@ -5,6 +5,13 @@
 extern "C" {
 #endif
 
+// The cache is looked up by name in the file given by RPMCACHE_CONFIG,
+// with lines like "NAME qacache DIR" or "NAME memcached CONFIG".  A few
+// lines with the same name make a chain, fastest first: hits are promoted
+// into the faster tiers, and writes go to all tiers.  With "memcached,async"
+// etc., writes to the tier are done by a background thread, and flushed by
+// rpmcache_close.
+// "NAME codec POLICY" sets the compression policy, see cache_codec in cache.h.
 struct rpmcache *rpmcache_open(const char *name);
 void rpmcache_clean(struct rpmcache *rpmcache, int days);
 void rpmcache_close(struct rpmcache *rpmcache);
@@ -12,6 +19,7 @@ void rpmcache_close(struct rpmcache *rpmcache);
 #ifndef __cplusplus
 #include <stdbool.h>
 #endif
+#include <stdio.h>
 
 // memcached needs ASCII keys no longer than 250 characters
 #define MAXRPMKEYLEN 250
@@ -25,6 +33,13 @@ struct rpmkey {
 // file size, and mtime.  Something like this: x11perf-1.5.4-alt1.x86_64@LqNLDQdSM
 bool rpmcache_key(const char *fname, unsigned fsize, unsigned mtime, struct rpmkey *key);
 
+// Alternatively, the key can be made from the header digest (SHA256, or SHA1
+// for older packages) stored in the signature header, which is read from
+// the open package, along with the file size and a hash of the signature
+// header: such keys survive copying and mtime changes.  Returns false if
+// the package has no digest.
+bool rpmcache_digest_key(const char *fname, int fd, unsigned fsize, struct rpmkey *key);
+
 /* Concerning empty values and trailing null bytes,
  * see the note in cache.h. */
 
@@ -35,6 +50,22 @@ void rpmcache_put(struct rpmcache *rpmcache,
 	const struct rpmkey *key,
 	const void *val, int valsize);
 
+// Fetch n entries at once, see cache_mget in cache.h.  With memcached or redis,
+// the keys are sent in a pipelined request rather than one by one.
+int rpmcache_mget(struct rpmcache *rpmcache, int n,
+	const struct rpmkey keys[],
+	void *vals[] /* malloc'd */, int valsizes[]);
+
+// The tag list from the "NAME tags TAG,..." line in rpmcache.conf, if any:
+// the tags to keep in cached headers, or, as "-TAG,...", to drop.
+const char *rpmcache_tags(struct rpmcache *rpmcache);
+
+// Write the counters (gets, hits by tier, promotions, puts, write-back
+// queueing, memcached and redis errors) and the latency histograms, as
+// "json" or "prometheus"; see cache_stats in cache.h.  Like cache_close,
+// rpmcache_close appends them to the file named by RPMCACHE_STATS.
+bool rpmcache_stats(struct rpmcache *rpmcache, FILE *fp, const char *fmt);
+
 #ifdef __cplusplus
 }
 #endif
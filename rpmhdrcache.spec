@@ -64,6 +64,9 @@ are stored in a Berkeley DB, larger entries are backed by filesystem.
 %files -n librpmcache
 %_libdir/librpmcache.so.0*
 %_bindir/qacache-clean
+%_bindir/qacache-stat
+%_bindir/qacache-train
+%_bindir/rpmcache-bench
 
 %files -n librpmcache-devel
 %dir %_includedir/qa
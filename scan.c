@@ -0,0 +1,103 @@
+#include "cache-impl.h"
+
+static
+int size_bucket(unsigned long long size)
+{
+    int b = size ? 63 - __builtin_clzll(size) : 0;
+    return b < CACHE_SCAN_NSIZE ? b : CACHE_SCAN_NSIZE - 1;
+}
+
+static
+int age_bucket(struct cache *cache, unsigned short t)
+{
+    unsigned short age = cache->now - t;
+    // entries from the future, e.g. with clock skew, are fresh
+    if (age > 0x8000)
+	age = 0;
+    int b = 31 - __builtin_clz(age + 1);
+    return b < CACHE_SCAN_NAGE ? b : CACHE_SCAN_NAGE - 1;
+}
+
+// Half powers of 2, without libm: the ratio u/c is at least
+// 2^(b/2) if u^2 >= c^2 * 2^b.
+static
+int ratio_bucket(unsigned long long usize, unsigned long long csize)
+{
+    double u2 = (double) usize * usize;
+    double c2 = (double) csize * csize;
+    int b = 0;
+    while (b < CACHE_SCAN_NRATIO - 1 && u2 >= c2 * (2 << b))
+	b++;
+    return b;
+}
+
+void qascan_ent(struct cache *cache, struct cache_scan *scan, bool fs,
+	const struct cache_ent *vent, int avail, int ventsize,
+	unsigned short mtime, unsigned short atime)
+{
+    struct cache_scan_part *part = fs ? &scan->fs : &scan->db;
+    int csize = ventsize - sizeof(*vent);
+    if (csize < 0)
+	return;
+
+    part->nent++;
+    part->csize += csize;
+    part->size[size_bucket(csize)]++;
+    part->mtime[age_bucket(cache, mtime)]++;
+    part->atime[age_bucket(cache, atime)]++;
+    if (fs ? csize <= scan->cutoff + scan->cutoff / 8 : csize > scan->cutoff - scan->cutoff / 8)
+	scan->near_cutoff++;
+
+    if (avail < (int) sizeof(*vent)) {
+	scan->unread++;
+	part->usize += csize;
+	return;
+    }
+    int c;
+    int usize = -1;
+    const void *data = vent + 1;
+    int n = avail - sizeof(*vent);
+    if (vent->flags & V_LZ4) {
+	c = CACHE_SCAN_LZ4;
+	usize = codec_usize(CODEC_LZ4, data, n);
+    }
+    else if (vent->flags & V_SNAPPY)
+	c = CACHE_SCAN_LEGACY;
+    else if (vent->flags & V_ZSTD) {
+	c = (vent->flags & V_ZDICT) ? CACHE_SCAN_ZDICT : CACHE_SCAN_ZSTD;
+	usize = codec_usize(CODEC_ZSTD, data, n);
+    }
+    else
+	c = CACHE_SCAN_RAW;
+    if (usize < 0)
+	usize = csize;
+    part->usize += usize;
+    scan->codec[c].nent++;
+    scan->codec[c].usize += usize;
+    scan->codec[c].csize += csize;
+    scan->codec[c].ratio[ratio_bucket(usize, csize)]++;
+}
+
+static
+bool scan_db(void *arg, const void *key, int keysize,
+	const struct cache_ent *vent, int ventsize)
+{
+    (void) key;
+    (void) keysize;
+    void **args = arg;
+    qascan_ent(args[0], args[1], false, vent, ventsize, ventsize,
+	    vent->mtime, vent->atime);
+    return true;
+}
+
+void cache_scan(struct cache *cache, struct cache_scan *scan)
+{
+    memset(scan, 0, sizeof(*scan));
+    scan->cutoff = MAX_DB_VAL_SIZE;
+    void *args[] = { cache, scan };
+    qadb_walk(cache, scan_db, args);
+    qadb_stat(cache, scan);
+    qafs_scan(cache, scan);
+}
+
+// ex:ts=8 sts=4 sw=4 noet
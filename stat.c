@@ -0,0 +1,140 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "cache.h"
+
+static const char *codecs[CACHE_SCAN_NCODEC] = {
+    [CACHE_SCAN_RAW] = "raw",
+    [CACHE_SCAN_LZ4] = "lz4",
+    [CACHE_SCAN_ZSTD] = "zstd",
+    [CACHE_SCAN_ZDICT] = "zstd+dict",
+    [CACHE_SCAN_LEGACY] = "snappy",
+};
+
+static double mib(unsigned long long n)
+{
+    return n / 1048576.0;
+}
+
+static double pct(double a, double b)
+{
+    return b > 0 ? 100 * a / b : 0;
+}
+
+static void print_part(const char *name, const struct cache_scan_part *p)
+{
+    printf("  %s: %lu entries, %.1f MiB stored, %.1f MiB uncompressed, %.2fx\n",
+	    name, p->nent, mib(p->csize), mib(p->usize),
+	    p->csize ? (double) p->usize / p->csize : 0);
+}
+
+// Print the non-empty range of db and fs histograms side by side.
+static void print_hist(const char *title, const char *unit,
+	const unsigned long *db, const unsigned long *fs, int n, bool age)
+{
+    int lo = n, hi = -1;
+    for (int i = 0; i < n; i++)
+	if (db[i] || fs[i]) {
+	    if (lo > i)
+		lo = i;
+	    hi = i;
+	}
+    if (hi < 0)
+	return;
+    printf("  %s:\n", title);
+    for (int i = lo; i <= hi; i++) {
+	// sizes are [2^i, 2^(i+1)), ages are [2^i - 1, 2^(i+1) - 1)
+	unsigned long from = age ? (1UL << i) - 1 : 1UL << i;
+	unsigned long to = age ? (2UL << i) - 1 : 2UL << i;
+	if (i == n - 1)
+	    printf("    >= %-10lu %-5s", from, unit);
+	else
+	    printf("    %9lu-%-10lu %-5s", from, to, unit);
+	printf(" db %10lu  fs %10lu\n", db[i], fs[i]);
+    }
+}
+
+static void print_codecs(const struct cache_scan *s)
+{
+    printf("  %-10s %10s %12s %12s %7s\n", "codec", "entries", "stored MiB", "usize MiB", "ratio");
+    for (int c = 0; c < CACHE_SCAN_NCODEC; c++) {
+	if (s->codec[c].nent == 0)
+	    continue;
+	printf("  %-10s %10lu %12.1f %12.1f %6.2fx\n", codecs[c], s->codec[c].nent,
+		mib(s->codec[c].csize), mib(s->codec[c].usize),
+		s->codec[c].csize ? (double) s->codec[c].usize / s->codec[c].csize : 0);
+    }
+    for (int c = 0; c < CACHE_SCAN_NCODEC; c++) {
+	if (c == CACHE_SCAN_RAW || c == CACHE_SCAN_LEGACY || s->codec[c].nent == 0)
+	    continue;
+	printf("  %s compression ratio:\n", codecs[c]);
+	for (int i = 0; i < CACHE_SCAN_NRATIO; i++) {
+	    unsigned long n = s->codec[c].ratio[i];
+	    if (n == 0)
+		continue;
+	    // the buckets are by the half power of 2
+	    double from = (i & 1 ? 1.41421356 : 1.0) * (1 << i / 2);
+	    double to = (i & 1 ? 2.0 : 1.41421356) * (1 << i / 2);
+	    if (i == CACHE_SCAN_NRATIO - 1)
+		printf("    >= %-11.2f %10lu\n", from, n);
+	    else
+		printf("    %5.2f-%-5.2f   %10lu\n", from, to, n);
+	}
+    }
+}
+
+static void print_scan(const char *dir, const struct cache_scan *s)
+{
+    printf("%s:\n", dir);
+    print_part("db", &s->db);
+    print_part("fs", &s->fs);
+    if (s->unread)
+	printf("  fs entries with unread headers: %lu (not the owner?)\n", s->unread);
+    printf("  near the %d KiB db/fs cutoff: %lu entries\n", s->cutoff >> 10, s->near_cutoff);
+    if (s->hx)
+	printf("  index: %.1f MiB, %lu/%lu slots used (%.0f%%), %lu live, %.1f MiB garbage (%.0f%%)\n",
+		mib(s->dbfile_bytes), s->hx_used, s->hx_slots, pct(s->hx_used, s->hx_slots),
+		s->hx_live, mib(s->hx_garbage_bytes), pct(s->hx_garbage_bytes, s->dbfile_bytes));
+    else
+	printf("  db files: %.1f MiB, %u-byte pages: %lu total, %lu free (%.0f%%), "
+		"%lu leaf (%.0f%% full), %lu overflow\n",
+		mib(s->dbfile_bytes), s->pagesize, s->pages, s->free_pages,
+		pct(s->free_pages, s->pages), s->leaf_pages,
+		100 - pct(s->leaf_free_bytes, (double) s->leaf_pages * s->pagesize),
+		s->overflow_pages);
+    print_codecs(s);
+    print_hist("stored size", "bytes", s->db.size, s->fs.size, CACHE_SCAN_NSIZE, false);
+    print_hist("age (since put)", "days", s->db.mtime, s->fs.mtime, CACHE_SCAN_NAGE, true);
+    print_hist("idle (since last use)", "days", s->db.atime, s->fs.atime, CACHE_SCAN_NAGE, true);
+}
+
+int main(int argc, const char *argv[])
+{
+    if (argc < 2 || argv[1][0] == '-') {
+	fprintf(stderr, "Usage: %s DIR...\n", program_invocation_short_name);
+	return 2;
+    }
+    // hits must not update atime, nor anything else
+    setenv("QACACHE_RDONLY", "1", 1);
+    int rc = 0;
+    for (int i = 1; i < argc; i++) {
+	const char *dir = argv[i];
+	struct cache *cache = cache_open(dir);
+	if (!cache) {
+	    // warning issued by the library
+	    rc = 1;
+	    continue;
+	}
+	struct cache_scan scan;
+	cache_scan(cache, &scan);
+	cache_close(cache);
+	print_scan(dir, &scan);
+    }
+    return rc;
+}
+
+// ex: set ts=8 sts=4 sw=4 noet:
@@ -0,0 +1,344 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "error.h"
+#include "stats.h"
+
+// Label values can be paths, with quotes and backslashes; the escaping
+// is the same for JSON and Prometheus.
+static
+void put_quoted(FILE *fp, const char *s)
+{
+    putc('"', fp);
+    for (; *s; s++) {
+	if (*s == '"' || *s == '\\')
+	    putc('\\', fp);
+	if (*s == '\n')
+	    fputs("\\n", fp);
+	else
+	    putc(*s, fp);
+    }
+    putc('"', fp);
+}
+
+// The upper bound of the bucket where the quantile falls, in ns.
+static
+unsigned long quantile(const unsigned long *bucket, unsigned long count, double q)
+{
+    unsigned long rank = count * q;
+    unsigned long sum = 0;
+    for (int b = 0; b < STATS_NBUCKET; b++) {
+	sum += bucket[b];
+	if (sum > rank)
+	    return 2UL << b;
+    }
+    return 2UL << (STATS_NBUCKET - 1);
+}
+
+static
+void write_json(FILE *fp, const struct stats_desc *d)
+{
+    fprintf(fp, "{\"%s\":{\"%s\":", d->prefix, d->label);
+    put_quoted(fp, d->value);
+    fprintf(fp, ",\"pid\":%d", (int) getpid());
+    for (int i = 0; i < d->ncnt; i++)
+	fprintf(fp, ",\"%s\":%lu", d->cntname[i],
+		__atomic_load_n(&d->cnt[i], __ATOMIC_RELAXED));
+    fputs(",\"latency\":{", fp);
+    for (int i = 0; i < d->nhist; i++) {
+	const struct stats_hist *h = &d->hist[i];
+	unsigned long bucket[STATS_NBUCKET];
+	unsigned long count = 0;
+	for (int b = 0; b < STATS_NBUCKET; b++)
+	    count += bucket[b] = __atomic_load_n(&h->bucket[b], __ATOMIC_RELAXED);
+	fprintf(fp, "%s\"%s\":{\"count\":%lu,\"sum_ns\":%lu", i ? "," : "",
+		d->histname[i], count, __atomic_load_n(&h->sum, __ATOMIC_RELAXED));
+	if (count)
+	    fprintf(fp, ",\"p50_ns\":%lu,\"p99_ns\":%lu,\"p999_ns\":%lu",
+		    quantile(bucket, count, 0.5), quantile(bucket, count, 0.99),
+		    quantile(bucket, count, 0.999));
+	// only the non-empty buckets, keyed by the upper bound
+	fputs(",\"buckets\":{", fp);
+	bool first = true;
+	for (int b = 0; b < STATS_NBUCKET; b++) {
+	    if (bucket[b] == 0)
+		continue;
+	    fprintf(fp, "%s\"%lu\":%lu", first ? "" : ",", 2UL << b, bucket[b]);
+	    first = false;
+	}
+	fputs("}}", fp);
+    }
+    fputs("}}}\n", fp);
+}
+
+static
+void put_labels(FILE *fp, const struct stats_desc *d)
+{
+    fprintf(fp, "{%s=", d->label);
+    put_quoted(fp, d->value);
+}
+
+static
+void write_prometheus(FILE *fp, const struct stats_desc *d)
+{
+    for (int i = 0; i < d->ncnt; i++) {
+	fprintf(fp, "# TYPE %s_%s_total counter\n", d->prefix, d->cntname[i]);
+	fprintf(fp, "%s_%s_total", d->prefix, d->cntname[i]);
+	put_labels(fp, d);
+	fprintf(fp, "} %lu\n", __atomic_load_n(&d->cnt[i], __ATOMIC_RELAXED));
+    }
+    for (int i = 0; i < d->nhist; i++) {
+	const struct stats_hist *h = &d->hist[i];
+	const char *name = d->histname[i];
+	fprintf(fp, "# TYPE %s_%s_seconds histogram\n", d->prefix, name);
+	// the buckets are cumulative; all of them are written, so that
+	// the records can be added up in the file
+	unsigned long count = 0;
+	for (int b = 0; b < STATS_NBUCKET - 1; b++) {
+	    count += __atomic_load_n(&h->bucket[b], __ATOMIC_RELAXED);
+	    fprintf(fp, "%s_%s_seconds_bucket", d->prefix, name);
+	    put_labels(fp, d);
+	    fprintf(fp, ",le=\"%g\"} %lu\n", (2UL << b) / 1e9, count);
+	}
+	count += __atomic_load_n(&h->bucket[STATS_NBUCKET - 1], __ATOMIC_RELAXED);
+	fprintf(fp, "%s_%s_seconds_bucket", d->prefix, name);
+	put_labels(fp, d);
+	fprintf(fp, ",le=\"+Inf\"} %lu\n", count);
+	fprintf(fp, "%s_%s_seconds_sum", d->prefix, name);
+	put_labels(fp, d);
+	fprintf(fp, "} %.9f\n", __atomic_load_n(&h->sum, __ATOMIC_RELAXED) / 1e9);
+	fprintf(fp, "%s_%s_seconds_count", d->prefix, name);
+	put_labels(fp, d);
+	fprintf(fp, "} %lu\n", count);
+    }
+}
+
+bool stats_write(FILE *fp, const char *fmt, const struct stats_desc *d)
+{
+    if (fmt == NULL || strcmp(fmt, "json") == 0)
+	write_json(fp, d);
+    else if (strcmp(fmt, "prometheus") == 0)
+	write_prometheus(fp, d);
+    else {
+	ERROR("unknown format: %s", fmt);
+	return false;
+    }
+    return !ferror(fp);
+}
+
+// The lines of a Prometheus text file, to be merged.
+struct lines {
+    int n, alloc;
+    char **v;
+};
+
+static
+bool lines_insert(struct lines *l, int i, char *line)
+{
+    if (line == NULL)
+	return false;
+    if (l->n == l->alloc) {
+	int alloc = l->alloc ? 2 * l->alloc : 64;
+	char **v = realloc(l->v, alloc * sizeof(*v));
+	if (v == NULL) {
+	    free(line);
+	    return false;
+	}
+	l->v = v;
+	l->alloc = alloc;
+    }
+    memmove(l->v + i + 1, l->v + i, (l->n - i) * sizeof(*l->v));
+    l->v[i] = line;
+    l->n++;
+    return true;
+}
+
+static
+void lines_free(struct lines *l)
+{
+    for (int i = 0; i < l->n; i++)
+	free(l->v[i]);
+    free(l->v);
+}
+
+// Add the value of a sample line to another one with the same series;
+// counters are integers, and sums are in seconds.
+static
+char *add_sample(const char *line, size_t keylen, const char *val1, const char *val2)
+{
+    char *out = NULL;
+    int rc;
+    if (strchr(val1, '.') || strchr(val2, '.'))
+	rc = asprintf(&out, "%.*s %.9f", (int) keylen, line,
+		strtod(val1, NULL) + strtod(val2, NULL));
+    else
+	rc = asprintf(&out, "%.*s %lu", (int) keylen, line,
+		strtoul(val1, NULL, 10) + strtoul(val2, NULL, 10));
+    return rc < 0 ? NULL : out;
+}
+
+// Merge the new record into the lines of the file: the samples of the
+// same series are added up, and the others go to the end of the metric
+// family, which must be contiguous.
+static
+bool merge_prometheus(struct lines *l, char *buf)
+{
+    int start = l->n, end = l->n;
+    char *save;
+    for (char *line = strtok_r(buf, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+	if (line[0] == '#') {
+	    for (start = 0; start < l->n; start++)
+		if (strcmp(l->v[start], line) == 0)
+		    break;
+	    if (start == l->n && !lines_insert(l, l->n, strdup(line)))
+		return false;
+	    for (end = start + 1; end < l->n && l->v[end][0] != '#'; end++)
+		;
+	    continue;
+	}
+	const char *val = strrchr(line, ' ');
+	if (val == NULL)
+	    continue;
+	size_t keylen = val++ - line;
+	int i;
+	for (i = start; i < end; i++)
+	    if (strncmp(l->v[i], line, keylen + 1) == 0)
+		break;
+	if (i < end) {
+	    char *sum = add_sample(line, keylen, l->v[i] + keylen + 1, val);
+	    if (sum == NULL)
+		return false;
+	    free(l->v[i]);
+	    l->v[i] = sum;
+	}
+	else if (lines_insert(l, end, strdup(line)))
+	    end++;
+	else
+	    return false;
+    }
+    return true;
+}
+
+// A Prometheus text file cannot declare a metric twice, so records are
+// not appended: they are added up into the file, which is rewritten
+// and renamed into place.  The file is locked while it is merged; if
+// another process has renamed it meanwhile, the new one is locked.
+static
+void dump_prometheus(const char *fname, const char *buf, size_t size)
+{
+    char *tmp = NULL;
+    if (asprintf(&tmp, "%s.tmp", fname) < 0) {
+	ERROR("asprintf: %m");
+	return;
+    }
+    int fd;
+    while (1) {
+	fd = open(fname, O_RDONLY | O_CREAT | O_CLOEXEC, 0666);
+	if (fd < 0) {
+	    ERROR("%s: %m", fname);
+	    free(tmp);
+	    return;
+	}
+	if (flock(fd, LOCK_EX) < 0)
+	    ERROR("%s: LOCK_EX: %m", fname);
+	struct stat st1, st2;
+	if (fstat(fd, &st1) < 0 || stat(fname, &st2) < 0 ||
+		(st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino))
+	    break;
+	close(fd);
+    }
+    struct lines l = { 0 };
+    FILE *fp = fdopen(fd, "r");
+    if (fp == NULL) {
+	ERROR("%s: fdopen: %m", fname);
+	close(fd);
+	free(tmp);
+	return;
+    }
+    char *line = NULL;
+    size_t linesize = 0;
+    ssize_t len;
+    bool ok = true;
+    while (ok && (len = getline(&line, &linesize, fp)) > 0) {
+	if (line[len-1] == '\n')
+	    line[--len] = '\0';
+	ok = len == 0 || lines_insert(&l, l.n, strdup(line));
+    }
+    free(line);
+    char *rec = strndup(buf, size);
+    ok = ok && rec && merge_prometheus(&l, rec);
+    free(rec);
+    if (!ok) {
+	ERROR("%s: cannot merge stats", fname);
+	goto out;
+    }
+    FILE *out = fopen(tmp, "we");
+    if (out == NULL) {
+	ERROR("%s: %m", tmp);
+	goto out;
+    }
+    for (int i = 0; i < l.n; i++)
+	fprintf(out, "%s\n", l.v[i]);
+    if (fclose(out)) {
+	ERROR("%s: write: %m", tmp);
+	unlink(tmp);
+	goto out;
+    }
+    if (rename(tmp, fname) < 0) {
+	ERROR("%s: rename: %m", tmp);
+	unlink(tmp);
+    }
+out:
+    // the lock goes with the file, after the rename
+    fclose(fp);
+    lines_free(&l);
+    free(tmp);
+}
+
+void stats_dump(const struct stats_desc *d)
+{
+    const char *fname = getenv("RPMCACHE_STATS");
+    if (fname == NULL || *fname == '\0')
+	return;
+    size_t len = strlen(fname);
+    bool prom = len > 5 && strcmp(fname + len - 5, ".prom") == 0;
+
+    // the record is formatted in memory, and then appended with
+    // a single write, so that records from a few processes do not mix
+    char *buf = NULL;
+    size_t size = 0;
+    FILE *fp = open_memstream(&buf, &size);
+    if (fp == NULL) {
+	ERROR("open_memstream: %m");
+	return;
+    }
+    bool ok = stats_write(fp, prom ? "prometheus" : "json", d);
+    if (fclose(fp) || !ok) {
+	ERROR("cannot format stats");
+	free(buf);
+	return;
+    }
+    if (prom) {
+	dump_prometheus(fname, buf, size);
+	free(buf);
+	return;
+    }
+    int fd = open(fname, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+    if (fd < 0) {
+	ERROR("%s: %m", fname);
+	free(buf);
+	return;
+    }
+    if (flock(fd, LOCK_EX) < 0)
+	ERROR("%s: LOCK_EX: %m", fname);
+    ssize_t n = write(fd, buf, size);
+    if (n != (ssize_t) size)
+	ERROR("%s: write: %m", fname);
+    close(fd);
+    free(buf);
+}
+
+// ex:ts=8 sts=4 sw=4 noet
@@ -0,0 +1,70 @@
+// Operation counters and latency histograms, cheap enough to be always
+// on: counters are bumped with relaxed atomics, and latencies go into
+// buckets by the power of 2 of nanoseconds.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+// Bucket i counts latencies in [2^i, 2^(i+1)) ns; the last one takes
+// everything from 2^39 ns, which is about 9 minutes.
+#define STATS_NBUCKET 40
+
+struct stats_hist {
+    unsigned long count;
+    unsigned long sum;	// ns
+    unsigned long bucket[STATS_NBUCKET];
+};
+
+static inline
+uint64_t stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline
+void stats_add(unsigned long *cnt, unsigned long n)
+{
+    __atomic_add_fetch(cnt, n, __ATOMIC_RELAXED);
+}
+
+// Record the time elapsed since t0, as returned by stats_now.
+static inline
+void stats_time(struct stats_hist *h, uint64_t t0)
+{
+    uint64_t ns = stats_now() - t0;
+    int b = ns ? 63 - __builtin_clzll(ns) : 0;
+    if (b >= STATS_NBUCKET)
+	b = STATS_NBUCKET - 1;
+    stats_add(&h->count, 1);
+    stats_add(&h->sum, ns);
+    stats_add(&h->bucket[b], 1);
+}
+
+// What to write: the metrics are named PREFIX_NAME, and labelled
+// with label="value"; JSON records also have the pid.
+struct stats_desc {
+    const char *prefix;
+    const char *label, *value;
+    int ncnt;
+    const char *const *cntname;
+    const unsigned long *cnt;
+    int nhist;
+    const char *const *histname;
+    const struct stats_hist *hist;
+};
+
+#pragma GCC visibility push(hidden)
+
+// The format is "json" (a single line, the default) or "prometheus".
+bool stats_write(FILE *fp, const char *fmt, const struct stats_desc *d);
+
+// If RPMCACHE_STATS is set, append the stats to the file it names, as
+// JSON lines.  If the name ends with ".prom", the stats are rather added
+// up into the file, in Prometheus text format.
+void stats_dump(const struct stats_desc *d);
+
+#pragma GCC visibility pop
@@ -0,0 +1,65 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "cache.h"
+
+// Borrow and release empty, small and large values; run by "make check".
+
+static int nfail;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+	    fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+	    nfail++; \
+	} \
+    } while (0)
+
+static void check_borrow(struct cache *cache, const char *key, const char *val, int valsize)
+{
+    cache_put(cache, key, strlen(key), val, valsize);
+    struct cache_val v;
+    memset(&v, 0xa5, sizeof v);
+    CHECK(cache_borrow(cache, key, strlen(key), &v));
+    CHECK(v.valsize == valsize);
+    if (valsize == 0)
+	CHECK(v.val == NULL);
+    else
+	CHECK(v.val && memcmp(v.val, val, valsize) == 0);
+    cache_release(&v);
+    CHECK(v.val == NULL && v.priv == NULL);
+}
+
+int main(void)
+{
+    char dir[] = "/tmp/test-borrow.XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+	perror("mkdtemp");
+	return 1;
+    }
+    struct cache *cache = cache_open(dir);
+    if (cache == NULL)
+	return 1;
+    check_borrow(cache, "empty", NULL, 0);
+    check_borrow(cache, "small", "value", 5);
+    // large values go to the filesystem
+    int bigsize = 1 << 20;
+    char *big = malloc(bigsize);
+    if (big == NULL)
+	return 1;
+    for (int i = 0; i < bigsize; i++)
+	big[i] = i * 7919 >> 8;
+    check_borrow(cache, "big", big, bigsize);
+    free(big);
+    cache_close(cache);
+    char cmd[sizeof dir + 16];
+    snprintf(cmd, sizeof cmd, "rm -rf %s", dir);
+    if (system(cmd))
+	fprintf(stderr, "cannot remove %s\n", dir);
+    return nfail ? 1 : 0;
+}
+
+// ex: set ts=8 sts=4 sw=4 noet:
@@ -0,0 +1,44 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "cache.h"
+
+int main(int argc, const char *argv[])
+{
+    if (argc < 2) {
+  usage:
+      fprintf(stderr, "Usage: %s [-s SIZE] DIR...\n",
+	      program_invocation_short_name);
+      return 2;
+    }
+    int dictsize = 0;
+    int i = 1;
+    if (strcmp(argv[i], "-s") == 0) {
+	if (argc < 4)
+	    goto usage;
+	dictsize = atoi(argv[i+1]);
+	if (dictsize < 1)
+	    goto usage;
+	i += 2;
+    }
+    int rc = 0;
+    for (; i < argc; i++) {
+	const char *dir = argv[i];
+	struct cache *cache = cache_open(dir);
+	if (!cache) {
+	    // warning issued by the library
+	    rc = 1;
+	    continue;
+	}
+	if (!cache_train(cache, dictsize))
+	    rc = 1;
+	cache_close(cache);
+    }
+    return rc;
+}
+
+// ex: set ts=8 sts=4 sw=4 noet: